@@ -0,0 +1,504 @@
+// Simulated SAM at the other end of the SPI link
+
+#include "FakeSamTransport.h"
+#include "SPITransaction.h"
+#include "Config.h"
+#include "Crc32.h"
+
+using namespace SPITransaction;
+
+const uint32_t headerDwords = 5;
+const uint32_t lastFragment = 0x80000000;
+const uint32_t packetNumberMask = 0x0000FF00;
+const size_t maxSentPackets = 64;             // how far back a NAK can make us go
+
+FakeSamTransport::FakeSamTransport(const Options& o) : opts(o), dataLength(maxSpiFileData)
+{
+}
+
+void FakeSamTransport::Init()
+{
+  frequency = spiFrequency;
+  if (opts.spiDataLength != 0)
+  {
+    QueueInfo(ttSetSpiDataLength, opts.spiDataLength);
+  }
+  if (opts.enableCrc)
+  {
+    QueueInfo(ttEnableCrc, 0);
+    crcRequested = true;
+  }
+}
+
+bool FakeSamTransport::IsSamReady()
+{
+  return ready;
+}
+
+void FakeSamTransport::OnSamReady(ReadyCallback callback)
+{
+  readyCallback = callback;
+}
+
+void FakeSamTransport::RequestTransfer(bool wanted)
+{
+  espWantsTransfer = wanted;
+}
+
+void FakeSamTransport::SetFrequency(uint32_t f)
+{
+  if (frequency == spiFrequencyWithCrc && f == spiFrequency)
+  {
+    ++stats.frequencyDrops;
+  }
+  frequency = f;
+}
+
+bool FakeSamTransport::SettingsAgreed() const
+{
+  for (const Packet& p : outQueue)
+  {
+    if ((p.trType & 0xFF000000) == trTypeInfo)
+    {
+      return false;
+    }
+  }
+  return !dataLengthPending && (!crcRequested || CrcInUse());
+}
+
+uint64_t FakeSamTransport::Poll()
+{
+  if (inTransfer)
+  {
+    return UINT64_MAX;
+  }
+
+  const uint64_t now = HostClock::Now();
+  uint64_t next = UINT64_MAX;
+  if (!ready)
+  {
+    if (now < turnaroundEnd)
+    {
+      next = turnaroundEnd;
+    }
+    else
+    {
+      bool wanted = espWantsTransfer || nakPending;
+      if (!wanted && !outQueue.empty())
+      {
+        if (CanSend(outQueue.front()))
+        {
+          wanted = true;
+        }
+        else if (!dataLengthPending)
+        {
+          next = outQueue.front().notBefore;
+        }
+      }
+      if (wanted)
+      {
+        ready = true;
+        readyTime = now;
+        callbackDue = true;
+      }
+    }
+  }
+
+  if (ready && callbackDue)
+  {
+    const uint64_t due = readyTime + opts.taskLatencyNanos;
+    if (now >= due)
+    {
+      callbackDue = false;
+      if (readyCallback != nullptr)
+      {
+        readyCallback((uint32_t)(readyTime/1000));
+      }
+      return HostClock::Now();            // the callback may have run a transaction, after which there is more to do
+    }
+    else
+    {
+      next = std::min(next, due);
+    }
+  }
+  return next;
+}
+
+bool FakeSamTransport::CanSend(const Packet& p) const
+{
+  return !dataLengthPending && HostClock::Now() >= p.notBefore;
+}
+
+// Put a packet on the wire for the first time, numbering it and adding its CRC if CRCs are in use
+void FakeSamTransport::Build(Packet& p)
+{
+  const bool withCrc = CrcInUse();
+  uint32_t trType = p.trType;
+  if (withCrc)
+  {
+    lastPacketNumber = nextPacketNumber;
+    nextPacketNumber = (nextPacketNumber + 1) & 0xFF;
+    trType = (trType & ~packetNumberMask) | (lastPacketNumber << 8);
+  }
+  const uint32_t length = p.data.size();
+  p.words.assign(headerDwords + (length + 3)/4 + ((withCrc) ? 1 : 0), 0);
+  p.words[0] = trType;
+  p.words[1] = p.seq;
+  p.words[2] = 0;
+  p.words[3] = p.fragment;
+  p.words[4] = length;
+  if (length != 0)
+  {
+    memcpy(&p.words[headerDwords], p.data.data(), length);
+  }
+  if (withCrc)
+  {
+    Crc32 crc;
+    crc.Update(p.words.data(), (p.words.size() - 1) * sizeof(uint32_t));
+    p.words.back() = crc.Get();
+  }
+  p.built = true;
+}
+
+void FakeSamTransport::QueueInfo(uint32_t tt, uint32_t value)
+{
+  Packet p;
+  p.trType = trTypeInfo | tt;
+  p.seq = 0;
+  p.fragment = lastFragment;
+  if (tt != ttEnableCrc)
+  {
+    p.data.resize(sizeof(value));
+    memcpy(p.data.data(), &value, sizeof(value));
+  }
+  p.notBefore = 0;
+  p.built = false;
+  outQueue.push_back(p);
+}
+
+// Queue the fragments of the reply to a rr_ request. The first one starts with the return code and the content length.
+void FakeSamTransport::QueueReply(const Request& req)
+{
+  const uint64_t notBefore = HostClock::Now() + opts.replyNanos;
+  uint32_t sent = 0;
+  uint32_t fragment = 0;
+  do
+  {
+    Packet p;
+    p.trType = trTypeResponse | ttRr;
+    p.seq = (opts.returnSeq) ? req.seq : 0;
+    p.notBefore = notBefore;
+    p.built = false;
+    if (fragment == 0)
+    {
+      const uint32_t header[2] = { 200 | rcJson, opts.replyLength };
+      p.data.resize(sizeof(header));
+      memcpy(p.data.data(), header, sizeof(header));
+    }
+    const uint32_t n = std::min<uint32_t>(opts.replyLength - sent, dataLength - p.data.size());
+    for (uint32_t i = 0; i < n; ++i)
+    {
+      p.data.push_back(ReplyByte(req.seq, sent + i));
+    }
+    sent += n;
+    p.fragment = fragment | ((sent == opts.replyLength) ? lastFragment : 0);
+    outQueue.push_back(p);
+    ++fragment;
+    ++stats.replyFragments;
+  } while (sent < opts.replyLength);
+}
+
+void FakeSamTransport::BeginTransfer()
+{
+  inTransfer = true;
+  ready = false;
+  callbackDue = false;
+  transferStart = HostClock::Now();
+  rxWords.clear();
+  txIndex = 0;
+  txIsPacket = false;
+  if (nakPending)
+  {
+    // NAKs go ahead of everything else. They aren't numbered in sequence, because they are never sent again.
+    Packet nak;
+    nak.trType = trTypeInfo | ttSamNak;
+    nak.seq = 0;
+    nak.fragment = lastFragment;
+    nak.data.resize(sizeof(uint32_t));
+    memcpy(nak.data.data(), &nakNumber, sizeof(nakNumber));
+    const uint32_t savedNext = nextPacketNumber;
+    nextPacketNumber = lastPacketNumber;
+    Build(nak);
+    nextPacketNumber = savedNext;
+    txWords = nak.words;
+    nakPending = false;
+  }
+  else if (!outQueue.empty() && CanSend(outQueue.front()))
+  {
+    Packet& p = outQueue.front();
+    if (!p.built)
+    {
+      Build(p);
+    }
+    else
+    {
+      ++stats.resends;
+    }
+    txWords = p.words;
+    txIsPacket = true;
+  }
+  else
+  {
+    txWords.assign(headerDwords, 0);
+  }
+
+  // Noise on the link at the higher clock speed. A lost NAK is only recovered by the request it belonged to timing out, which isn't simulated,
+  // so NAKs always get through.
+  corruptRx = false;
+  const uint32_t txNumber = (txWords[0] & packetNumberMask) >> 8;
+  if (stats.corruptions < opts.corruptRepeatedly && txIsPacket && CrcInUse() && frequency == spiFrequencyWithCrc && txNumber != 1
+      && (stats.corruptions == 0 || txNumber == corruptNumber))
+  {
+    ++stats.corruptions;
+    corruptNumber = txNumber;
+    txWords.back() ^= 1;                  // the CRC, so that the ESP sees a whole packet that fails it
+  }
+  else if (opts.corruptOneIn != 0 && espCrc && CrcInUse() && frequency == spiFrequencyWithCrc && Random() % opts.corruptOneIn == 0)
+  {
+    ++stats.corruptions;
+    if (Random() & 1)
+    {
+      corruptRx = true;
+    }
+    else if ((txWords[0] & 0xFF0000FF) != (trTypeInfo | ttSamNak))
+    {
+      txWords[Random() % txWords.size()] ^= 1u << (Random() % 32);
+    }
+  }
+  HostClock::Advance(opts.transferOverheadNanos);
+}
+
+void FakeSamTransport::TransferDwords(uint32_t *out, uint32_t *in, uint32_t numDwords)
+{
+  for (uint32_t i = 0; i < numDwords; ++i)
+  {
+    if (out != nullptr)
+    {
+      rxWords.push_back(out[i]);
+    }
+    const uint32_t w = (txIndex < txWords.size()) ? txWords[txIndex] : 0;
+    ++txIndex;
+    if (in != nullptr)
+    {
+      in[i] = w;
+    }
+  }
+  stats.dwords += numDwords;
+  HostClock::Advance((uint64_t)numDwords * 32 * 1000000000u / frequency);
+}
+
+void FakeSamTransport::WriteDwords(uint32_t *out, uint32_t numDwords)
+{
+  TransferDwords(out, nullptr, numDwords);
+}
+
+void FakeSamTransport::EndTransfer()
+{
+  const uint64_t now = HostClock::Now();
+  inTransfer = false;
+  ++transactions;
+  ++stats.transactions;
+  stats.busyNanos += now - transferStart;
+
+  if (txIsPacket)
+  {
+    Packet& p = outQueue.front();
+    if ((p.trType & 0xFF0000FF) == (trTypeInfo | ttSetSpiDataLength))
+    {
+      dataLengthPending = true;           // send nothing more until the ESP has changed its buffers
+    }
+    if ((p.words[0] & packetNumberMask) != 0 || p.words.size() > headerDwords + (p.data.size() + 3)/4)
+    {
+      sentPackets.push_back(p);           // it has a CRC, so the ESP may NAK it
+      if (sentPackets.size() > maxSentPackets)
+      {
+        sentPackets.pop_front();
+      }
+    }
+    outQueue.pop_front();
+  }
+
+  if (corruptRx && !rxWords.empty() && (rxWords[0] & 0xFF0000FF) != (trTypeInfo | ttNak))
+  {
+    rxWords[Random() % rxWords.size()] ^= 1u << (Random() % 32);
+  }
+  ReceivePacket(rxWords);
+  turnaroundEnd = now + opts.turnaroundNanos;
+}
+
+void FakeSamTransport::SendNak(uint32_t packetNumber)
+{
+  if (!nakPending)
+  {
+    nakPending = true;
+    nakNumber = packetNumber;
+  }
+}
+
+// The ESP says that a packet from us was corrupt. Send it again, and the ones we sent after it, because the ESP drops those until it has it.
+void FakeSamTransport::ResendFrom(uint32_t packetNumber)
+{
+  for (size_t i = 0; i < sentPackets.size(); ++i)
+  {
+    if (((sentPackets[i].words[0] & packetNumberMask) >> 8) == packetNumber)
+    {
+      for (size_t j = sentPackets.size(); j > i; --j)
+      {
+        outQueue.push_front(sentPackets[j - 1]);
+      }
+      sentPackets.erase(sentPackets.begin() + i, sentPackets.end());
+      return;
+    }
+  }
+}
+
+uint32_t FakeSamTransport::Random()
+{
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+void FakeSamTransport::ReceivePacket(const std::vector<uint32_t>& words)
+{
+  if (words.size() < headerDwords || (words[0] & 0xFF000000) == 0)
+  {
+    return;                               // the ESP had nothing to send
+  }
+
+  const uint32_t trType = words[0];
+  const uint32_t length = words[4];
+  const uint32_t opcode = trType & 0xFF0000FF;
+  const bool hasCrc = espCrc || opcode == (trTypeInfo | ttCrcEnabled);
+  const size_t dataDwords = (length + 3)/4;
+  bool good = length <= dataLength && words.size() >= headerDwords + dataDwords + ((hasCrc) ? 1 : 0);
+  if (good && hasCrc)
+  {
+    Crc32 crc;
+    crc.Update(words.data(), (headerDwords + dataDwords) * sizeof(uint32_t));
+    good = crc.Get() == words[headerDwords + dataDwords];
+  }
+  if (!good)
+  {
+    ++stats.badPackets;
+    if (espCrc)
+    {
+      SendNak((espNumberKnown) ? expectedEspNumber : (trType & packetNumberMask) >> 8);
+    }
+    return;
+  }
+
+  // Packets with CRCs are numbered in sequence, apart from NAKs. Drop any that we already have, and any that come after one we have NAKed until it arrives.
+  if (hasCrc && opcode != (trTypeInfo | ttNak))
+  {
+    const uint32_t number = (trType & packetNumberMask) >> 8;
+    if (espNumberKnown)
+    {
+      const int8_t ahead = (int8_t)(number - expectedEspNumber);
+      if (ahead < 0)
+      {
+        return;
+      }
+      if (ahead > 0)
+      {
+        SendNak(expectedEspNumber);
+        return;
+      }
+    }
+    espNumberKnown = true;
+    expectedEspNumber = (number + 1) & 0xFF;
+  }
+
+  HandlePacket(trType, words[1], words[2], words[3], reinterpret_cast<const uint8_t*>(&words[headerDwords]), length);
+}
+
+void FakeSamTransport::HandlePacket(uint32_t trType, uint32_t seq, uint32_t ip, uint32_t fragment, const uint8_t *data, uint32_t length)
+{
+  uint32_t value = 0;
+  if (length >= sizeof(value))
+  {
+    memcpy(&value, data, sizeof(value));
+  }
+
+  switch (trType & 0xFF0000FF)
+  {
+  case trTypeRequest | ttRr:
+    {
+      const bool isLast = (fragment & lastFragment) != 0;
+      fragment &= ~lastFragment;
+      size_t i = 0;
+      if (fragment == 0)
+      {
+        requests.push_back(Request{seq, ip, 1, 0});
+        i = requests.size() - 1;
+      }
+      else
+      {
+        while (i < requests.size() && requests[i].seq != seq)
+        {
+          ++i;
+        }
+        if (i == requests.size())
+        {
+          ++stats.postdataErrors;       // postdata for a request we haven't got
+          return;
+        }
+        Request& req = requests[i];
+        bool ok = fragment == req.nextFragment;
+        for (uint32_t j = 0; ok && j < length; ++j)
+        {
+          ok = data[j] == PostdataByte(seq, req.postdataReceived + j);
+        }
+        if (ok)
+        {
+          stats.postdataBytes += length;
+        }
+        else
+        {
+          ++stats.postdataErrors;
+        }
+        req.postdataReceived += length;
+        req.nextFragment = fragment + 1;
+      }
+      if (isLast)
+      {
+        ++stats.requests;
+        QueueReply(requests[i]);
+        requests.erase(requests.begin() + i);
+      }
+    }
+    break;
+
+  case trTypeInfo | ttSpiDataLengthSet:
+    dataLength = value;
+    dataLengthPending = false;
+    break;
+
+  case trTypeInfo | ttCrcEnabled:
+    // The ESP adds CRCs from this packet on. It checks ours from the transaction after next, once it knows that this one wasn't NAKed.
+    espCrc = true;
+    samCrcFrom = transactions + 1;
+    break;
+
+  case trTypeInfo | ttNak:
+    ++stats.naksReceived;
+    ResendFrom(value);
+    break;
+
+  default:
+    break;
+  }
+}
+
+// End
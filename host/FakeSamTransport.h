@@ -0,0 +1,153 @@
+// Simulated SAM at the other end of the SPI link, so that SPITransaction can be run and measured on a host.
+//
+// The SAM speaks the packet protocol of RepRapFirmwareWiFi: trTypeRequest/trTypeResponse/trTypeInfo framing, fragment numbering,
+// the ttSetSpiDataLength and ttEnableCrc negotiations, and packet numbers and NAKs once CRCs are in use.
+// It answers each rr_ request, once the last fragment of its postdata has arrived, with a JSON reply of a set length.
+// Postdata and reply bodies follow a pattern that depends on the request's seq, so that both ends can check what they get.
+//
+// Time is simulated. A transfer moves the host clock on by the time its dwords take at the current SPI clock frequency,
+// and after each transaction the SAM takes a while before it can signal that it is ready for the next one.
+// Bits can be flipped on the link in either direction, to test the recovery of corrupt packets.
+
+#ifndef _FAKESAMTRANSPORT_H_INCLUDED
+#define _FAKESAMTRANSPORT_H_INCLUDED
+
+#include "SPITransport.h"
+#include <deque>
+#include <vector>
+
+class FakeSamTransport : public SPITransport
+{
+public:
+  struct Options
+  {
+    uint32_t turnaroundNanos = 20000;         // time the SAM takes after a transaction before it can start another
+    uint32_t transferOverheadNanos = 1000;    // time a transaction takes on top of clocking its dwords, for SS and the FIFO loads
+    uint32_t taskLatencyNanos = 5000;         // time from the SAM signalling that it is ready to our ready callback being run
+    uint32_t replyNanos = 100000;             // time the SAM takes to start replying to a rr_ request
+    uint32_t replyLength = 600;               // bytes of body in each rr_ reply
+    bool returnSeq = true;                    // put the seq of the request in each reply fragment, else 0 as older firmware does
+    uint32_t spiDataLength = 0;               // data length to ask for with ttSetSpiDataLength, or 0 to keep the default
+    bool enableCrc = false;                   // ask for CRCs with ttEnableCrc
+    uint32_t corruptOneIn = 0;                // once CRCs are in use at the higher clock speed, flip a bit in one transaction in this many, or 0 for none
+    uint32_t corruptRepeatedly = 0;           // before that, spoil the CRC of one packet that the SAM sends at the higher clock speed this many times
+                                              // as it is sent again. Not its first numbered packet, because the ESP takes whichever one it gets first as the start.
+  };
+
+  struct Stats
+  {
+    uint64_t transactions = 0;
+    uint64_t dwords = 0;                      // dwords clocked, in both directions at once
+    uint64_t busyNanos = 0;                   // time spent in transactions
+    uint64_t requests = 0;                    // rr_ requests whose postdata has all arrived
+    uint64_t postdataBytes = 0;               // postdata that arrived in order
+    uint64_t postdataErrors = 0;              // postdata fragments that weren't what the client sent, or came out of order
+    uint64_t replyFragments = 0;              // rr_ reply fragments sent, not counting resends
+    uint64_t badPackets = 0;                  // packets from the ESP that failed their CRC, which we NAKed
+    uint64_t naksReceived = 0;                // NAKs from the ESP
+    uint64_t resends = 0;                     // packets sent again because of a NAK
+    uint64_t corruptions = 0;                 // transactions in which a bit was flipped
+    uint64_t frequencyDrops = 0;              // times the ESP went from the higher clock speed to the lower one
+  };
+
+  explicit FakeSamTransport(const Options& opts);
+
+  // SPITransport
+  void Init() override;
+  bool IsSamReady() override;
+  void OnSamReady(ReadyCallback callback) override;
+  void RequestTransfer(bool wanted) override;
+  void BeginTransfer() override;
+  void EndTransfer() override;
+  void TransferDwords(uint32_t *out, uint32_t *in, uint32_t numDwords) override;
+  void WriteDwords(uint32_t *out, uint32_t numDwords) override;
+  void SetFrequency(uint32_t frequency) override;
+
+  // Run the SAM up to the current time: signal that it is ready if it wants a transaction, and call the ready callback when it is due.
+  // Returns the time of the next thing the SAM will do without being prompted, or UINT64_MAX if there is none.
+  uint64_t Poll();
+
+  // Return true once the data length and CRCs the SAM asked for have been agreed
+  bool SettingsAgreed() const;
+
+  bool CrcInUse() const { return espCrc && transactions >= samCrcFrom; }
+  uint32_t Frequency() const { return frequency; }
+  uint32_t DataLength() const { return dataLength; }
+  const Stats& GetStats() const { return stats; }
+
+  // The bytes that the client sends as postdata and that the SAM sends as the reply body
+  static uint8_t PostdataByte(uint32_t seq, uint32_t offset) { return (uint8_t)(seq * 31 + offset * 7 + (offset >> 8)); }
+  static uint8_t ReplyByte(uint32_t seq, uint32_t offset) { return (uint8_t)(seq * 17 + offset * 3 + (offset >> 9) + 0x20); }
+
+private:
+  // A packet we are going to send. It is numbered and given its CRC when it is first sent, and keeps them if it is sent again.
+  struct Packet
+  {
+    uint32_t trType;
+    uint32_t seq;
+    uint32_t fragment;
+    std::vector<uint8_t> data;
+    uint64_t notBefore;                       // the SAM isn't ready to send it until this time
+    bool built;
+    std::vector<uint32_t> words;              // the packet as it goes on the wire, once built
+  };
+
+  struct Request
+  {
+    uint32_t seq;
+    uint32_t ip;
+    uint32_t nextFragment;
+    uint32_t postdataReceived;
+  };
+
+  void Build(Packet& p);
+  void QueueInfo(uint32_t tt, uint32_t value);
+  void QueueReply(const Request& req);
+  bool CanSend(const Packet& p) const;
+  void ReceivePacket(const std::vector<uint32_t>& words);
+  void HandlePacket(uint32_t trType, uint32_t seq, uint32_t ip, uint32_t fragment, const uint8_t *data, uint32_t length);
+  void SendNak(uint32_t packetNumber);
+  void ResendFrom(uint32_t packetNumber);
+  uint32_t Random();
+
+  Options opts;
+  Stats stats;
+  ReadyCallback readyCallback = nullptr;
+  uint32_t frequency = 0;
+
+  bool ready = false;                         // SAM TfrReady line
+  bool espWantsTransfer = false;              // ESP ReqTransfer line
+  bool inTransfer = false;
+  bool callbackDue = false;
+  uint64_t readyTime = 0;                     // when the SAM last became ready
+  uint64_t turnaroundEnd = 0;                 // when the SAM can next become ready
+  uint64_t transactions = 0;
+  uint64_t transferStart = 0;
+
+  std::vector<uint32_t> txWords;              // what we are sending in this transaction
+  size_t txIndex = 0;
+  bool txIsPacket = false;                    // true if txWords is outQueue.front() rather than an empty packet or a NAK
+  std::vector<uint32_t> rxWords;              // what the ESP has sent in this transaction
+  bool corruptRx = false;                     // flip a bit in what the ESP sends in this transaction
+  uint32_t randomState = 0x2545F491;
+
+  std::deque<Packet> outQueue;                // packets waiting to be sent, oldest first
+  std::deque<Packet> sentPackets;             // numbered packets we have sent, which the ESP may NAK
+  bool nakPending = false;
+  uint32_t nakNumber = 0;
+
+  std::vector<Request> requests;
+
+  uint32_t dataLength;                        // data length both ends have agreed
+  bool dataLengthPending = false;             // we have asked for a new data length and are waiting for the ESP to confirm it
+  bool crcRequested = false;
+  bool espCrc = false;                        // the ESP adds CRCs to its packets
+  uint64_t samCrcFrom = UINT64_MAX;           // first transaction in which we add CRCs to ours
+  uint32_t nextPacketNumber = 1;
+  uint32_t lastPacketNumber = 0;
+  bool espNumberKnown = false;
+  uint32_t expectedEspNumber = 0;             // packet number we expect on the next packet from the ESP
+  uint32_t corruptNumber = 0;                 // number of the packet that corruptRepeatedly spoils
+};
+
+#endif
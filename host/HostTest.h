@@ -0,0 +1,34 @@
+// Helpers for the host tests and benchmarks
+
+#ifndef _HOSTTEST_H_INCLUDED
+#define _HOSTTEST_H_INCLUDED
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Report a failed check without stopping, so that one run shows every failure
+static int checkFailures = 0;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { ++checkFailures; printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); } } while (0)
+
+// Run a test in a child process, because the transaction manager keeps its state in globals. Returns true if it passed.
+template<class F> bool RunIsolated(const char *name, F test)
+{
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid == 0)
+  {
+    test();
+    fflush(stdout);
+    _exit((checkFailures == 0) ? 0 : 1);
+  }
+  int status;
+  const bool passed = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  printf("%s %s\n", (passed) ? "pass" : "FAIL", name);
+  return passed;
+}
+
+#endif
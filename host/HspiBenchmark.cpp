@@ -0,0 +1,90 @@
+// Benchmark of the HSPI transfer functions on the cycle-counting model of the peripheral.
+// For each transfer size it compares transferDwords, which loads the FIFO, shifts a burst and unloads it before starting the next,
+// with transferDwordsStreamed, which loads and unloads one half of the FIFO while the other half is being shifted.
+
+#include "HspiModel.h"
+#include "HSPI.h"
+#include "Config.h"
+#include "HostTest.h"
+#include <vector>
+
+static const uint32_t sizes[] = { 5, 128, 512, 1024 };            // dwords: a header, and 512, 2048 and 4096 byte data parts
+
+struct Result
+{
+  HspiModel::Stats stats;
+  bool correct;
+};
+
+// Time one transfer and check that the right data went each way
+static Result Time(bool streamed, bool receive, uint32_t size)
+{
+  std::vector<uint32_t> out(size), samData(size), in(size);
+  for (uint32_t i = 0; i < size; ++i)
+  {
+    out[i] = 0xA5000000 | i;
+    samData[i] = 0x5A000000 | i;
+  }
+
+  HSPIClass hspi;
+  uint32_t *inPtr = (receive) ? in.data() : nullptr;
+  HspiModel::Begin(HspiModel::Costs(), samData.data(), inPtr, size);
+  if (streamed)
+  {
+    hspi.transferDwordsStreamed(out.data(), inPtr, size);
+  }
+  else
+  {
+    hspi.transferDwords(out.data(), inPtr, size);
+  }
+  Result r;
+  r.stats = HspiModel::End();
+  r.correct = HspiModel::Sent() == out && (!receive || in == samData);
+  return r;
+}
+
+static void Run(uint32_t frequency)
+{
+  HSPIClass hspi;
+  hspi.begin();
+  hspi.setBitOrder(MSBFIRST);
+  hspi.setDataMode(SPI_MODE1);
+  hspi.setFrequency(frequency);
+  const uint32_t clk = SPI1CLK;
+  const double clockMHz = (double)ESP8266_CLOCK / ((((clk >> 18) & 0x1FFF) + 1) * (((clk >> 12) & 0x3F) + 1)) / 1e6;
+  printf("SPI clock %.2f MHz\n", clockMHz);
+
+  for (bool receive : { true, false })
+  {
+    for (uint32_t size : sizes)
+    {
+      const Result perBurst = Time(false, receive, size);
+      const Result streamed = Time(true, receive, size);
+      for (const Result *r : { &perBurst, &streamed })
+      {
+        const double micros = r->stats.cycles / (ESP8266_CLOCK / 1e6);
+        printf("  %-8s %4u dwords %-9s %7llu cycles %7.1f us %6.2f MB/s  bus %5.1f%%  %3u bursts %5u register and %5u FIFO accesses\n",
+               (receive) ? "transfer" : "write", (unsigned int)size, (r == &streamed) ? "streamed" : "per burst",
+               (unsigned long long)r->stats.cycles, micros, size * 4 / micros, 100.0 * r->stats.shiftCycles / r->stats.cycles,
+               r->stats.bursts, r->stats.registerReads + r->stats.registerWrites, r->stats.fifoWrites + r->stats.fifoReads);
+        CHECK(r->correct);
+      }
+
+      // Above one burst, overlapping the FIFO accesses with shifting must save time
+      if (size > 16)
+      {
+        CHECK(streamed.stats.cycles < perBurst.stats.cycles);
+      }
+    }
+  }
+}
+
+int main()
+{
+  bool passed = true;
+  passed &= RunIsolated("hspi without crc", []() { Run(spiFrequency); });
+  passed &= RunIsolated("hspi with crc", []() { Run(spiFrequencyWithCrc); });
+  return (passed) ? 0 : 1;
+}
+
+// End
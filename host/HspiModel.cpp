@@ -0,0 +1,166 @@
+// Cycle-counting model of the ESP8266 HSPI peripheral
+
+#include "HspiModel.h"
+
+enum { regCmd, regC, regC1, regU, regU1, regClk, regGpMux, numRegisters };
+
+HostRegister SPI1CMD(regCmd), SPI1C(regC), SPI1C1(regC1), SPI1U(regU), SPI1U1(regU1), SPI1CLK(regClk), GPMUX(regGpMux);
+volatile uint32_t SPI1W[16];
+
+namespace HspiModel
+{
+  static Costs costs;
+  static Stats stats;
+  static uint32_t registers[numRegisters];
+  static uint64_t now = 0;                    // CPU cycles
+  static uint64_t startTime = 0;
+
+  static bool burstActive = false;
+  static uint64_t burstEnd = 0;
+  static uint32_t burstInHalf = 0;            // index of the first FIFO word the burst receives into
+  static uint32_t burstWords = 0;
+
+  static const uint32_t *samData = nullptr;
+  static size_t samIndex = 0;
+  static uint32_t *inBuffer = nullptr;
+  static size_t inLength = 0;
+  static size_t inFilled = 0;
+  static uint32_t fifoCopy[16];               // what the FIFO held at the last register access
+  static std::vector<uint32_t> sent;
+
+  // Charge for the FIFO accesses that the CPU has made since the last register access
+  static void CountFifoAccesses()
+  {
+    for (size_t i = 0; i < 16; ++i)
+    {
+      if (SPI1W[i] != fifoCopy[i])
+      {
+        fifoCopy[i] = SPI1W[i];
+        ++stats.fifoWrites;
+        now += costs.fifoWrite;
+      }
+    }
+    while (inFilled < inLength && inBuffer[inFilled] != sentinel)
+    {
+      ++inFilled;
+      ++stats.fifoReads;
+      now += costs.fifoRead;
+    }
+  }
+
+  // Finish the burst being shifted if its time is up, putting what the SAM sent into the FIFO
+  static void UpdateHardware()
+  {
+    if (burstActive && now >= burstEnd)
+    {
+      for (uint32_t i = 0; i < burstWords; ++i)
+      {
+        const uint32_t w = (samData != nullptr) ? samData[samIndex + i] : 0;
+        SPI1W[(burstInHalf + i) & 15] = w;
+        fifoCopy[(burstInHalf + i) & 15] = w;
+      }
+      samIndex += burstWords;
+      burstActive = false;
+    }
+  }
+
+  // Clock cycles per bit that SPI1CLK selects
+  static uint32_t CyclesPerBit()
+  {
+    const uint32_t clk = registers[regClk];
+    if (clk & 0x80000000)
+    {
+      return 1;
+    }
+    return (((clk >> 18) & 0x1FFF) + 1) * (((clk >> 12) & 0x3F) + 1);
+  }
+
+  static void StartBurst()
+  {
+    const uint32_t bits = ((registers[regU1] >> SPILMOSI) & SPIMMOSI) + 1;
+    const uint32_t outHalf = (registers[regU] & SPIUMOSIH) ? 8 : 0;
+    burstInHalf = (registers[regU] & SPIUMISOH) ? 8 : 0;
+    burstWords = (bits + 31)/32;
+    for (uint32_t i = 0; i < burstWords; ++i)
+    {
+      sent.push_back((uint32_t)SPI1W[(outHalf + i) & 15]);
+    }
+    const uint64_t shift = (uint64_t)bits * CyclesPerBit();
+    burstEnd = now + costs.burstStart + shift;
+    burstActive = true;
+    stats.shiftCycles += shift;
+    ++stats.bursts;
+  }
+
+  uint32_t Read(int id)
+  {
+    CountFifoAccesses();
+    now += costs.registerRead;
+    ++stats.registerReads;
+    UpdateHardware();
+    return (id == regCmd && burstActive) ? registers[id] | SPIBUSY : registers[id];
+  }
+
+  void Write(int id, uint32_t value)
+  {
+    CountFifoAccesses();
+    now += costs.registerWrite;
+    ++stats.registerWrites;
+    UpdateHardware();
+    if (id == regCmd)
+    {
+      if ((value & SPIBUSY) != 0 && !burstActive)
+      {
+        StartBurst();
+      }
+      value &= ~SPIBUSY;
+    }
+    registers[id] = value;
+  }
+
+  void Begin(const Costs& c, const uint32_t *sam, uint32_t *in, size_t numDwords)
+  {
+    costs = c;
+    stats = Stats();
+    startTime = now;
+    samData = sam;
+    samIndex = 0;
+    inBuffer = in;
+    inLength = (in != nullptr) ? numDwords : 0;
+    inFilled = 0;
+    for (size_t i = 0; i < inLength; ++i)
+    {
+      in[i] = sentinel;
+    }
+    for (size_t i = 0; i < 16; ++i)
+    {
+      SPI1W[i] = fifoCopy[i] = 0;
+    }
+    sent.clear();
+  }
+
+  const Stats& End()
+  {
+    CountFifoAccesses();
+    stats.cycles = now - startTime;
+    return stats;
+  }
+
+  const std::vector<uint32_t>& Sent()
+  {
+    return sent;
+  }
+}
+
+HostRegister::operator uint32_t() const
+{
+  return HspiModel::Read(id);
+}
+
+HostRegister& HostRegister::operator=(uint32_t value)
+{
+  HspiModel::Write(id, value);
+  return *this;
+}
+
+// End
@@ -0,0 +1,52 @@
+// Cycle-counting model of the ESP8266 HSPI peripheral, for timing the transfer functions in HSPI.cpp on a host.
+//
+// The CPU runs at 80MHz. Each register read or write costs a fixed number of cycles, and so does each dword moved between memory and the FIFO.
+// Setting SPIBUSY in SPI1CMD starts a burst of the length in SPI1U1, sent from the half of the FIFO that SPIUMOSIH selects and received into
+// the half that SPIUMISOH selects. SPIBUSY reads as set until the burst has been shifted at the rate that SPI1CLK sets.
+//
+// FIFO accesses can't be seen directly, so at each register access the model counts the FIFO words that have changed, and the words of the
+// receive buffer that have been filled in, since the last one. So the data sent must differ from what the FIFO held before, and the data received
+// must differ from the sentinel that Begin() fills the receive buffer with. The costs are estimates, so compare the paths rather than trusting
+// the absolute figures.
+
+#ifndef _HSPIMODEL_H_INCLUDED
+#define _HSPIMODEL_H_INCLUDED
+
+#include <Arduino.h>
+#include <vector>
+
+namespace HspiModel
+{
+  struct Costs
+  {
+    uint32_t registerRead = 8;      // a read of a peripheral register goes over the slow peripheral bus
+    uint32_t registerWrite = 4;
+    uint32_t fifoWrite = 4;         // load a dword from memory and store it in the FIFO, with the loop around it
+    uint32_t fifoRead = 10;         // read a dword from the FIFO and store it in memory, with the loop around it
+    uint32_t burstStart = 16;       // from SPIBUSY being set to the first clock edge
+  };
+
+  struct Stats
+  {
+    uint64_t cycles = 0;            // CPU cycles from Begin() to End()
+    uint64_t shiftCycles = 0;       // cycles during which data was being shifted
+    uint32_t bursts = 0;
+    uint32_t registerReads = 0;
+    uint32_t registerWrites = 0;
+    uint32_t fifoWrites = 0;
+    uint32_t fifoReads = 0;
+  };
+
+  const uint32_t sentinel = 0xDEADBEEF;
+
+  // Start timing a transfer. The SAM sends the dwords of samData. If in isn't null, it is where the transfer puts numDwords received dwords.
+  void Begin(const Costs& costs, const uint32_t *samData, uint32_t *in, size_t numDwords);
+
+  // Account for the FIFO accesses since the last register access and return the statistics of the transfer
+  const Stats& End();
+
+  // The dwords shifted out since Begin()
+  const std::vector<uint32_t>& Sent();
+}
+
+#endif
@@ -0,0 +1,112 @@
+// Benchmark of multipart/form-data uploads through RepRapWebServer.
+// It posts a form with a text field and a multi-MB file, arriving a TCP segment at a time, and reports the upload rate in host time.
+// The file is random data, or data full of partial delimiters, which makes the boundary search do the most work.
+
+#include "WebHarness.h"
+#include "HostTest.h"
+#include <chrono>
+#include <string>
+
+static const char boundary[] = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+const size_t fileSize = 8 * 1024 * 1024;
+
+// Random bytes from an xorshift generator
+static std::string RandomData(size_t length)
+{
+  std::string data(length, '\0');
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < length; ++i)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    data[i] = (char)x;
+  }
+  return data;
+}
+
+// Data made of ever longer prefixes of the delimiter, none of them complete
+static std::string NearMissData(size_t length)
+{
+  const std::string delimiter = std::string("\r\n--") + boundary;
+  std::string data;
+  for (size_t n = 1; data.size() < length; n = (n % (delimiter.size() - 1)) + 1)
+  {
+    data += delimiter.substr(0, n);
+    data += 'x';
+  }
+  data.resize(length);
+  return data;
+}
+
+static void Run(const std::string& file)
+{
+  RepRapWebServer server(80);
+  std::string received;
+  received.reserve(file.size());
+  uint32_t starts = 0, ends = 0, aborts = 0;
+  String field;
+  server.on("/upload", HTTP_POST,
+            [&server, &field]() { field = server.arg("comment"); server.send(200, "text/plain", ""); },
+            [&]()
+            {
+              HTTPUpload& upload = server.upload();
+              switch (upload.status)
+              {
+              case UPLOAD_FILE_START:
+                ++starts;
+                break;
+              case UPLOAD_FILE_WRITE:
+                received.append((const char*)upload.buf, upload.currentSize);
+                break;
+              case UPLOAD_FILE_END:
+                ++ends;
+                CHECK(upload.totalSize == file.size());
+                CHECK(strcmp(upload.filename, "test.gcode") == 0);
+                break;
+              case UPLOAD_FILE_ABORTED:
+                ++aborts;
+                break;
+              }
+            });
+  server.begin();
+
+  std::string body = std::string("--") + boundary + "\r\n"
+                     "Content-Disposition: form-data; name=\"comment\"\r\n\r\n"
+                     "first layer at 0.2mm\r\n"
+                     "--" + boundary + "\r\n"
+                     "Content-Disposition: form-data; name=\"file\"; filename=\"test.gcode\"\r\n"
+                     "Content-Type: application/octet-stream\r\n\r\n";
+  body += file;
+  body += std::string("\r\n--") + boundary + "--\r\n";
+
+  HostConnection& conn = *WiFiServer::Connect();
+  conn.Send("POST /upload HTTP/1.1\r\n"
+            "Host: 192.168.1.20\r\n"
+            "Content-Type: multipart/form-data; boundary=" + std::string(boundary) + "\r\n"
+            "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n");
+  conn.Send(body);
+
+  const auto start = std::chrono::steady_clock::now();
+  ServeAll(server, conn);
+  const auto end = std::chrono::steady_clock::now();
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  printf("%.1f MB in %.3f s, %.1f MB/s\n", file.size() / 1e6, seconds, file.size() / seconds / 1e6);
+
+  CHECK(starts == 1 && ends == 1 && aborts == 0);
+  CHECK(received == file);
+  CHECK(field == "first layer at 0.2mm");
+  CHECK(conn.output.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+  CHECK(conn.inputTaken == conn.input.size());
+}
+
+int main()
+{
+  bool passed = true;
+  passed &= RunIsolated("multipart random data", []() { Run(RandomData(fileSize)); });
+  passed &= RunIsolated("multipart partial delimiters", []() { Run(NearMissData(fileSize)); });
+  return (passed) ? 0 : 1;
+}
+
+// End
@@ -0,0 +1,120 @@
+// Benchmark of request parsing in RepRapWebServer.
+// It sends the requests that Duet Web Control makes while it polls a printer, with the headers a browser sends, over one persistent connection,
+// and reports the requests handled per second of host time and the heap allocations made per request. The handlers reply with a fixed JSON body,
+// so the figures are for reading, parsing and routing the request and building the response header.
+
+#include "WebHarness.h"
+#include "HostTest.h"
+#include <chrono>
+#include <string>
+
+static const char browserHeaders[] =
+  "Host: 192.168.1.20\r\n"
+  "Connection: keep-alive\r\n"
+  "Accept: application/json, text/plain, */*\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+  "Referer: http://192.168.1.20/\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+  "\r\n";
+
+// Request lines in the proportions that DWC sends them: mostly status polls, with the occasional reply fetch, G-code and file list
+static const char *const requestLines[] =
+{
+  "GET /rr_status?type=1 HTTP/1.1",
+  "GET /rr_status?type=1 HTTP/1.1",
+  "GET /rr_status?type=1 HTTP/1.1",
+  "GET /rr_status?type=3 HTTP/1.1",
+  "GET /rr_reply HTTP/1.1",
+  "GET /rr_gcode?gcode=G1%20X10.5%20Y20%20F6000 HTTP/1.1",
+  "GET /rr_status?type=1 HTTP/1.1",
+  "GET /rr_filelist?dir=0%3A%2Fgcodes&first=0 HTTP/1.1",
+  "GET /rr_status?type=2 HTTP/1.1",
+  "GET /rr_connect?password=reprap&time=2026-10-16T10%3A30%3A00 HTTP/1.1",
+};
+
+const size_t numRequestLines = sizeof(requestLines)/sizeof(requestLines[0]);
+const uint32_t rounds = 20000;
+
+static const char statusReply[] = "{\"status\":\"I\",\"coords\":{\"xyz\":[0.0,0.0,0.0]}}";
+
+struct Counts
+{
+  uint32_t handled = 0;
+  uint32_t argErrors = 0;
+};
+
+static void Run()
+{
+  RepRapWebServer server(80);
+  Counts counts;
+  const auto reply = [&server]() { server.send(200, sizeof(statusReply) - 1, F("application/json"), (const uint8_t*)statusReply, sizeof(statusReply) - 1, true); };
+  const auto expect = [&server, &counts](const char *name, const char *value)
+  {
+    const char *v = server.argValue(name);
+    if (v == NULL || strcmp(v, value) != 0)
+    {
+      ++counts.argErrors;
+    }
+  };
+  server.on("/rr_status", HTTP_GET, [&]() { ++counts.handled; counts.argErrors += (server.argValue("type") == NULL); reply(); });
+  server.on("/rr_reply", HTTP_GET, [&]() { ++counts.handled; reply(); });
+  server.on("/rr_gcode", HTTP_GET, [&]() { ++counts.handled; expect("gcode", "G1 X10.5 Y20 F6000"); reply(); });
+  server.on("/rr_filelist", HTTP_GET, [&]() { ++counts.handled; expect("dir", "0:/gcodes"); expect("first", "0"); reply(); });
+  server.on("/rr_connect", HTTP_GET, [&]() { ++counts.handled; expect("password", "reprap"); expect("time", "2026-10-16T10:30:00"); reply(); });
+  server.setKeepAlive(5000, 0xFFFFFFFF);
+  server.begin();
+
+  std::string batch;
+  for (const char *line : requestLines)
+  {
+    batch += line;
+    batch += "\r\n";
+    batch += browserHeaders;
+  }
+
+  HostConnection& conn = *WiFiServer::Connect();
+  conn.input.reserve(batch.size());
+  conn.output.reserve(1000 * numRequestLines);
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < rounds && conn.serverOpen; ++i)
+  {
+    conn.input.assign(batch);
+    conn.inputTaken = 0;
+    conn.output.clear();
+    allocations += ServeAll(server, conn);
+    bytes += batch.size();
+  }
+  const auto end = std::chrono::steady_clock::now();
+
+  // Every request of the last round got a response
+  size_t responses = 0;
+  for (size_t pos = 0; (pos = conn.output.find("HTTP/1.1 200 OK\r\n", pos)) != std::string::npos; ++pos)
+  {
+    ++responses;
+  }
+
+  // The allocation counter sees String allocations, so a count of zero means something
+  const uint64_t before = HostHeap::Allocations();
+  const String s("x");
+  CHECK(HostHeap::Allocations() == before + 1);
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  printf("%u requests, %.0f requests/s, %.1f MB/s of request heads, %.3f allocations per request\n",
+         counts.handled, counts.handled / seconds, bytes / seconds / 1e6, (double)allocations / counts.handled);
+
+  CHECK(conn.serverOpen);
+  CHECK(counts.handled == rounds * numRequestLines);
+  CHECK(counts.argErrors == 0);
+  CHECK(responses == numRequestLines);
+  CHECK(allocations == 0);
+}
+
+int main()
+{
+  return (RunIsolated("parse requests", Run)) ? 0 : 1;
+}
+
+// End
@@ -0,0 +1,180 @@
+// Stand-in for the rr_ request handling in RepRapWiFi.cpp
+
+#include "RrClient.h"
+#include "SPITransaction.h"
+
+using namespace SPITransaction;
+
+RrClient::RrClient(size_t m, bool h) : maxAtSam(m), holdReplies(h)
+{
+}
+
+void RrClient::Queue(uint32_t postLength)
+{
+  jobs.push_back(Job{nextSeq, postLength, 0, 1, false, 0, 0, 0, false});
+  nextSeq = (nextSeq == 0xFFFFFFFF) ? 1 : nextSeq + 1;
+}
+
+bool RrClient::Spin()
+{
+  bool didSomething = false;
+  if (held != nullptr)
+  {
+    ReleaseIncoming(held);
+    held = nullptr;
+    didSomething = true;
+  }
+
+  while (held == nullptr && DataReady())
+  {
+    if (!TakeReply())
+    {
+      IncomingDataTaken();
+    }
+    didSomething = true;
+  }
+
+  // Send another request if there is room at the SAM and no request there still has postdata to send
+  size_t numAtSam = 0;
+  Job *sendingPostdata = nullptr;
+  Job *next = nullptr;
+  for (Job& job : jobs)
+  {
+    if (job.sent)
+    {
+      ++numAtSam;
+      if (job.postLength != 0)
+      {
+        sendingPostdata = &job;
+      }
+    }
+    else if (next == nullptr)
+    {
+      next = &job;
+    }
+  }
+
+  if (numAtSam < maxAtSam && sendingPostdata == nullptr && next != nullptr)
+  {
+    char request[40];
+    const int length = snprintf(request, sizeof(request), "status?type=1&seq=%u", (unsigned int)next->seq);
+    if (ScheduleRequestMessage(trTypeRequest | ttRr, 0, next->seq, next->postLength == 0, request, length))
+    {
+      next->sent = true;
+      ++stats.requestsSent;
+      didSomething = true;
+      if (next->postLength != 0)
+      {
+        sendingPostdata = next;
+      }
+    }
+  }
+
+  // The network always has the next postdata ready, so fill a whole buffer at a time
+  if (sendingPostdata != nullptr)
+  {
+    Job& job = *sendingPostdata;
+    uint8_t *buf;
+    size_t len;
+    if (GetBufferAddress(&buf, len))
+    {
+      if (len > job.postLength)
+      {
+        len = job.postLength;
+      }
+      for (size_t i = 0; i < len; ++i)
+      {
+        buf[i] = FakeSamTransport::PostdataByte(job.seq, job.postSent + i);
+      }
+      job.postLength -= len;
+      job.postSent += len;
+      stats.postdataBytes += len;
+      SchedulePostdataMessage(trTypeRequest | ttRr, 0, job.seq, len, job.fragment, job.postLength == 0);
+      ++job.fragment;
+      didSomething = true;
+    }
+  }
+  return didSomething;
+}
+
+// If the incoming message is a reply to a rr_ request, check it and return true
+bool RrClient::TakeReply()
+{
+  if (GetOpcode() != (trTypeResponse | ttRr))
+  {
+    return false;
+  }
+
+  const uint32_t seq = GetSeq();
+  auto job = jobs.begin();
+  while (job != jobs.end() && !(job->sent && (seq == 0 || job->seq == seq)))
+  {
+    ++job;
+  }
+  if (job == jobs.end())
+  {
+    ++stats.replyErrors;
+    IncomingDataTaken();
+    return true;
+  }
+
+  size_t length;
+  const uint8_t *data = (const uint8_t*)GetData(length);
+  bool isLast;
+  const uint32_t fragment = GetFragment(isLast);
+  if (fragment != job->nextReplyFragment)
+  {
+    job->replyFailed = true;
+  }
+  job->nextReplyFragment = fragment + 1;
+  if (fragment == 0)
+  {
+    if (length < 8)
+    {
+      job->replyFailed = true;
+      length = 0;
+    }
+    else
+    {
+      job->replyFailed |= *(const uint32_t*)data != (200 | rcJson);
+      job->contentLength = *(const uint32_t*)(data + 4);
+      data += 8;
+      length -= 8;
+    }
+  }
+  for (size_t i = 0; i < length; ++i)
+  {
+    if (data[i] != FakeSamTransport::ReplyByte(job->seq, job->replyReceived + i))
+    {
+      job->replyFailed = true;
+      break;
+    }
+  }
+  job->replyReceived += length;
+  stats.replyBytes += length;
+
+  if (holdReplies)
+  {
+    held = HoldIncoming();
+  }
+  else
+  {
+    IncomingDataTaken();
+  }
+
+  if (isLast)
+  {
+    if (job->replyFailed || job->replyReceived != job->contentLength)
+    {
+      ++stats.replyErrors;
+    }
+    else
+    {
+      ++stats.repliesCompleted;
+    }
+    jobs.erase(job);
+  }
+  return true;
+}
+
+// End
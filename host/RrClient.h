@@ -0,0 +1,86 @@
+// Stand-in for the rr_ request handling in RepRapWiFi.cpp, for driving SPITransaction on a host.
+// It sends rr_ requests and their postdata in the order SpinRrJobs does, keeps up to a set number of them at the SAM,
+// and checks each reply against what FakeSamTransport sends.
+
+#ifndef _RRCLIENT_H_INCLUDED
+#define _RRCLIENT_H_INCLUDED
+
+#include "FakeSamTransport.h"
+#include "SPITransaction.h"
+#include <deque>
+
+class RrClient
+{
+public:
+  struct Stats
+  {
+    uint64_t requestsSent = 0;
+    uint64_t repliesCompleted = 0;          // replies that arrived whole and correct
+    uint64_t replyBytes = 0;                // reply body bytes received
+    uint64_t replyErrors = 0;               // replies that were out of order, the wrong length or had the wrong data, and replies to no request
+    uint64_t postdataBytes = 0;             // postdata handed to SPITransaction
+  };
+
+  // maxAtSam is how many requests may be at the SAM at once. If holdReplies is true, each reply fragment is held until the next loop, as HandleRrReply does.
+  RrClient(size_t maxAtSam, bool holdReplies);
+
+  // Queue a request with the given amount of postdata
+  void Queue(uint32_t postLength);
+
+  // Do the work that loop() would do for these requests, without waiting for anything. Returns true if anything was done.
+  bool Spin();
+
+  // Return true when every queued request has had its whole reply
+  bool Done() const { return jobs.empty(); }
+
+  const Stats& GetStats() const { return stats; }
+
+private:
+  struct Job
+  {
+    uint32_t seq;
+    uint32_t postLength;                    // postdata still to send
+    uint32_t postSent;
+    uint32_t fragment;                      // fragment number of the next postdata message
+    bool sent;
+    uint32_t nextReplyFragment;
+    uint32_t replyReceived;
+    uint32_t contentLength;
+    bool replyFailed;
+  };
+
+  bool TakeReply();
+
+  size_t maxAtSam;
+  bool holdReplies;
+  std::deque<Job> jobs;                     // oldest first
+  uint32_t nextSeq = 1;
+  SPITransaction::IncomingMessage held = nullptr;
+  Stats stats;
+};
+
+// Run the ESP side and the simulated SAM together until done() returns true. loop() runs every loopNanos, while the SAM's ready callback can start a
+// transaction in between. Returns false if time runs out first.
+template<class F> bool RunSimulation(FakeSamTransport& sam, RrClient& client, uint64_t loopNanos, uint64_t timeLimit, F done)
+{
+  uint64_t nextLoop = HostClock::Now();
+  while (!done())
+  {
+    const uint64_t now = HostClock::Now();
+    if (now > timeLimit)
+    {
+      return false;
+    }
+    if (now >= nextLoop)
+    {
+      client.Spin();
+      SPITransaction::DoTransaction();
+      nextLoop = HostClock::Now() + loopNanos;
+    }
+    const uint64_t next = sam.Poll();
+    HostClock::AdvanceTo(std::min(next, nextLoop));
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,143 @@
+// Benchmark of the number of TCP segments that rr_ replies take.
+// Each reply is sent the way HandleRrReply sends it: send() with the first fragment from the SAM, then sendContent() with the rest.
+// That gathers the response header and the body into as few segments as they fit in. For comparison, each reply is also sent with the header
+// and the body in separate writes, as the server used to. The TCP stand-in sends each write at once, as the firmware turns Nagle's algorithm off.
+
+#include "WebHarness.h"
+#include "HostTest.h"
+#include <string>
+#include <vector>
+
+struct Scenario
+{
+  const char *name;
+  std::vector<size_t> fragments;      // body bytes in each fragment from the SAM
+  bool lengthKnown;                   // false if the SAM doesn't know the length, so the reply is sent chunked
+};
+
+static const Scenario scenarios[] =
+{
+  { "status 60",              { 60 },               true },
+  { "status 600",             { 600 },              true },
+  { "status 1300",            { 1300 },             true },
+  { "reply 2040",             { 2040 },             true },
+  { "file list 2040+2048+900", { 2040, 2048, 900 }, true },
+  { "chunked 600+600",        { 600, 600 },         false },
+};
+
+struct Result
+{
+  uint64_t writes;
+  uint64_t segments;
+  size_t bytes;
+};
+
+static Result Send(const Scenario& s, bool gathered)
+{
+  size_t total = 0;
+  for (size_t n : s.fragments)
+  {
+    total += n;
+  }
+  std::string body(total, '\0');
+  for (size_t i = 0; i < total; ++i)
+  {
+    body[i] = (char)('a' + i % 26);
+  }
+
+  RepRapWebServer server(80);
+  server.on("/rr_reply", HTTP_GET, [&]()
+            {
+              const size_t contentLength = (s.lengthKnown) ? total : CONTENT_LENGTH_UNKNOWN;
+              const uint8_t *data = (const uint8_t*)body.data();
+              for (size_t i = 0; i < s.fragments.size(); ++i)
+              {
+                const bool isLast = (i + 1 == s.fragments.size());
+                if (i != 0)
+                {
+                  server.sendContent(data, s.fragments[i], isLast);
+                }
+                else if (gathered)
+                {
+                  server.send(200, contentLength, F("application/json"), data, s.fragments[i], isLast);
+                }
+                else
+                {
+                  // An empty first part flushes the header on its own, and the body follows in a write of its own
+                  server.send(200, contentLength, F("application/json"), data, 0, false);
+                  server.sendContent(data, s.fragments[i], isLast);
+                }
+                data += s.fragments[i];
+              }
+            });
+  server.begin();
+
+  HostConnection& conn = *WiFiServer::Connect();
+  conn.Send("GET /rr_reply HTTP/1.1\r\nHost: 192.168.1.20\r\n\r\n");
+  ServeAll(server, conn);
+
+  // The body arrived whole after the header, de-chunked if it was sent in chunks
+  const size_t headerEnd = conn.output.find("\r\n\r\n");
+  std::string received = (headerEnd != std::string::npos) ? conn.output.substr(headerEnd + 4) : std::string();
+  if (!s.lengthKnown)
+  {
+    std::string dechunked;
+    size_t pos = 0;
+    for (;;)
+    {
+      char *end;
+      const size_t n = strtoul(received.c_str() + pos, &end, 16);
+      pos = end - received.c_str() + 2;
+      if (n == 0 || pos + n > received.size())
+      {
+        break;
+      }
+      dechunked += received.substr(pos, n);
+      pos += n + 2;
+    }
+    CHECK(received.compare(received.size() - 5, 5, "0\r\n\r\n") == 0);
+    received = dechunked;
+  }
+  CHECK(received == body);
+  CHECK(conn.output.find("Transfer-Encoding: chunked") != std::string::npos || s.lengthKnown);
+
+  return Result{ conn.writes, conn.segments, conn.output.size() };
+}
+
+static void Run(const Scenario& s)
+{
+  const Result gathered = Send(s, true);
+  const Result separate = Send(s, false);
+
+  // The fewest segments the reply could take, given that each fragment from the SAM goes out before the next one arrives
+  uint64_t fewest = 0;
+  size_t pending = gathered.bytes;
+  for (size_t i = s.fragments.size(); i-- > 1; )
+  {
+    const size_t n = s.fragments[i] + ((s.lengthKnown) ? 0 : 12);     // allow for the chunk size line and ends
+    fewest += (n + hostTcpMss - 1)/hostTcpMss;
+    pending -= std::min(pending, n);
+  }
+  fewest += (pending + hostTcpMss - 1)/hostTcpMss;
+
+  printf("%-24s %5zu bytes  gathered %2llu writes %2llu segments  separate %2llu writes %2llu segments  fewest %2llu\n",
+         s.name, gathered.bytes, (unsigned long long)gathered.writes, (unsigned long long)gathered.segments,
+         (unsigned long long)separate.writes, (unsigned long long)separate.segments, (unsigned long long)fewest);
+  CHECK(gathered.segments <= separate.segments);
+  if (s.lengthKnown)
+  {
+    CHECK(gathered.segments == fewest);
+  }
+}
+
+int main()
+{
+  bool passed = true;
+  for (const Scenario& s : scenarios)
+  {
+    passed &= RunIsolated(s.name, [&s]() { Run(s); });
+  }
+  return (passed) ? 0 : 1;
+}
+
+// End
@@ -0,0 +1,96 @@
+// Benchmark of the SPI transaction manager against the simulated SAM.
+// For rr_ status polling, file downloads and uploads, it reports the transaction rate, the payload rate, the request rate and the time from the SAM
+// signalling that it is ready to the transfer starting. Rates are in simulated time; the host time per transaction is measured too.
+
+#include "FakeSamTransport.h"
+#include "RrClient.h"
+#include "SPITransaction.h"
+#include "HostTest.h"
+#include <chrono>
+
+struct Scenario
+{
+  const char *name;
+  uint32_t spiDataLength;             // 0 to keep the default
+  bool crc;
+  size_t maxAtSam;
+  uint32_t requests;
+  uint32_t postLength;
+  uint32_t replyLength;
+};
+
+static const Scenario scenarios[] =
+{
+  { "status 2048",            0,    false, 1, 2000,   0,      600 },
+  { "status 2048 x4",         0,    false, 4, 2000,   0,      600 },
+  { "status 4096 crc",        4096, true,  1, 2000,   0,      600 },
+  { "status 4096 crc x4",     4096, true,  4, 2000,   0,      600 },
+  { "download 2048",          0,    false, 1, 50,     0,      65536 },
+  { "download 4096 crc",      4096, true,  1, 50,     0,      65536 },
+  { "upload 2048",            0,    false, 1, 10,     262144, 40 },
+  { "upload 4096 crc",        4096, true,  1, 10,     262144, 40 },
+};
+
+const uint64_t loopNanos = 50000;     // time loop() takes when it has nothing else to do
+const uint64_t timeLimit = 600ull * 1000000000;
+
+static void Run(const Scenario& s)
+{
+  FakeSamTransport::Options opts;
+  opts.spiDataLength = s.spiDataLength;
+  opts.enableCrc = s.crc;
+  opts.replyLength = s.replyLength;
+  FakeSamTransport sam(opts);
+  SPITransaction::Init(sam);
+  RrClient client(s.maxAtSam, true);
+
+  if (!RunSimulation(sam, client, loopNanos, timeLimit, [&sam]() { return sam.SettingsAgreed(); }))
+  {
+    printf("%-22s settings were not agreed\n", s.name);
+    ++checkFailures;
+    return;
+  }
+
+  const FakeSamTransport::Stats samBefore = sam.GetStats();
+  const uint64_t startTime = HostClock::Now();
+  SPITransaction::ResetLatencyStats();
+  for (uint32_t i = 0; i < s.requests; ++i)
+  {
+    client.Queue(s.postLength);
+  }
+
+  const auto hostStart = std::chrono::steady_clock::now();
+  const bool finished = RunSimulation(sam, client, loopNanos, timeLimit, [&client]() { return client.Done(); });
+  const auto hostEnd = std::chrono::steady_clock::now();
+
+  const FakeSamTransport::Stats& samStats = sam.GetStats();
+  const RrClient::Stats& clientStats = client.GetStats();
+  const double seconds = (HostClock::Now() - startTime) * 1e-9;
+  const uint64_t transactions = samStats.transactions - samBefore.transactions;
+  const double payload = (double)(samStats.postdataBytes - samBefore.postdataBytes) + clientStats.replyBytes;
+  const double hostNanos = std::chrono::duration<double, std::nano>(hostEnd - hostStart).count();
+  uint32_t count, minMicros, maxMicros, averageMicros;
+  SPITransaction::GetLatencyStats(count, minMicros, maxMicros, averageMicros);
+
+  printf("%-22s %9.0f tr/s %9.1f KB/s %8.1f req/s  ready latency us min/avg/max %u/%u/%u  bus %4.1f%%  host %4.0f ns/tr\n",
+         s.name, transactions / seconds, payload / seconds / 1024, clientStats.repliesCompleted / seconds,
+         minMicros, averageMicros, maxMicros, 100.0 * (samStats.busyNanos - samBefore.busyNanos) * 1e-9 / seconds,
+         hostNanos / transactions);
+
+  CHECK(finished);
+  CHECK(clientStats.repliesCompleted == s.requests);
+  CHECK(clientStats.replyErrors == 0);
+  CHECK(samStats.postdataErrors == 0);
+}
+
+int main()
+{
+  bool passed = true;
+  for (const Scenario& s : scenarios)
+  {
+    passed &= RunIsolated(s.name, [&s]() { Run(s); });
+  }
+  return (passed) ? 0 : 1;
+}
+
+// End
@@ -0,0 +1,223 @@
+// Tests of the rings of SPI transaction buffers, run against the simulated SAM
+
+#include "FakeSamTransport.h"
+#include "RrClient.h"
+#include "SPITransaction.h"
+#include "Config.h"
+#include "HostTest.h"
+
+using namespace SPITransaction;
+
+const uint64_t loopNanos = 50000;
+const uint64_t timeLimit = 60ull * 1000000000;
+
+// Run transactions without a client taking the incoming messages, until done() returns true or 10ms have passed
+template<class F> void RunSam(FakeSamTransport& sam, F done)
+{
+  const uint64_t end = HostClock::Now() + 10000000;
+  while (!done() && HostClock::Now() < end)
+  {
+    DoTransaction();
+    HostClock::AdvanceTo(std::min(sam.Poll(), HostClock::Now() + loopNanos));
+  }
+}
+
+// Postdata buffers are reserved, filled and committed one after another, up to the size of the ring, before the SAM takes any of them
+static void TestReserveCommit()
+{
+  FakeSamTransport sam(FakeSamTransport::Options{});
+  Init(sam);
+
+  CHECK(ScheduleRequestMessage(trTypeRequest | ttRr, 0, 1, false, "upload", 6));
+  uint8_t *first = nullptr;
+  size_t length = 0;
+  CHECK(GetBufferAddress(&first, length));
+  CHECK(length == maxSpiFileData);
+  uint8_t *again = nullptr;
+  CHECK(GetBufferAddress(&again, length));
+  CHECK(again == first);                              // reserving again gives the same buffer until it is committed
+
+  // The request took one buffer, so this one fills the ring
+  CHECK(numSpiOutBuffers == 2);
+  for (size_t i = 0; i < 100; ++i)
+  {
+    first[i] = FakeSamTransport::PostdataByte(1, i);
+  }
+  SchedulePostdataMessage(trTypeRequest | ttRr, 0, 1, 100, 1, false);
+  uint8_t *full;
+  CHECK(!GetBufferAddress(&full, length));
+  CHECK(!ScheduleInfoMessage(ttNetworkInfo, "x", 1));
+
+  // Once the SAM has taken a message there is room for the next fragment
+  RunSam(sam, []() { return false; });
+  uint8_t *next = nullptr;
+  CHECK(GetBufferAddress(&next, length));
+  for (size_t i = 0; i < 50; ++i)
+  {
+    next[i] = FakeSamTransport::PostdataByte(1, 100 + i);
+  }
+  SchedulePostdataMessage(trTypeRequest | ttRr, 0, 1, 50, 2, true);
+
+  // Cancelling a reservation frees the buffer for other messages
+  CHECK(GetBufferAddress(&next, length));
+  CancelPostdataMessage();
+  CHECK(ScheduleInfoMessage(ttNetworkInfo, "x", 1));
+
+  RunSam(sam, []() { return false; });
+  CHECK(sam.GetStats().requests == 1);
+  CHECK(sam.GetStats().postdataBytes == 150);
+  CHECK(sam.GetStats().postdataErrors == 0);
+  CHECK(DataReady());
+  CHECK(GetOpcode() == (trTypeResponse | ttRr));
+  CHECK(GetSeq() == 1);
+}
+
+// While a reply fragment is held, the SAM can send the next one into another input buffer
+static void TestHoldIncoming()
+{
+  FakeSamTransport::Options opts;
+  opts.replyLength = 3 * maxSpiFileData;
+  FakeSamTransport sam(opts);
+  Init(sam);
+
+  CHECK(ScheduleRequestMessage(trTypeRequest | ttRr, 0, 7, true, "download", 8));
+  RunSam(sam, []() { return DataReady(); });
+  CHECK(DataReady());
+  bool isLast;
+  CHECK(GetFragment(isLast) == 0 && !isLast);
+  size_t length;
+  const uint8_t *held = (const uint8_t*)GetData(length);
+  CHECK(length == maxSpiFileData);
+  const IncomingMessage msg = HoldIncoming();
+  CHECK(!DataReady());
+
+  const uint64_t transactions = sam.GetStats().transactions;
+  RunSam(sam, []() { return DataReady(); });
+  CHECK(sam.GetStats().transactions > transactions);
+  CHECK(DataReady());
+  CHECK(GetFragment(isLast) == 1);
+
+  // The held message is still intact
+  CHECK(*(const uint32_t*)held == (200 | rcJson));
+  bool intact = true;
+  for (size_t i = 8; i < length; ++i)
+  {
+    intact = intact && held[i] == FakeSamTransport::ReplyByte(7, i - 8);
+  }
+  CHECK(intact);
+
+  // Both input buffers are in use, so the SAM can't send the third fragment until one is freed
+  const uint64_t before = sam.GetStats().transactions;
+  RunSam(sam, []() { return false; });
+  CHECK(sam.GetStats().transactions == before);
+  ReleaseIncoming(msg);
+  IncomingDataTaken();
+  RunSam(sam, []() { return DataReady(); });
+  CHECK(GetFragment(isLast) == 2);
+}
+
+// Requests, postdata and replies of all sizes get through whole and in order
+static void TestTraffic(uint32_t spiDataLength, bool crc, size_t maxAtSam, bool returnSeq, uint32_t requests, uint32_t postLength, uint32_t replyLength,
+                        uint32_t corruptOneIn = 0)
+{
+  FakeSamTransport::Options opts;
+  opts.corruptOneIn = corruptOneIn;
+  opts.spiDataLength = spiDataLength;
+  opts.enableCrc = crc;
+  opts.returnSeq = returnSeq;
+  opts.replyLength = replyLength;
+  FakeSamTransport sam(opts);
+  Init(sam);
+  RrClient client(maxAtSam, true);
+
+  CHECK(RunSimulation(sam, client, loopNanos, timeLimit, [&sam]() { return sam.SettingsAgreed(); }));
+  CHECK(GetMaxDataLength() == ((spiDataLength != 0) ? spiDataLength : maxSpiFileData));
+  CHECK(sam.CrcInUse() == crc);
+  CHECK(sam.Frequency() == ((crc) ? spiFrequencyWithCrc : spiFrequency));
+
+  for (uint32_t i = 0; i < requests; ++i)
+  {
+    client.Queue((i % 3 == 1) ? postLength : 0);
+  }
+  CHECK(RunSimulation(sam, client, loopNanos, timeLimit, [&client]() { return client.Done(); }));
+  CHECK(client.GetStats().repliesCompleted == requests);
+  CHECK(client.GetStats().replyErrors == 0);
+  CHECK(sam.GetStats().postdataBytes == client.GetStats().postdataBytes);
+  CHECK(sam.GetStats().postdataErrors == 0);
+  if (corruptOneIn == 0)
+  {
+    CHECK(sam.GetStats().badPackets == 0);
+  }
+  else
+  {
+    // Errors were recovered by NAKs without dropping the clock speed
+    CHECK(sam.GetStats().badPackets != 0);
+    CHECK(sam.GetStats().naksReceived != 0);
+    CHECK(sam.Frequency() == spiFrequencyWithCrc);
+  }
+}
+
+// A packet from the SAM that keeps failing its CRC drops the clock speed once it has failed maxConsecutiveCrcErrors times, and a run of good packets
+// afterwards brings the speed back. The packets sent after it arrive out of sequence and are NAKed too, but they don't count as CRC errors.
+static void TestCrcBurst(uint32_t burst)
+{
+  FakeSamTransport::Options opts;
+  opts.enableCrc = true;
+  opts.corruptRepeatedly = burst;
+  opts.replyLength = 3 * maxSpiFileData;
+  FakeSamTransport sam(opts);
+  Init(sam);
+  RrClient client(4, true);
+
+  for (uint32_t i = 0; i < 50; ++i)
+  {
+    client.Queue(0);
+  }
+  CHECK(RunSimulation(sam, client, loopNanos, timeLimit, [&client]() { return client.Done(); }));
+  CHECK(sam.GetStats().corruptions == burst);
+  CHECK(sam.GetStats().frequencyDrops == ((burst >= maxConsecutiveCrcErrors) ? 1 : 0));
+
+  for (uint32_t i = 0; i < crcRetryGoodPackets; ++i)
+  {
+    client.Queue(0);
+  }
+  CHECK(RunSimulation(sam, client, loopNanos, timeLimit, [&client]() { return client.Done(); }));
+  CHECK(client.GetStats().replyErrors == 0);
+  CHECK(sam.Frequency() == spiFrequencyWithCrc);
+}
+
+// With the ring, the next postdata fragment is filled while the previous one is waiting for the SAM, so an upload keeps the bus busy
+static void TestUploadOverlaps()
+{
+  FakeSamTransport sam(FakeSamTransport::Options{});
+  Init(sam);
+  RrClient client(1, false);
+
+  const uint64_t start = HostClock::Now();
+  client.Queue(64 * maxSpiFileData);
+  CHECK(RunSimulation(sam, client, loopNanos, timeLimit, [&client]() { return client.Done(); }));
+  CHECK(client.GetStats().repliesCompleted == 1);
+  CHECK(sam.GetStats().transactions < 70);            // one per fragment, plus the request and the reply
+  CHECK(sam.GetStats().busyNanos * 100 / (HostClock::Now() - start) >= 80);
+}
+
+int main()
+{
+  bool passed = true;
+  passed &= RunIsolated("reserve and commit postdata buffers", TestReserveCommit);
+  passed &= RunIsolated("hold an incoming message", TestHoldIncoming);
+  passed &= RunIsolated("upload overlaps filling with sending", TestUploadOverlaps);
+  passed &= RunIsolated("traffic 2048", []() { TestTraffic(0, false, 1, true, 300, 10000, 3000); });
+  passed &= RunIsolated("traffic 2048 x4", []() { TestTraffic(0, false, 4, true, 300, 10000, 3000); });
+  passed &= RunIsolated("traffic 2048 without seq", []() { TestTraffic(0, false, 1, false, 300, 10000, 3000); });
+  passed &= RunIsolated("traffic 512", []() { TestTraffic(512, false, 4, true, 300, 5000, 2000); });
+  passed &= RunIsolated("traffic 4096 crc", []() { TestTraffic(4096, true, 1, true, 300, 20000, 9000); });
+  passed &= RunIsolated("traffic 4096 crc x4", []() { TestTraffic(4096, true, 4, true, 300, 20000, 9000); });
+  passed &= RunIsolated("traffic 2048 crc with errors", []() { TestTraffic(0, true, 1, true, 300, 10000, 3000, 20); });
+  passed &= RunIsolated("traffic 4096 crc x4 with errors", []() { TestTraffic(4096, true, 4, true, 300, 20000, 9000, 20); });
+  passed &= RunIsolated("crc errors short of a drop", []() { TestCrcBurst(maxConsecutiveCrcErrors - 1); });
+  passed &= RunIsolated("crc errors drop the clock speed", []() { TestCrcBurst(maxConsecutiveCrcErrors); });
+  return (passed) ? 0 : 1;
+}
+
+// End
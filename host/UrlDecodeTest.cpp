@@ -0,0 +1,200 @@
+// Tests of RepRapWebServer::urlDecode(), which decodes request arguments in place, and a comparison of its speed
+// with a decoder that handles one character at a time.
+
+#include "WebHarness.h"
+#include "HostTest.h"
+#include <chrono>
+#include <string>
+
+// Decode one character at a time, with the same rules as urlDecode()
+static std::string ReferenceDecode(const std::string& s)
+{
+  std::string out;
+  for (size_t i = 0; i < s.size(); ++i)
+  {
+    if (s[i] == '+')
+    {
+      out += ' ';
+    }
+    else if (s[i] == '%' && i + 2 < s.size() && isxdigit((uint8_t)s[i + 1]) && isxdigit((uint8_t)s[i + 2]))
+    {
+      out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    }
+    else
+    {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+// Decode a copy of a string with urlDecode(), checking the returned length and the terminator
+static std::string Decode(const std::string& s)
+{
+  std::string buf = s + "####";               // the terminator must go straight after the decoded text
+  const size_t n = RepRapWebServer::urlDecode(&buf[0], s.size());
+  CHECK(n <= s.size());
+  CHECK(buf[n] == '\0');
+  return buf.substr(0, n);
+}
+
+static void TestCases()
+{
+  static const struct { const char *in; size_t inLength; const char *out; size_t outLength; } cases[] =
+  {
+    { "", 0, "", 0 },
+    { "abc", 3, "abc", 3 },
+    { "a+b", 3, "a b", 3 },
+    { "%30", 3, "0", 1 },                       // the old String::replace decoder turned this into '*'
+    { "%3A", 3, ":", 1 },                       // and this into ';'
+    { "%3a", 3, ":", 1 },
+    { "%2B", 3, "+", 1 },                       // an encoded '+' isn't a space
+    { "%25", 3, "%", 1 },
+    { "%%41", 4, "%A", 2 },
+    { "100%", 4, "100%", 4 },                   // a '%' without two hex digits after it is kept
+    { "%4", 2, "%4", 2 },
+    { "%zz", 3, "%zz", 3 },
+    { "%4g", 3, "%4g", 3 },
+    { "a%00b", 5, "a\0b", 3 },
+    { "%FF", 3, "\xFF", 1 },
+    { "M117+Hello%2C+world%21", 22, "M117 Hello, world!", 18 },
+    { "abcdefg%20hijklmn+opq", 21, "abcdefg hijklmn opq", 19 },   // escapes straddling word boundaries
+    { "0%3A%2Fgcodes%2Fbenchy%20v2.gcode", 33, "0:/gcodes/benchy v2.gcode", 25 },
+  };
+  for (const auto& c : cases)
+  {
+    const std::string out = Decode(std::string(c.in, c.inLength));
+    if (out != std::string(c.out, c.outLength))
+    {
+      printf("  \"%s\" decoded as \"%s\"\n", c.in, out.c_str());
+      ++checkFailures;
+    }
+  }
+}
+
+// Every byte value, encoded in upper and lower case
+static void TestAllBytes()
+{
+  for (int c = 0; c < 256; ++c)
+  {
+    char upper[4], lower[4];
+    snprintf(upper, sizeof(upper), "%%%02X", c);
+    snprintf(lower, sizeof(lower), "%%%02x", c);
+    CHECK(Decode(upper) == std::string(1, (char)c));
+    CHECK(Decode(lower) == std::string(1, (char)c));
+  }
+}
+
+// Random strings rich in escapes, plus signs and bad escapes, at every alignment
+static void TestRandom()
+{
+  static const char alphabet[] = "%%%++09afAFgz:/ X";
+  uint32_t x = 88675123u;
+  uint32_t mismatches = 0;
+  for (int i = 0; i < 200000; ++i)
+  {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    std::string s(x % 40, ' ');
+    for (char& c : s)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      c = alphabet[x % (sizeof(alphabet) - 1)];
+    }
+    const std::string prefix(i % 4, 'p');       // vary the alignment of the text
+    const std::string decoded = Decode(prefix + s);
+    if (decoded != ReferenceDecode(prefix + s) && ++mismatches <= 5)
+    {
+      printf("  \"%s\" decoded as \"%s\"\n", (prefix + s).c_str(), decoded.c_str());
+    }
+  }
+  CHECK(mismatches == 0);
+}
+
+// A long G-code command sent with rr_gcode is decoded on its way through the server
+static void TestLongGcode()
+{
+  std::string gcode;
+  for (int i = 0; gcode.size() < 600; ++i)
+  {
+    gcode += "G1 X" + std::to_string(i) + ".5 Y-" + std::to_string(i * 3) + " E0.0123 F3600 ; move:" + std::to_string(i) + "\n";
+  }
+  std::string encoded;
+  for (char c : gcode)
+  {
+    char e[4];
+    snprintf(e, sizeof(e), "%%%02X", (uint8_t)c);
+    encoded += (isalnum((uint8_t)c) || c == '.' || c == '-') ? std::string(1, c) : (c == ' ') ? std::string("+") : std::string(e);
+  }
+
+  RepRapWebServer server(80);
+  std::string received;
+  server.on("/rr_gcode", HTTP_GET, [&]()
+            {
+              size_t length;
+              const char *value = server.argValue("gcode", &length);
+              received.assign((value != NULL) ? value : "", (value != NULL) ? length : 0);
+              server.send(200, "application/json", "{\"buff\":200}");
+            });
+  server.begin();
+  HostConnection& conn = *WiFiServer::Connect();
+  conn.Send("GET /rr_gcode?gcode=" + encoded + " HTTP/1.1\r\nHost: 192.168.1.20\r\n\r\n");
+  ServeAll(server, conn);
+  CHECK(received == gcode);
+}
+
+// Decoding speed on text with few escapes and on text that is mostly escapes, compared with decoding a character at a time
+static void TestThroughput()
+{
+  const std::string gcodeText = "M32+%220%3A%2Fgcodes%2Fbenchy.gcode%22+G1+X100.5+Y200+F6000+M104+S210+";
+  const std::string escapedText = "%7B%22key%22%3A%5B1%2C2%2C3%5D%7D";
+  for (const std::string *sample : { &gcodeText, &escapedText })
+  {
+    std::string text;
+    while (text.size() < 1000000)
+    {
+      text += *sample;
+    }
+    std::string buf;
+    buf.reserve(text.size() + 1);
+    const int rounds = 50;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (int i = 0; i < rounds; ++i)
+    {
+      buf.assign(text);
+      total += RepRapWebServer::urlDecode(&buf[0], buf.size());
+    }
+    const double tableSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    size_t referenceTotal = 0;
+    for (int i = 0; i < rounds; ++i)
+    {
+      referenceTotal += ReferenceDecode(text).size();
+    }
+    const double referenceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %s: urlDecode %.0f MB/s, a character at a time %.0f MB/s\n", (sample == &gcodeText) ? "G-code" : "mostly escapes",
+           text.size() * rounds / tableSeconds / 1e6, text.size() * rounds / referenceSeconds / 1e6);
+    CHECK(total == referenceTotal);
+  }
+}
+
+int main()
+{
+  bool passed = true;
+  passed &= RunIsolated("decode fixed cases", TestCases);
+  passed &= RunIsolated("decode every byte", TestAllBytes);
+  passed &= RunIsolated("decode random strings", TestRandom);
+  passed &= RunIsolated("decode a long G-code command", TestLongGcode);
+  passed &= RunIsolated("decode throughput", TestThroughput);
+  return (passed) ? 0 : 1;
+}
+
+// End
@@ -0,0 +1,29 @@
+// Helpers for running RepRapWebServer on a host against the TCP stand-in
+
+#ifndef _WEBHARNESS_H_INCLUDED
+#define _WEBHARNESS_H_INCLUDED
+
+#include "WiFiServer.h"
+#include "RepRapWebServer.h"
+#include "HostHeap.h"
+
+// Call handleClient() until the server has read everything the client sent and a call sends nothing more, or until the connection is closed.
+// Returns the number of heap allocations made by the server while it did so.
+inline uint64_t ServeAll(RepRapWebServer& server, const HostConnection& conn, uint32_t maxCalls = 1000000)
+{
+  uint64_t allocations = 0;
+  for (uint32_t i = 0; i < maxCalls && conn.serverOpen; ++i)
+  {
+    const size_t output = conn.output.size();
+    const uint64_t before = HostHeap::Allocations();
+    server.handleClient();
+    allocations += HostHeap::Allocations() - before;
+    if (conn.inputTaken == conn.input.size() && conn.output.size() == output)
+    {
+      break;
+    }
+  }
+  return allocations;
+}
+
+#endif
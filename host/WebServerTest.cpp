@@ -0,0 +1,53 @@
+// Tests of RepRapWebServer's handling of request bodies, run against the TCP stand-in
+
+#include "WebHarness.h"
+#include "HostTest.h"
+#include <string>
+
+// A request whose body won't fit in the request arena is refused with 413 and its handler isn't called, however large its Content-Length
+static void TestOversizedBody(const char *method, const char *contentLength)
+{
+  RepRapWebServer server(80);
+  uint32_t handled = 0;
+  server.on("/upload", HTTP_ANY, [&]() { ++handled; server.send(200, "text/plain", ""); });
+  server.begin();
+
+  HostConnection& conn = *WiFiServer::Connect();
+  conn.Send(std::string(method) + " /upload?a=1 HTTP/1.1\r\nHost: 192.168.1.20\r\nContent-Type: text/plain\r\nContent-Length: " + contentLength + "\r\n\r\n");
+  conn.Send(std::string(4 * HTTP_REQUEST_ARENA_SIZE, 'x'));
+  ServeAll(server, conn);
+
+  CHECK(handled == 0);
+  CHECK(conn.output.compare(0, 21, "HTTP/1.1 413 Request ") == 0);
+  CHECK(!conn.serverOpen);
+}
+
+// A body that fits is read whole and becomes the plain argument
+static void TestPlainBody()
+{
+  RepRapWebServer server(80);
+  String plain;
+  server.on("/config", HTTP_PUT, [&]() { plain = server.arg("plain"); server.send(200, "text/plain", ""); });
+  server.begin();
+
+  const std::string body = "{\"name\":\"duet\"}";
+  HostConnection& conn = *WiFiServer::Connect();
+  conn.Send("PUT /config HTTP/1.1\r\nHost: 192.168.1.20\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+  ServeAll(server, conn);
+
+  CHECK(plain == body.c_str());
+  CHECK(conn.output.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+}
+
+int main()
+{
+  bool passed = true;
+  passed &= RunIsolated("plain body", TestPlainBody);
+  passed &= RunIsolated("body larger than the arena", []() { TestOversizedBody("PUT", "4096"); });
+  passed &= RunIsolated("Content-Length that saturates strtoul", []() { TestOversizedBody("PUT", "99999999999999999999"); });
+  passed &= RunIsolated("Content-Length that wraps a 32-bit sum", []() { TestOversizedBody("PATCH", "4294967290"); });
+  passed &= RunIsolated("POST body when not serving the printer", []() { TestOversizedBody("POST", "4294967295"); });
+  return (passed) ? 0 : 1;
+}
+
+// End
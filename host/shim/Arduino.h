@@ -0,0 +1,90 @@
+// Just enough of the ESP8266 Arduino core to build the firmware's protocol code on a host.
+// Time is simulated: micros() and millis() read a clock that only moves when the simulation advances it.
+
+#ifndef _HOST_ARDUINO_H_INCLUDED
+#define _HOST_ARDUINO_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <strings.h>
+#include <algorithm>
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strcpy_P strcpy
+#define ICACHE_RAM_ATTR
+#define ICACHE_FLASH_ATTR
+
+#define DEC 10
+#define HEX 16
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define SPECIAL 0xF8
+#define LSBFIRST 0
+#define MSBFIRST 1
+#define SCK 14
+#define MISO 12
+#define MOSI 13
+#define SS 15
+#define ESP8266_CLOCK 80000000UL
+
+#undef abs
+#define abs(x) ((x)>0?(x):-(x))     // as the core defines it, which HSPI.cpp relies on for unsigned arguments
+
+#include "esp8266_peri.h"
+#include "WString.h"
+
+#define DEBUGV(...)
+
+namespace HostClock
+{
+  // Return the simulated time in nanoseconds
+  uint64_t Now();
+
+  // Move the simulated time on by an interval, or to a time if that is later
+  void Advance(uint64_t nanoseconds);
+  void AdvanceTo(uint64_t time);
+}
+
+uint32_t micros();
+uint32_t millis();
+void delay(uint32_t ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+
+// Serial port. Output is thrown away unless echo is set, because the protocol code reports every bad packet and the tests make plenty of them.
+class HostSerial
+{
+public:
+  bool echo = false;
+  uint32_t lines = 0;           // number of lines printed, whether or not they were echoed
+
+  void begin(unsigned long) { }
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(int n, int base = DEC) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t println() { ++lines; return print("\n"); }
+  template<class T> size_t println(T value) { const size_t n = print(value); return n + println(); }
+  template<class T> size_t println(T value, int base) { const size_t n = print(value, base); return n + println(); }
+};
+
+extern HostSerial Serial;
+
+#endif
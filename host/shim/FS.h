@@ -0,0 +1,60 @@
+// Host version of the SPIFFS file system, held in memory
+
+#ifndef _HOST_FS_H_INCLUDED
+#define _HOST_FS_H_INCLUDED
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace fs
+{
+  enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+  class File
+  {
+  public:
+    File() { }
+    File(const std::string& name, const std::shared_ptr<const std::string>& data) : fileName(name), data(data) { }
+
+    explicit operator bool() const { return data != nullptr; }
+    size_t read(uint8_t *buf, size_t size);
+    bool seek(uint32_t pos, SeekMode mode);
+    size_t size() const { return (data != nullptr) ? data->size() : 0; }
+    const char *name() const { return fileName.c_str(); }
+    void close() { data = nullptr; }
+
+  private:
+    std::string fileName;
+    std::shared_ptr<const std::string> data;
+    size_t position = 0;
+  };
+
+  class FS
+  {
+  public:
+    FS() : files(std::make_shared<std::map<std::string, std::shared_ptr<const std::string>>>()) { }
+
+    bool exists(const char *path) const { return files->count(path) != 0; }
+    bool exists(const String& path) const { return exists(path.c_str()); }
+    File open(const char *path, const char *mode) const;
+    File open(const String& path, const char *mode) const { return open(path.c_str(), mode); }
+
+    // Put a file in the file system
+    void Add(const char *path, const std::string& data) { (*files)[path] = std::make_shared<const std::string>(data); }
+
+  private:
+    std::shared_ptr<std::map<std::string, std::shared_ptr<const std::string>>> files;   // shared by copies, as they all refer to the one file system
+  };
+}
+
+using fs::File;
+using fs::FS;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+extern FS SPIFFS;
+
+#endif
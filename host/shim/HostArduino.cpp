@@ -0,0 +1,78 @@
+// Host versions of the Arduino core functions declared in the shim Arduino.h
+
+#include <Arduino.h>
+
+static uint64_t hostTime = 0;
+
+uint64_t HostClock::Now()
+{
+  return hostTime;
+}
+
+void HostClock::Advance(uint64_t nanoseconds)
+{
+  hostTime += nanoseconds;
+}
+
+void HostClock::AdvanceTo(uint64_t time)
+{
+  hostTime = std::max(hostTime, time);
+}
+
+uint32_t micros()
+{
+  return (uint32_t)(hostTime/1000);
+}
+
+uint32_t millis()
+{
+  return (uint32_t)(hostTime/1000000);
+}
+
+void delay(uint32_t ms)
+{
+  HostClock::Advance((uint64_t)ms * 1000000);
+}
+
+void yield()
+{
+}
+
+void pinMode(uint8_t, uint8_t)
+{
+}
+
+HostSerial Serial;
+
+size_t HostSerial::print(const char *s)
+{
+  if (echo)
+  {
+    fputs(s, stderr);
+  }
+  return strlen(s);
+}
+
+size_t HostSerial::print(char c)
+{
+  const char s[2] = { c, 0 };
+  return print(s);
+}
+
+size_t HostSerial::print(long n, int base)
+{
+  if (n < 0 && base == DEC)
+  {
+    return print('-') + print((unsigned long)-n, base);
+  }
+  return print((unsigned long)n, base);
+}
+
+size_t HostSerial::print(unsigned long n, int base)
+{
+  char s[24];
+  snprintf(s, sizeof(s), (base == HEX) ? "%lX" : "%lu", n);
+  return print(s);
+}
+
+// End
@@ -0,0 +1,36 @@
+// Host version of the SPIFFS file system
+
+#include "FS.h"
+
+FS SPIFFS;
+
+size_t fs::File::read(uint8_t *buf, size_t size)
+{
+  if (data == nullptr || position >= data->size())
+  {
+    return 0;
+  }
+  const size_t n = std::min(size, data->size() - position);
+  memcpy(buf, data->data() + position, n);
+  position += n;
+  return n;
+}
+
+bool fs::File::seek(uint32_t pos, SeekMode mode)
+{
+  const size_t base = (mode == SeekSet) ? 0 : (mode == SeekCur) ? position : size();
+  if (data == nullptr || base + pos > data->size())
+  {
+    return false;
+  }
+  position = base + pos;
+  return true;
+}
+
+fs::File fs::FS::open(const char *path, const char *mode) const
+{
+  const auto f = files->find(path);
+  return (f != files->end() && strcmp(mode, "r") == 0) ? File(f->first, f->second) : File();
+}
+
+// End
@@ -0,0 +1,55 @@
+// Heap allocation counting for the host build
+
+#include "HostHeap.h"
+#include <new>
+#include <stdlib.h>
+
+static uint64_t allocations = 0;
+
+uint64_t HostHeap::Allocations()
+{
+  return allocations;
+}
+
+void HostHeap::Count()
+{
+  ++allocations;
+}
+
+void *operator new(size_t size)
+{
+  ++allocations;
+  void *p = malloc((size != 0) ? size : 1);
+  if (p == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+// End
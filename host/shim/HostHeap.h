@@ -0,0 +1,19 @@
+// Heap allocation counting for the host build. Every operator new and every String buffer allocation is counted,
+// so that a benchmark can report how many allocations the firmware code makes.
+
+#ifndef _HOST_HEAP_H_INCLUDED
+#define _HOST_HEAP_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace HostHeap
+{
+  // Return the number of allocations made so far
+  uint64_t Allocations();
+
+  // Count an allocation made other than through operator new
+  void Count();
+}
+
+#endif
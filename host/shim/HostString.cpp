@@ -0,0 +1,148 @@
+// Host version of the Arduino String class
+
+#include "WString.h"
+#include "HostHeap.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static char emptyString[1] = "";
+
+String::String(const char *s) : buffer(emptyString), len(0), capacity(0)
+{
+  append(s, strlen(s));
+}
+
+String::String(const String& s) : buffer(emptyString), len(0), capacity(0)
+{
+  append(s.buffer, s.len);
+}
+
+String::String(String&& s) : buffer(s.buffer), len(s.len), capacity(s.capacity)
+{
+  s.buffer = emptyString;
+  s.len = s.capacity = 0;
+}
+
+String::String(char c) : buffer(emptyString), len(0), capacity(0)
+{
+  append(&c, 1);
+}
+
+String::String(int n) : String((long)n)
+{
+}
+
+String::String(unsigned int n) : String((unsigned long)n)
+{
+}
+
+String::String(long n) : buffer(emptyString), len(0), capacity(0)
+{
+  char s[24];
+  append(s, snprintf(s, sizeof(s), "%ld", n));
+}
+
+String::String(unsigned long n) : buffer(emptyString), len(0), capacity(0)
+{
+  char s[24];
+  append(s, snprintf(s, sizeof(s), "%lu", n));
+}
+
+String::~String()
+{
+  if (capacity != 0)
+  {
+    free(buffer);
+  }
+}
+
+String& String::operator=(const String& s)
+{
+  if (this != &s)
+  {
+    len = 0;
+    append(s.buffer, s.len);
+  }
+  return *this;
+}
+
+String& String::operator=(String&& s)
+{
+  if (this != &s)
+  {
+    if (capacity != 0)
+    {
+      free(buffer);
+    }
+    buffer = s.buffer;
+    len = s.len;
+    capacity = s.capacity;
+    s.buffer = emptyString;
+    s.len = s.capacity = 0;
+  }
+  return *this;
+}
+
+String& String::operator=(const char *s)
+{
+  const String copy(s);         // s may point into this string
+  return *this = copy;
+}
+
+int String::indexOf(char c) const
+{
+  const char *p = (const char*)memchr(buffer, c, len);
+  return (p != nullptr) ? (int)(p - buffer) : -1;
+}
+
+String String::substring(size_t from, size_t to) const
+{
+  String r;
+  if (to > len)
+  {
+    to = len;
+  }
+  if (from < to)
+  {
+    r.append(buffer + from, to - from);
+  }
+  return r;
+}
+
+// Make room for a string of n characters, growing the buffer as the core does
+bool String::reserve(size_t n)
+{
+  if (n < capacity)
+  {
+    return true;
+  }
+  char *p = (char*)realloc((capacity != 0) ? buffer : nullptr, n + 1);
+  if (p == nullptr)
+  {
+    return false;
+  }
+  HostHeap::Count();
+  if (capacity == 0)
+  {
+    p[0] = '\0';
+  }
+  buffer = p;
+  capacity = n + 1;
+  return true;
+}
+
+String& String::append(const char *s, size_t n)
+{
+  const bool inside = (s >= buffer && s < buffer + len);      // s may point into this string, which reserve() can move
+  const size_t offset = s - buffer;
+  if (n == 0 || !reserve(len + n))
+  {
+    return *this;
+  }
+  memmove(buffer + len, (inside) ? buffer + offset : s, n);
+  len += n;
+  buffer[len] = '\0';
+  return *this;
+}
+
+// End
@@ -0,0 +1,86 @@
+// Host stand-ins for TCP connections and servers
+
+#include "WiFiClient.h"
+#include "WiFiServer.h"
+
+int WiFiClient::available() const
+{
+  return (conn != nullptr && conn->serverOpen) ? (int)(conn->input.size() - conn->inputTaken) : 0;
+}
+
+int WiFiClient::read()
+{
+  uint8_t c;
+  return (read(&c, 1) == 1) ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t size)
+{
+  size_t n = available();
+  if (n > size)
+  {
+    n = size;
+  }
+  if (n > conn->maxRead)
+  {
+    n = conn->maxRead;
+  }
+  if (n == 0)
+  {
+    return -1;
+  }
+  memcpy(buf, conn->input.data() + conn->inputTaken, n);
+  conn->inputTaken += n;
+  return n;
+}
+
+void WiFiClient::flush()
+{
+  if (conn != nullptr)
+  {
+    conn->inputTaken = conn->input.size();
+  }
+}
+
+void WiFiClient::stop()
+{
+  if (conn != nullptr)
+  {
+    conn->serverOpen = false;
+  }
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t size, bool)
+{
+  if (conn == nullptr || !conn->serverOpen)
+  {
+    return 0;
+  }
+  conn->output.append((const char*)buf, size);
+  ++conn->writes;
+  conn->segments += (size + hostTcpMss - 1)/hostTcpMss;
+  return size;
+}
+
+WiFiServer *WiFiServer::current = nullptr;
+
+WiFiClient WiFiServer::available()
+{
+  if (pending.empty())
+  {
+    return WiFiClient();
+  }
+  WiFiClient client(pending.front());
+  pending.pop_front();
+  return client;
+}
+
+std::shared_ptr<HostConnection> WiFiServer::Connect()
+{
+  std::shared_ptr<HostConnection> conn = std::make_shared<HostConnection>();
+  current->pending.push_back(conn);
+  current->connections.push_back(conn);
+  return conn;
+}
+
+// End
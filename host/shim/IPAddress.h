@@ -0,0 +1,19 @@
+// Host version of IPAddress, just enough to construct a server
+
+#ifndef _HOST_IPADDRESS_H_INCLUDED
+#define _HOST_IPADDRESS_H_INCLUDED
+
+#include <stdint.h>
+
+class IPAddress
+{
+public:
+  IPAddress(uint32_t a = 0) : address(a) { }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) { }
+  operator uint32_t() const { return address; }
+
+private:
+  uint32_t address;
+};
+
+#endif
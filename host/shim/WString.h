@@ -0,0 +1,63 @@
+// Host version of the Arduino String class, with the members that the web server uses. Buffers come from malloc and are counted by HostHeap.
+
+#ifndef _HOST_WSTRING_H_INCLUDED
+#define _HOST_WSTRING_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Strings in flash. On a host they are ordinary strings.
+class __FlashStringHelper;
+#define FPSTR(p) (reinterpret_cast<const __FlashStringHelper *>(p))
+#define F(s) FPSTR(s)
+
+class String
+{
+public:
+  String(const char *s = "");
+  String(const String& s);
+  String(String&& s);
+  explicit String(const __FlashStringHelper *s) : String(reinterpret_cast<const char*>(s)) { }
+  explicit String(char c);
+  explicit String(int n);
+  explicit String(unsigned int n);
+  explicit String(long n);
+  explicit String(unsigned long n);
+  ~String();
+
+  String& operator=(const String& s);
+  String& operator=(String&& s);
+  String& operator=(const char *s);
+
+  String& operator+=(const String& s) { return append(s.buffer, s.len); }
+  String& operator+=(const char *s) { return append(s, strlen(s)); }
+  String& operator+=(char c) { return append(&c, 1); }
+
+  friend String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+  friend String operator+(const String& a, const char *b) { String r(a); r += b; return r; }
+  friend String operator+(const char *a, const String& b) { String r(a); r += b; return r; }
+
+  bool operator==(const String& s) const { return len == s.len && memcmp(buffer, s.buffer, len) == 0; }
+  bool operator==(const char *s) const { return strcmp(buffer, s) == 0; }
+  bool operator!=(const String& s) const { return !(*this == s); }
+  bool operator!=(const char *s) const { return !(*this == s); }
+
+  size_t length() const { return len; }
+  const char *c_str() const { return buffer; }
+  bool startsWith(const String& s) const { return s.len <= len && memcmp(buffer, s.buffer, s.len) == 0; }
+  bool endsWith(const String& s) const { return s.len <= len && memcmp(buffer + len - s.len, s.buffer, s.len) == 0; }
+  int indexOf(char c) const;
+  String substring(size_t from) const { return substring(from, len); }
+  String substring(size_t from, size_t to) const;
+
+private:
+  String& append(const char *s, size_t n);
+  bool reserve(size_t n);
+
+  char *buffer;
+  size_t len;
+  size_t capacity;
+};
+
+#endif
@@ -0,0 +1,53 @@
+// Host stand-in for a TCP connection. The test puts the bytes that the client sends into the connection, and the connection
+// records what the server writes and the number of TCP segments that would carry it.
+// Nagle's algorithm is off in the firmware, so each write goes out at once in as many segments of up to an MSS as it needs.
+
+#ifndef _HOST_WIFICLIENT_H_INCLUDED
+#define _HOST_WIFICLIENT_H_INCLUDED
+
+#include <Arduino.h>
+#include "IPAddress.h"
+#include <memory>
+#include <string>
+
+const size_t hostTcpMss = 1460;
+
+struct HostConnection
+{
+  std::string input;                  // bytes from the client
+  size_t inputTaken = 0;              // how many of them the server has read
+  size_t maxRead = hostTcpMss;        // most bytes that one read() returns, as if each segment arrived separately
+  bool clientOpen = true;             // false once the client has closed its end
+  bool serverOpen = true;             // false once the server has stopped the connection
+
+  std::string output;                 // bytes written by the server
+  uint64_t writes = 0;
+  uint64_t segments = 0;
+
+  // Add bytes that the client sends
+  void Send(const char *data, size_t length) { input.append(data, length); }
+  void Send(const std::string& data) { input += data; }
+};
+
+class WiFiClient
+{
+public:
+  WiFiClient() { }
+  explicit WiFiClient(const std::shared_ptr<HostConnection>& c) : conn(c) { }
+
+  explicit operator bool() const { return conn != nullptr; }
+  uint8_t connected() const { return conn != nullptr && conn->serverOpen && (conn->clientOpen || available() != 0); }
+  int available() const;
+  int read();
+  int read(uint8_t *buf, size_t size);
+  void flush();
+  void stop();
+  size_t write(const uint8_t *buf, size_t size, bool last = true);
+  size_t print(const char *s) { return write((const uint8_t*)s, strlen(s)); }
+  void setNoDelay(bool) { }
+
+private:
+  std::shared_ptr<HostConnection> conn;
+};
+
+#endif
@@ -0,0 +1,29 @@
+// Host stand-in for a TCP server. The test queues connections for available() to hand out.
+
+#ifndef _HOST_WIFISERVER_H_INCLUDED
+#define _HOST_WIFISERVER_H_INCLUDED
+
+#include "WiFiClient.h"
+#include <deque>
+
+class WiFiServer
+{
+public:
+  WiFiServer(IPAddress, uint16_t port) : WiFiServer(port) { }
+  WiFiServer(uint16_t) { current = this; }
+  ~WiFiServer() { if (current == this) current = nullptr; }
+
+  void begin() { }
+  WiFiClient available();
+
+  // Make a connection from a client, to be accepted by the next call to available(). The server keeps it for as long as the server exists,
+  // so the test can look at it after the connection has been closed.
+  static std::shared_ptr<HostConnection> Connect();
+
+private:
+  static WiFiServer *current;
+  std::deque<std::shared_ptr<HostConnection>> pending;
+  std::deque<std::shared_ptr<HostConnection>> connections;
+};
+
+#endif
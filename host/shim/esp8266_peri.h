@@ -0,0 +1,48 @@
+// The HSPI registers that HSPI.cpp uses. On a host they are simulated by HspiModel, which counts the CPU cycles that register and FIFO
+// accesses take and the time the SPI hardware takes to shift each burst.
+
+#ifndef _HOST_ESP8266_PERI_H_INCLUDED
+#define _HOST_ESP8266_PERI_H_INCLUDED
+
+#include <stdint.h>
+
+// A peripheral register. Every read and write goes through the model, so that it can charge for the access and act on it.
+class HostRegister
+{
+public:
+  explicit HostRegister(int id) : id(id) { }
+  operator uint32_t() const;
+  HostRegister& operator=(uint32_t value);
+  HostRegister& operator|=(uint32_t bits) { return *this = (uint32_t)*this | bits; }
+  HostRegister& operator&=(uint32_t bits) { return *this = (uint32_t)*this & bits; }
+
+private:
+  HostRegister(const HostRegister&) = delete;
+  int id;
+};
+
+extern HostRegister SPI1CMD, SPI1C, SPI1C1, SPI1U, SPI1U1, SPI1CLK, GPMUX;
+
+// The FIFO is plain memory, because HSPI.cpp takes pointers into it. The model works out the accesses to it from what has changed.
+extern volatile uint32_t SPI1W[16];
+#define SPI1W0 (SPI1W[0])
+
+#define SPIBUSY     (1 << 18)
+#define SPIUMOSI    (1 << 27)
+#define SPIUMOSIH   (1 << 25)
+#define SPIUMISOH   (1 << 24)
+#define SPIUWRBYO   (1 << 11)
+#define SPIURDBYO   (1 << 10)
+#define SPIUSME     (1 << 7)
+#define SPIUSSE     (1 << 6)
+#define SPIUCSSETUP (1 << 5)
+#define SPIUCSHOLD  (1 << 4)
+#define SPIUDUPLEX  (1 << 0)
+#define SPICWBO     (1 << 26)
+#define SPICRBO     (1 << 25)
+#define SPILMOSI    17
+#define SPILMISO    8
+#define SPIMMOSI    0x1FF
+#define SPIMMISO    0x1FF
+
+#endif
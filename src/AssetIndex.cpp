@@ -0,0 +1,382 @@
+// Index of the static files in SPIFFS
+
+#include "AssetIndex.h"
+#include "Config.h"
+#include "WiFiServer.h"
+#include "WiFiClient.h"
+#include "RepRapWebServer.h"
+
+namespace AssetIndex
+{
+  const size_t indexSize = maxAssets * 2;     // power of 2, and at most half full so that probe sequences stay short
+
+  static Asset assets[maxAssets];
+  static uint8_t index[indexSize];            // asset numbers by path hash, 0xFF if empty
+  static size_t numAssets = 0;
+  static size_t pinnedBytes = 0;
+
+  struct MimeTypeEntry
+  {
+    char suffix[6];
+    char type[24];
+  };
+
+  // MIME types by path suffix, the first one that matches is used
+  static const MimeTypeEntry mimeTypes[] PROGMEM =
+  {
+    { ".html", "text/html" },
+    { ".htm", "text/html" },
+    { "/", "text/html" },
+    { ".css", "text/css" },
+    { ".js", "application/javascript" },
+    { ".json", "application/json" },
+    { ".png", "image/png" },
+    { ".ico", "image/x-icon" },
+    { ".svg", "image/svg+xml" },
+    { ".gz", "application/x-gzip" },
+    { "", "text/plain" }
+  };
+
+  struct CachePolicy
+  {
+    char suffix[5];
+    char cacheControl[14];
+  };
+
+  // Cache policies by path suffix, the first one that matches is used. Every response carries an ETag,
+  // so a client that must revalidate the page gets a 304 reply without the file being read.
+  static const CachePolicy cachePolicies[] PROGMEM =
+  {
+    { ".ico", "max-age=86400" },
+    { ".png", "max-age=86400" },
+    { ".svg", "max-age=86400" },
+    { "", "no-cache" }
+  };
+
+  static const char header200[] PROGMEM = "HTTP/1.1 200 OK\r\n";
+  static const char header304[] PROGMEM = "HTTP/1.1 304 Not Modified\r\n";
+  static const char headerCacheControl[] PROGMEM = "Cache-Control: ";
+  static const char headerETag[] PROGMEM = "\r\nETag: ";
+  static const char headerContentType[] PROGMEM = "\r\nContent-Type: ";
+  static const char headerContentLength[] PROGMEM = "\r\nContent-Length: ";
+  static const char headerAcceptRanges[] PROGMEM = "\r\nAccept-Ranges: bytes\r\n";
+  static const char headerGzip[] PROGMEM = "Content-Encoding: gzip\r\n";
+  static const char headerLineEnd[] PROGMEM = "\r\n";
+
+  // Return true if the first length characters of a path end with a suffix that is in flash
+  static bool EndsWith_P(const char *path, size_t length, PGM_P suffix)
+  {
+    const size_t suffixLength = strlen_P(suffix);
+    return suffixLength <= length && strncmp_P(path + length - suffixLength, suffix, suffixLength) == 0;
+  }
+
+  static uint8_t GetMimeType(const char *path, size_t length)
+  {
+    uint8_t i = 0;
+    while (!EndsWith_P(path, length, mimeTypes[i].suffix))
+    {
+      ++i;
+    }
+    return i;
+  }
+
+  static uint8_t GetCachePolicy(const char *path, size_t length)
+  {
+    uint8_t i = 0;
+    while (!EndsWith_P(path, length, cachePolicies[i].suffix))
+    {
+      ++i;
+    }
+    return i;
+  }
+
+  // Return the FNV-1a hash of the contents of a file
+  static uint32_t HashFile(const char *fileName)
+  {
+    uint32_t hash = 2166136261u;
+    File f = SPIFFS.open(fileName, "r");
+    if (f)
+    {
+      uint8_t buf[256];
+      size_t n;
+      while ((n = f.read(buf, sizeof(buf))) != 0)
+      {
+        for (size_t i = 0; i < n; ++i)
+        {
+          hash = (hash ^ buf[i]) * 16777619u;
+        }
+        yield();
+      }
+      f.close();
+    }
+    return hash;
+  }
+
+  static const Asset *Find(const char *path, size_t length)
+  {
+    const uint32_t hash = RepRapWebServer::hashPath(path, length);
+    for (size_t slot = hash & (indexSize - 1); index[slot] != 0xFF; slot = (slot + 1) & (indexSize - 1))
+    {
+      const Asset& asset = assets[index[slot]];
+      if (asset.hash == hash && asset.pathLength == length && memcmp(asset.fileName, path, length) == 0)
+      {
+        return &asset;
+      }
+    }
+    return nullptr;
+  }
+
+  // Add an asset to the index, served under the first pathLength characters of the file name. Assets must be added in order of preference,
+  // because a path that is already present is not added again. The first asset of a file must have the whole file name as its path,
+  // and it owns the copy of the file name that the others share. Return true if the asset was added.
+  static bool Add(const char *fileName, size_t pathLength, size_t size, bool gzip)
+  {
+    if (numAssets == maxAssets || pathLength > 0xFF || Find(fileName, pathLength) != nullptr)
+    {
+      return false;
+    }
+
+    Asset& asset = assets[numAssets];
+    asset.fileName = fileName;
+    asset.pathLength = (uint8_t)pathLength;
+    asset.hash = RepRapWebServer::hashPath(fileName, pathLength);
+    asset.size = size;
+    asset.gzip = gzip;
+    asset.mimeType = GetMimeType(fileName, pathLength);
+    asset.cachePolicy = GetCachePolicy(fileName, pathLength);
+    asset.data = nullptr;
+
+    // Another path may refer to the same file, e.g. the index page, in which case we already have its hash
+    size_t other = 0;
+    while (other < numAssets && assets[other].fileName != fileName)
+    {
+      ++other;
+    }
+    if (other < numAssets)
+    {
+      memcpy(asset.etag, assets[other].etag, sizeof(asset.etag));
+    }
+    else
+    {
+      snprintf(asset.etag, sizeof(asset.etag), "\"%08x\"", (unsigned int)HashFile(fileName));
+    }
+
+    size_t slot = asset.hash & (indexSize - 1);
+    while (index[slot] != 0xFF)
+    {
+      slot = (slot + 1) & (indexSize - 1);
+    }
+    index[slot] = (uint8_t)numAssets;
+    ++numAssets;
+    return true;
+  }
+
+  static bool IsIndexPage(const char *path, size_t length)
+  {
+    return EndsWith_P(path, length, PSTR("/reprap.htm"));
+  }
+
+  // Add a file under its own name, and under the names it is also served under: without .gz if it is compressed,
+  // and as its directory if it is the index page
+  static void AddFile(const String& name, size_t size)
+  {
+    char *fileName = strdup(name.c_str());
+    if (fileName == nullptr)
+    {
+      return;
+    }
+    const size_t length = name.length();
+    if (!Add(fileName, length, size, false))
+    {
+      free(fileName);
+      return;
+    }
+
+    size_t pathLength = length;
+    bool gzip = false;
+    if (name.endsWith(".gz"))
+    {
+      pathLength -= 3;
+      gzip = true;
+      Add(fileName, pathLength, size, gzip);
+    }
+    if (IsIndexPage(fileName, pathLength))
+    {
+      Add(fileName, pathLength - 10, size, gzip);
+    }
+  }
+
+  // Keep the smallest files in RAM, up to the pinned size limits
+  static void PinSmallAssets()
+  {
+    for (;;)
+    {
+      Asset *smallest = nullptr;
+      for (size_t i = 0; i < numAssets; ++i)
+      {
+        Asset& asset = assets[i];
+        if (asset.data == nullptr && asset.size != 0 && asset.size <= maxPinnedAssetSize && (smallest == nullptr || asset.size < smallest->size))
+        {
+          smallest = &asset;
+        }
+      }
+      if (smallest == nullptr || pinnedBytes + smallest->size > maxPinnedAssetBytes)
+      {
+        return;
+      }
+
+      uint8_t *data = (uint8_t*)malloc(smallest->size);
+      if (data == nullptr)
+      {
+        return;
+      }
+      File f = Open(*smallest);
+      const bool ok = f && f.read(data, smallest->size) == smallest->size;
+      f.close();
+      if (!ok)
+      {
+        free(data);
+        return;
+      }
+
+      // Another path may refer to the same file, e.g. the index page
+      for (size_t i = 0; i < numAssets; ++i)
+      {
+        if (assets[i].fileName == smallest->fileName)
+        {
+          assets[i].data = data;
+        }
+      }
+      pinnedBytes += smallest->size;
+    }
+  }
+
+  void Build()
+  {
+    for (size_t i = 0; i < numAssets; ++i)
+    {
+      if (assets[i].data != nullptr)
+      {
+        // Free each pinned buffer once, even if several assets share it
+        uint8_t *data = assets[i].data;
+        free(data);
+        for (size_t j = i; j < numAssets; ++j)
+        {
+          if (assets[j].data == data)
+          {
+            assets[j].data = nullptr;
+          }
+        }
+      }
+    }
+
+    // The asset whose path is the whole file name owns it, and was added before the others that share it
+    while (numAssets != 0)
+    {
+      Asset& asset = assets[--numAssets];
+      if (asset.fileName[asset.pathLength] == '\0')
+      {
+        free(const_cast<char*>(asset.fileName));
+      }
+      asset = Asset();
+    }
+    pinnedBytes = 0;
+    memset(index, 0xFF, sizeof(index));
+
+    // Uncompressed files take precedence over compressed ones with the same name, so add them first
+    Dir dir = SPIFFS.openDir("/");
+    while (dir.next())
+    {
+      String fileName = dir.fileName();
+      if (!fileName.endsWith(".gz"))
+      {
+        AddFile(fileName, dir.fileSize());
+      }
+    }
+
+    // Compressed files are served both under their own name and without the .gz extension
+    dir = SPIFFS.openDir("/");
+    while (dir.next())
+    {
+      String fileName = dir.fileName();
+      if (fileName.endsWith(".gz"))
+      {
+        AddFile(fileName, dir.fileSize());
+      }
+    }
+
+    PinSmallAssets();
+  }
+
+  size_t Count()
+  {
+    return numAssets;
+  }
+
+  const Asset *Find(const char *path)
+  {
+    return (numAssets == 0) ? nullptr : Find(path, strlen(path));
+  }
+
+  File Open(const Asset& asset)
+  {
+    return SPIFFS.open(asset.fileName, "r");
+  }
+
+  PGM_P MimeType(const Asset& asset)
+  {
+    return mimeTypes[asset.mimeType].type;
+  }
+
+  // Append a string from flash to a header, keeping count of the length even if it doesn't fit
+  static void Append_P(char *buf, size_t bufSize, size_t& length, PGM_P s)
+  {
+    const size_t n = strlen_P(s);
+    if (length + n < bufSize)
+    {
+      memcpy_P(buf + length, s, n);
+    }
+    length += n;
+  }
+
+  static void Append(char *buf, size_t bufSize, size_t& length, const char *s)
+  {
+    const size_t n = strlen(s);
+    if (length + n < bufSize)
+    {
+      memcpy(buf + length, s, n);
+    }
+    length += n;
+  }
+
+  size_t FormatHeader(const Asset& asset, bool notModified, char *buf, size_t bufSize)
+  {
+    size_t length = 0;
+    Append_P(buf, bufSize, length, (notModified) ? header304 : header200);
+    Append_P(buf, bufSize, length, headerCacheControl);
+    Append_P(buf, bufSize, length, cachePolicies[asset.cachePolicy].cacheControl);
+    Append_P(buf, bufSize, length, headerETag);
+    Append(buf, bufSize, length, asset.etag);
+    if (notModified)
+    {
+      Append_P(buf, bufSize, length, headerLineEnd);
+    }
+    else
+    {
+      char sizeText[11];
+      snprintf(sizeText, sizeof(sizeText), "%u", (unsigned int)asset.size);
+      Append_P(buf, bufSize, length, headerContentType);
+      Append_P(buf, bufSize, length, MimeType(asset));
+      Append_P(buf, bufSize, length, headerContentLength);
+      Append(buf, bufSize, length, sizeText);
+      Append_P(buf, bufSize, length, headerAcceptRanges);
+      if (asset.gzip)
+      {
+        Append_P(buf, bufSize, length, headerGzip);
+      }
+    }
+    return (length < bufSize) ? length : 0;
+  }
+}
+
+// End
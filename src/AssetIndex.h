@@ -0,0 +1,48 @@
+// Index of the static files in SPIFFS, built once at startup so that serving a file needs no directory searches or MIME lookups.
+
+#ifndef _ASSETINDEX_H_INCLUDED
+#define _ASSETINDEX_H_INCLUDED
+
+#include <Arduino.h>
+#include <FS.h>
+
+namespace AssetIndex
+{
+  // An asset takes little RAM: its path is a prefix of the name of the file it is served from, which is stored once for all the paths
+  // of that file, and its MIME type and cache policy are indexes into tables in flash. Response headers are built when they are sent.
+  struct Asset
+  {
+    const char *fileName;     // name of the file in SPIFFS, which may have .gz added to the path
+    uint32_t hash;            // hash of the path
+    uint32_t size;
+    uint8_t *data;            // file contents if the file is pinned in RAM, else nullptr
+    uint8_t pathLength;       // the URI the file is served under is the first pathLength characters of fileName
+    uint8_t mimeType;         // index into the MIME type table
+    uint8_t cachePolicy;      // index into the cache policy table
+    bool gzip;                // true if the file is served with Content-Encoding: gzip
+    char etag[11];            // quoted hash of the file contents
+  };
+
+  const size_t maxHeaderLength = 256;
+
+  // Index the files in SPIFFS. Call this after SPIFFS.begin().
+  void Build();
+
+  // Return the number of paths in the index
+  size_t Count();
+
+  // Return the file to serve for a URI, or nullptr if there is none
+  const Asset *Find(const char *path);
+
+  // Open the file of an asset that is not pinned in RAM
+  File Open(const Asset& asset);
+
+  // Return the MIME type of an asset, which is in flash
+  PGM_P MimeType(const Asset& asset);
+
+  // Write the status line and fixed headers of a 200 response for an asset, or of a 304 response if notModified is true.
+  // Return the length of the header, or 0 if it doesn't fit in the buffer.
+  size_t FormatHeader(const Asset& asset, bool notModified, char *buf, size_t bufSize);
+}
+
+#endif
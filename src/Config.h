@@ -10,12 +10,51 @@ const char* const softApName = "DuetWiFi";
 #define SHOW_PASSWORDS
 
 // Define the maximum length (bytes) of file upload data per SPI packet. Use a multiple of the SD card file or cluster size for efficiency.
+// This is the value we use at startup. The SAM may change it by sending a ttSetSpiDataLength message, within the range given below.
 // ************ This must be kept in step with the corresponding value in RepRapFirmwareWiFi *************
 const uint32_t maxSpiFileData = 2048;
 
+// Define the range of SPI packet data lengths that we will agree to. These are passed to the SAM in the network info message.
+const uint32_t minNegotiatedSpiFileData = 512;
+const uint32_t maxNegotiatedSpiFileData = 4096;
+
+// Define the number of outgoing and incoming SPI transaction buffers.
+// Having more than one of each allows the next fragment of postdata to be read from the network while the previous one is waiting to be sent,
+// and lets the SAM send us another message while we are still processing the previous one. Each buffer costs the maximum SPI packet data length plus 24 bytes of RAM.
+const size_t numSpiOutBuffers = 2;
+const size_t numSpiInBuffers = 2;
+
+// Define how many rr_ requests we can queue, and how many of those can be at the SAM at once.
+// Older SAM firmware doesn't return the sequence number in its replies, so it can only have one request at a time.
+// Firmware that does return it says so with a ttEnablePipelining message, after which it can have up to maxPipelinedRrRequests.
+const size_t maxQueuedRrRequests = 4;
+const size_t maxRrRequestsAtSam = 1;
+const size_t maxPipelinedRrRequests = maxQueuedRrRequests;
+
+// Define how long (ms) to wait for the SAM to reply to a rr_ request, or to send the next fragment of a reply
+const uint32_t rrReplyTimeout = 5000;
+
+// Define how many files in SPIFFS we index for the web server, and how much RAM we may use to keep the small ones in memory
+const size_t maxAssets = 64;                  // must be a power of 2 and no more than 127
+const size_t maxPinnedAssetSize = 2048;       // largest file we keep in RAM
+const size_t maxPinnedAssetBytes = 4096;      // total size of the files we keep in RAM
+
+// Define how long (ms) to wait for more postdata before sending a part-filled SPI buffer to the SAM
+const uint32_t postdataFlushTime = 20;
+
+// Define how much G-code from the telnet client we buffer while the SAM is busy, and how often (ms) we ask the SAM for replies to pass back.
+// A line longer than the buffer is thrown away and the client is sent an error, rather than part of it being sent as a command.
+const size_t telnetBufferSize = 512;
+const uint32_t telnetPollInterval = 250;
+
 // Define the SPI clock frequency
-// The SAM occasionally transmits incorrect data at 40MHz, so we now use 26.7MHz.
+// The SAM occasionally transmits incorrect data at 40MHz, so we use 26.7MHz unless the SAM has agreed to add a CRC to each packet,
+// in which case bad packets are detected and sent again. If we keep getting bad packets anyway, we drop back to the lower frequency
+// until we have had a run of good ones.
 const uint32_t spiFrequency = 27000000;     // This will get rounded down to 80MHz/3
+const uint32_t spiFrequencyWithCrc = 40000000;
+const uint32_t maxConsecutiveCrcErrors = 8;
+const uint32_t crcRetryGoodPackets = 1000;  // good packets at the lower frequency before we try the higher one again
 
 // Pin numbers
 const int SamSSPin = 15;          // GPIO15, output to SAM, SS pin for SPI transfer
@@ -0,0 +1,27 @@
+// CRC32 calculation for SPI packets
+
+#ifndef _CRC32_H_INCLUDED
+#define _CRC32_H_INCLUDED
+
+#include <Arduino.h>
+
+// Standard CRC32 (as used by Ethernet and zip), calculated incrementally so that a packet can be checked a piece at a time
+class Crc32
+{
+public:
+  Crc32() : crc(0xFFFFFFFF) { }
+
+  // Add some data to the CRC
+  void Update(const void *data, size_t length);
+
+  // Copy some data and add it to the CRC in the same pass
+  void UpdateAndCopy(void *dst, const void *src, size_t length);
+
+  // Get the CRC of the data so far
+  uint32_t Get() const { return ~crc; }
+
+private:
+  uint32_t crc;
+};
+
+#endif
@@ -540,4 +540,77 @@ void HSPIClass::transferDwords_(uint32_t * out, uint32_t * in, uint8_t size) {
     }
 }
 
+/**
+ * Transfer a block of dwords, using the two halves of the FIFO alternately so that
+ * one burst can be loaded and the previous one unloaded while another is being shifted.
+ * This leaves only a short gap between bursts instead of the FIFO load and unload time.
+ * @param out uint32_t *  data to send, or nullptr to send dummy data
+ * @param in  uint32_t *  buffer for received data, or nullptr to discard it
+ * @param size uint32_t   number of dwords
+ */
+void HSPIClass::transferDwordsStreamed(uint32_t * out, uint32_t * in, uint32_t size) {
+    const uint32_t halfSize = 8;                    // dwords in each half of the FIFO
+
+    if(size <= 16) {
+        transferDwords(out, in, size);              // a single burst can't be overlapped with anything
+        return;
+    }
+
+    while(SPI1CMD & SPIBUSY) {}
+
+    uint32_t half = 0;                              // which half of the FIFO the burst being shifted uses
+    uint8_t burstSize = halfSize;
+    volatile uint32_t * fifoPtr = &SPI1W0;
+    for(uint8_t i = 0; i < burstSize; ++i) {
+        *fifoPtr++ = (out != nullptr) ? *out++ : 0xFFFFFFFF;
+    }
+    startBurst_(half, burstSize);
+    size -= burstSize;
+
+    while(size != 0) {
+        // Load the next burst into the other half of the FIFO while the current one is being shifted
+        const uint32_t nextHalf = half ^ 1;
+        const uint8_t nextBurstSize = (size > halfSize) ? halfSize : size;
+        fifoPtr = &SPI1W0 + nextHalf * halfSize;
+        for(uint8_t i = 0; i < nextBurstSize; ++i) {
+            *fifoPtr++ = (out != nullptr) ? *out++ : 0xFFFFFFFF;
+        }
+
+        while(SPI1CMD & SPIBUSY) {}
+        startBurst_(nextHalf, nextBurstSize);
 
+        // Unload the received data from the burst that has just finished
+        if(in != nullptr) {
+            volatile uint32_t * fifoPtrRd = &SPI1W0 + half * halfSize;
+            for(uint8_t i = 0; i < burstSize; ++i) {
+                *in++ = *fifoPtrRd++;
+            }
+        }
+
+        half = nextHalf;
+        burstSize = nextBurstSize;
+        size -= nextBurstSize;
+    }
+
+    while(SPI1CMD & SPIBUSY) {}
+    if(in != nullptr) {
+        volatile uint32_t * fifoPtrRd = &SPI1W0 + half * halfSize;
+        for(uint8_t i = 0; i < burstSize; ++i) {
+            *in++ = *fifoPtrRd++;
+        }
+    }
+
+    // Go back to using the low half of the FIFO for the other transfer functions
+    SPI1U &= ~(SPIUMOSIH | SPIUMISOH);
+}
+
+// Start shifting a burst of dwords that has already been loaded into one half of the FIFO
+void HSPIClass::startBurst_(uint32_t half, uint8_t size) {
+    if(half != 0) {
+        SPI1U |= (SPIUMOSIH | SPIUMISOH);
+    } else {
+        SPI1U &= ~(SPIUMOSIH | SPIUMISOH);
+    }
+    setDataBits(size * 32);
+    SPI1CMD |= SPIBUSY;
+}
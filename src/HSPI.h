@@ -62,6 +62,7 @@ public:
   void writePattern(uint8_t * data, uint8_t size, uint32_t repeat);
   void transferBytes(uint8_t * out, uint8_t * in, uint32_t size);
   void transferDwords(uint32_t * out, uint32_t * in, uint32_t size);
+  void transferDwordsStreamed(uint32_t * out, uint32_t * in, uint32_t size);
   void endTransaction(void);
 private:
   bool useHwCs;
@@ -70,6 +71,7 @@ private:
   void writePattern_(uint8_t * data, uint8_t size, uint8_t repeat);
   void transferBytes_(uint8_t * out, uint8_t * in, uint8_t size);
   void transferDwords_(uint32_t * out, uint32_t * in, uint8_t size);
+  void startBurst_(uint32_t half, uint8_t size);
 public:
   void setDataBits(uint16_t bits);
 };
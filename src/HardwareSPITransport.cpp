@@ -0,0 +1,90 @@
+// Hardware transport for the SPI link to the SAM
+
+#include "HardwareSPITransport.h"
+#include "Config.h"
+#include "HSPI.h"
+
+static HSPIClass hspi;
+
+// The SAM ready interrupt posts an event to this task, which calls back into the transaction manager when the Arduino loop next yields.
+// The Arduino core runs the loop as a priority 1 task, so we use priority 2 to get in ahead of it.
+const uint8_t samReadyTaskPriority = USER_TASK_PRIO_2;
+const uint8_t samReadyTaskQueueLength = 2;
+
+SPITransport::ReadyCallback HardwareSPITransport::readyCallback = nullptr;
+os_event_t HardwareSPITransport::taskQueue[samReadyTaskQueueLength];
+
+void HardwareSPITransport::Init()
+{
+  pinMode(SamTfrReadyPin, INPUT);
+  pinMode(EspReqTransferPin, OUTPUT);
+  digitalWrite(EspReqTransferPin, LOW);
+  pinMode(SamSSPin, OUTPUT);
+  digitalWrite(SamSSPin, HIGH);
+
+  // Set up the fast SPI channel
+  hspi.begin();
+  hspi.setBitOrder(MSBFIRST);
+  hspi.setDataMode(SPI_MODE1);
+  hspi.setFrequency(spiFrequency);
+}
+
+bool HardwareSPITransport::IsSamReady()
+{
+  return digitalRead(SamTfrReadyPin) == HIGH;
+}
+
+void HardwareSPITransport::OnSamReady(ReadyCallback callback)
+{
+  readyCallback = callback;
+  system_os_task(SamReadyTask, samReadyTaskPriority, taskQueue, samReadyTaskQueueLength);
+  attachInterrupt(SamTfrReadyPin, SamReadyInterrupt, RISING);
+}
+
+// Interrupt handler for a rising edge on the SAM TfrReady pin. Just note the time and defer the work to a task.
+void ICACHE_RAM_ATTR HardwareSPITransport::SamReadyInterrupt()
+{
+  system_os_post(samReadyTaskPriority, 0, micros());
+}
+
+void HardwareSPITransport::SamReadyTask(os_event_t *event)
+{
+  if (readyCallback != nullptr)
+  {
+    readyCallback(event->par);
+  }
+}
+
+void HardwareSPITransport::RequestTransfer(bool wanted)
+{
+  digitalWrite(EspReqTransferPin, (wanted) ? HIGH : LOW);
+}
+
+void HardwareSPITransport::BeginTransfer()
+{
+  hspi.beginTransaction();
+  digitalWrite(SamSSPin, LOW);            // assert CS to SAM
+}
+
+void HardwareSPITransport::EndTransfer()
+{
+  digitalWrite(SamSSPin, HIGH);           // de-assert CS to SAM to end the transaction and tell SAM the transfer is complete
+  hspi.endTransaction();
+}
+
+void HardwareSPITransport::TransferDwords(uint32_t *out, uint32_t *in, uint32_t numDwords)
+{
+  hspi.transferDwordsStreamed(out, in, numDwords);
+}
+
+void HardwareSPITransport::WriteDwords(uint32_t *out, uint32_t numDwords)
+{
+  hspi.transferDwordsStreamed(out, nullptr, numDwords);
+}
+
+void HardwareSPITransport::SetFrequency(uint32_t frequency)
+{
+  hspi.setFrequency(frequency);
+}
+
+// End
@@ -0,0 +1,33 @@
+// Transport that uses the HSPI channel and GPIO pins defined in Config.h
+
+#ifndef _HARDWARESPITRANSPORT_H_INCLUDED
+#define _HARDWARESPITRANSPORT_H_INCLUDED
+
+#include "SPITransport.h"
+
+extern "C" {
+#include "user_interface.h"     // for os_event_t
+}
+
+class HardwareSPITransport : public SPITransport
+{
+public:
+  void Init() override;
+  bool IsSamReady() override;
+  void OnSamReady(ReadyCallback callback) override;
+  void RequestTransfer(bool wanted) override;
+  void BeginTransfer() override;
+  void EndTransfer() override;
+  void TransferDwords(uint32_t *out, uint32_t *in, uint32_t numDwords) override;
+  void WriteDwords(uint32_t *out, uint32_t numDwords) override;
+  void SetFrequency(uint32_t frequency) override;
+
+private:
+  static void SamReadyInterrupt();
+  static void SamReadyTask(os_event_t *event);
+
+  static ReadyCallback readyCallback;
+  static os_event_t taskQueue[];
+};
+
+#endif
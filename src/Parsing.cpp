@@ -34,566 +34,978 @@
 // Parse an incoming request
 // Returns true if a valid request.
 // On return, postLength is nonzero if we are in printer server mode and there is postdata to read.
+// The request head has already been read by _readRequestHead().
 bool RepRapWebServer::_parseRequest(WiFiClient& client, uint32_t &postLength)
 {
   postLength = 0;  
+  const RequestHead& head = _head;
 
-  // Read the first line of HTTP request
-  String req = client.readStringUntil('\r');
-  client.readStringUntil('\n');
-  //reset header value
-  for (int i = 0; i < _headerKeysCount; ++i) {
-    _currentHeaders[i].value =String();
-   }
-
-  // First line of HTTP request looks like "GET /path HTTP/1.1"
-  // Retrieve the "/path" part by finding the spaces
-  int addr_start = req.indexOf(' ');
-  int addr_end = req.indexOf(' ', addr_start + 1);
-  if (addr_start == -1 || addr_end == -1) {
-#ifdef DEBUG
-    DEBUG_OUTPUT.print("Invalid request: ");
-    DEBUG_OUTPUT.println(req);
-#endif
-    return false;
-  }
-
-  String methodStr = req.substring(0, addr_start);
-  String url = req.substring(addr_start + 1, addr_end);
-  _currentFullUri = url;
-  String searchStr = "";
-  int hasSearch = url.indexOf('?');
-  if (hasSearch != -1){
-    searchStr = url.substring(hasSearch + 1);
-    url = url.substring(0, hasSearch);
-  }
-  _currentUri = url;
+  _currentUri = head.path;
+  _currentQuery = head.query;
+  _hostHeader = head.host;
+  _ifNoneMatch = head.ifNoneMatch;
+  _rangeHeader = head.range;
 
   HTTPMethod method = HTTP_GET;
-  if (methodStr == "POST") {
+  if (strcmp(head.method, "POST") == 0) {
     method = HTTP_POST;
-  } else if (methodStr == "DELETE") {
+  } else if (strcmp(head.method, "DELETE") == 0) {
     method = HTTP_DELETE;
-  } else if (methodStr == "OPTIONS") {
+  } else if (strcmp(head.method, "OPTIONS") == 0) {
     method = HTTP_OPTIONS;
-  } else if (methodStr == "PUT") {
+  } else if (strcmp(head.method, "PUT") == 0) {
     method = HTTP_PUT;
-  } else if (methodStr == "PATCH") {
+  } else if (strcmp(head.method, "PATCH") == 0) {
     method = HTTP_PATCH;
   }
   _currentMethod = method;
 
+  // HTTP/1.1 connections are persistent unless the client says otherwise, HTTP/1.0 ones only if the client asks
+  bool http11 = (strcmp(head.version, "HTTP/1.1") == 0);
+  _currentConnection->http11 = http11;
+  _currentConnection->chunked = false;
+  _currentConnection->closeDelimited = false;
+  _currentConnection->bodyUnread = false;
+  bool keepAlive = (head.connection != NULL) ? _parseConnectionHeader(head.connection, http11) : http11;
+  _currentKeepAlive = _canKeepAlive(keepAlive);
+
 #ifdef DEBUG
   DEBUG_OUTPUT.print("method: ");
-  DEBUG_OUTPUT.print(methodStr);
+  DEBUG_OUTPUT.print(head.method);
   DEBUG_OUTPUT.print(" url: ");
-  DEBUG_OUTPUT.print(url);
+  DEBUG_OUTPUT.print(head.path);
   DEBUG_OUTPUT.print(" search: ");
-  DEBUG_OUTPUT.println(searchStr);
+  DEBUG_OUTPUT.println(head.query);
 #endif
 
-  //attach handler
-  RequestHandler* handler;
-  for (handler = _firstHandler; handler; handler = handler->next()) {
-    if (handler->canHandle(_currentMethod, _currentUri))
-      break;
+  //attach handler, trying the route table before the handler list
+  RequestHandler* handler = NULL;
+  _currentRoute = _findRoute(_currentMethod, _currentUri);
+  if (_currentRoute == NULL) {
+    for (handler = _firstHandler; handler; handler = handler->next()) {
+      if (handler->canHandle(_currentMethod, _currentUri))
+        break;
+    }
   }
   _currentHandler = handler;
 
-  String formData;
   // below is needed only when POST type request
   if (method == HTTP_POST || method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_DELETE)
   {
-    String boundaryStr;
-    String headerName;
-    String headerValue;
-    bool isForm = false;
-    uint32_t contentLength = 0;
-    //parse headers
-    while(1){
-      req = client.readStringUntil('\r');
-      client.readStringUntil('\n');
-      if (req == "") break;//no more headers
-      int headerDiv = req.indexOf(':');
-      if (headerDiv == -1){
-        break;
-      }
-      headerName = req.substring(0, headerDiv);
-      headerValue = req.substring(headerDiv + 1);
-      headerValue.trim();
-       _collectHeader(headerName.c_str(),headerValue.c_str());
-	  
-#ifdef DEBUG
-	  DEBUG_OUTPUT.print("headerName: ");
-	  DEBUG_OUTPUT.println(headerName);
-	  DEBUG_OUTPUT.print("headerValue: ");
-	  DEBUG_OUTPUT.println(headerValue);
-#endif
-	  
-      if (headerName == "Content-Type"){
-        if (headerValue.startsWith("text/plain")){
-          isForm = false;
-        } else if (headerValue.startsWith("multipart/form-data")){
-          boundaryStr = headerValue.substring(headerValue.indexOf('=')+1);
-          isForm = true;
-        }
-      } else if (headerName == "Content-Length"){
-        contentLength = headerValue.toInt();
-      } else if (headerName == "Host"){
-        _hostHeader = headerValue;
-      }
+    const char *boundary = NULL;
+    if (head.contentType != NULL && strncmp(head.contentType, "multipart/form-data", 19) == 0) {
+      boundary = strchr(head.contentType, '=');
+      boundary = (boundary != NULL) ? boundary + 1 : "";
     }
 
-    if (!isForm)
+    if (boundary == NULL)
     {
 #if 1   // DC42
-      if (_servingPrinter && method == HTTP_POST && contentLength != 0)
+      if (_servingPrinter && method == HTTP_POST && head.contentLength != 0)
       {
-        postLength = contentLength;     // tell caller that there is postdata to read
-        _parseArguments(searchStr);
-        return true;
+        postLength = head.contentLength;     // tell caller that there is postdata to read
+        return _parseArguments(head.query);
       }
 #endif
-      //some clients send headers first and data after (like we do)
-      //give them a chance
-      int tries = 100;//100ms max wait
-      while(!client.available() && tries--)delay(1);
-      size_t plainLen = client.available();
-      char *plainBuf = (char*)malloc(plainLen+1);
-      client.readBytes(plainBuf, plainLen);
-      plainBuf[plainLen] = '\0';
+      // Build the query followed by the body in the arena, leaving room to label the body as plain data.
+      // Read exactly Content-Length bytes, so that a pipelined request that follows the body is left for next time.
+      // The client's Content-Length is checked before it is added to anything, so that a huge one can't wrap round to a small allocation.
+      size_t plainLen = head.contentLength;
+      const size_t queryLen = strlen(head.query);
+      const size_t plainStart = queryLen + 7;
+      char *searchStr = (plainLen <= HTTP_REQUEST_ARENA_SIZE) ? (char*)_arena.allocate(plainStart + plainLen + 1) : NULL;
+      if (searchStr == NULL) {
+        _parseError = 413;                // no room for the body, and we mustn't carry on without its arguments
+        return false;
+      } else {
+        char *plainBuf = searchStr + plainStart;
+        if (!_readBody(client, (uint8_t*)plainBuf, plainLen)) {
+          return false;
+        }
+        plainBuf[plainLen] = '\0';
 #ifdef DEBUG
-      DEBUG_OUTPUT.print("Plain: ");
-      DEBUG_OUTPUT.println(plainBuf);
+        DEBUG_OUTPUT.print("Plain: ");
+        DEBUG_OUTPUT.println(plainBuf);
 #endif
-      if (plainBuf[0] == '{' || plainBuf[0] == '[' || strstr(plainBuf, "=") == NULL){
-        //plain post json or other data
-        searchStr += "plain=";
-        searchStr += plainBuf;
-      } else {
-        searchStr += plainBuf;
+        char *p = searchStr;
+        memcpy(p, head.query, queryLen);
+        p += queryLen;
+        if (queryLen != 0) {
+          *p++ = '&';
+        }
+        if (plainBuf[0] == '{' || plainBuf[0] == '[' || strchr(plainBuf, '=') == NULL){
+          //plain post json or other data
+          memcpy(p, "plain=", 6);
+          p += 6;
+        }
+        memmove(p, plainBuf, plainLen + 1);
+        if (!_splitArguments(searchStr)) {
+          return false;
+        }
       }
-      free(plainBuf);
     }
-    _parseArguments(searchStr);
-    if (isForm){
-      if (!_parseForm(client, boundaryStr, contentLength)) {
+    else
+    {
+      if (!_parseArguments(head.query) || !_parseForm(client, boundary, head.contentLength)) {
         return false;
       }
     }
-  } else {
-    String headerName;
-    String headerValue;
-    //parse headers
-    while(1){
-      req = client.readStringUntil('\r');
-      client.readStringUntil('\n');
-      if (req == "") break;//no more headers
-      int headerDiv = req.indexOf(':');
-      if (headerDiv == -1){
-        break;
-      }
-      headerName = req.substring(0, headerDiv);
-      headerValue = req.substring(headerDiv + 2);
-      _collectHeader(headerName.c_str(),headerValue.c_str());
-	  
+  } else if (!_parseArguments(head.query)) {
+    return false;
+  }
+  if (!_currentKeepAlive) {
+    client.flush();     // discard anything else the client sent, but not if it may be the next request on a persistent connection
+  }
+
 #ifdef DEBUG
-	  DEBUG_OUTPUT.print("headerName: ");
-	  DEBUG_OUTPUT.println(headerName);
-	  DEBUG_OUTPUT.print("headerValue: ");
-	  DEBUG_OUTPUT.println(headerValue);
+  DEBUG_OUTPUT.print("Request: ");
+  DEBUG_OUTPUT.println(head.path);
+  DEBUG_OUTPUT.print(" Arguments: ");
+  DEBUG_OUTPUT.println(head.query);
 #endif
-	  
-	  if (headerName == "Host"){
-        _hostHeader = headerValue;
+
+  return true;
+}
+
+// Read a body of known length, waiting for the client to send it. Returns false if it stops sending first.
+bool RepRapWebServer::_readBody(WiFiClient& client, uint8_t* buf, size_t length)
+{
+  size_t got = 0;
+  uint32_t lastData = millis();
+  while (got < length) {
+    const int n = client.read(buf + got, length - got);
+    if (n > 0) {
+      got += n;
+      lastData = millis();
+    } else if (!client.connected() || millis() - lastData > HTTP_MAX_DATA_WAIT) {
+      return false;
+    } else {
+      yield();
+    }
+  }
+  return true;
+}
+
+// Start reading a request head on a connection. The request buffer is shared, so only one connection reads a head at a time.
+void RepRapWebServer::_beginRequestHead(Connection& conn)
+{
+  RequestHead& head = _head;
+  head.method = head.path = head.query = head.version = NULL;
+  head.host = "";
+  head.contentType = head.connection = NULL;
+  head.ifNoneMatch = head.range = "";
+  head.contentLength = 0;
+
+  //reset header value
+  for (int i = 0; i < _headerKeysCount; ++i) {
+    _currentHeaders[i].value = "";
+  }
+
+  _parseError = 0;
+  _headLength = _headLineStart = 0;
+  _headSkipping = false;
+  _headStartTime = millis();
+  _headConnection = &conn;
+  conn.state = ConnectionState::ReadingHead;
+}
+
+// Read what the client has sent of the request line and headers into the request buffer, splitting each line up in place as soon as it is complete.
+// Only the lines that we keep pointers into stay in the buffer. Other headers are dropped, however long they are.
+// Returns Incomplete when the client has sent nothing more for now, so that we can get on with other work until it does.
+// Returns Failed if the request line was malformed, or with _parseError set to 414 or 431 if the request line or a header that we keep didn't fit in the buffer.
+RepRapWebServer::HeadStatus RepRapWebServer::_readRequestHead(WiFiClient& client)
+{
+  RequestHead& head = _head;
+  for (;;) {
+    int c = client.read();
+    if (c < 0) {
+      return HeadStatus::Incomplete;
+    }
+    if (_headSkipping) {
+      _headSkipping = (c != '\n');
+      continue;
+    }
+    if (c != '\n') {
+      if (_headLength + 1 >= sizeof(_requestBuf)) {
+        if (head.method == NULL) {
+          _parseError = 414;
+          return HeadStatus::Failed;
+        }
+        const char *line = _requestBuf + _headLineStart;
+        const char *colon = (const char*)memchr(line, ':', _headLength - _headLineStart);
+        if (colon == NULL || _keepsHeader(line, colon - line)) {
+          _parseError = 431;
+          return HeadStatus::Failed;
+        }
+        _headLength = _headLineStart;           // drop what we have of this header and skip the rest of it
+        _headSkipping = true;
+        continue;
       }
+      _requestBuf[_headLength++] = (char)c;
+      continue;
+    }
+
+    // End of a line, so terminate it in place, dropping the CR
+    if (_headLength > _headLineStart && _requestBuf[_headLength - 1] == '\r') {
+      --_headLength;
+    }
+    _requestBuf[_headLength++] = '\0';
+    char *line = _requestBuf + _headLineStart;
+    _headLineStart = _headLength;
+
+    if (head.method == NULL) {
+      if (*line == '\0') {
+        _headLineStart = _headLength = 0;       // ignore empty lines before the request line
+      } else if (!_parseRequestLine(line, head)) {
+        return HeadStatus::Failed;
+      }
+    } else if (*line == '\0') {
+      return HeadStatus::Complete;              // empty line ends the headers
+    } else if (!_parseHeaderLine(line, head)) {
+      _headLength = _headLineStart = line - _requestBuf;     // nothing points into this line, so reuse its space
     }
-    _parseArguments(searchStr);
   }
-  client.flush();
+}
+
+// Split a request line such as "GET /path?query HTTP/1.1" into its parts
+bool RepRapWebServer::_parseRequestLine(char* line, RequestHead& head)
+{
+  char *path = strchr(line, ' ');
+  if (path == NULL) {
+    return false;
+  }
+  *path++ = '\0';
+  char *version = strchr(path, ' ');
+  if (version == NULL) {
+    return false;
+  }
+  *version++ = '\0';
+
+  char *query = strchr(path, '?');
+  if (query != NULL) {
+    *query++ = '\0';
+  } else {
+    query = version - 1;            // points to the empty string
+  }
+  head.method = line;
+  head.path = path;
+  head.query = query;
+  head.version = version;
+  return true;
+}
+
+// Split a header line into name and value and note the headers we act on. Lines without a colon are ignored.
+// Returns true if we keep a pointer into the line.
+bool RepRapWebServer::_parseHeaderLine(char* line, RequestHead& head)
+{
+  char *value = strchr(line, ':');
+  if (value == NULL) {
+    return false;
+  }
+  *value++ = '\0';
+  while (*value == ' ' || *value == '\t') {
+    ++value;
+  }
+  char *end = value + strlen(value);
+  while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+    *--end = '\0';
+  }
+  bool keep = _collectHeader(line, value);
 
 #ifdef DEBUG
-  DEBUG_OUTPUT.print("Request: ");
-  DEBUG_OUTPUT.println(url);
-  DEBUG_OUTPUT.print(" Arguments: ");
-  DEBUG_OUTPUT.println(searchStr);
+  DEBUG_OUTPUT.print("headerName: ");
+  DEBUG_OUTPUT.println(line);
+  DEBUG_OUTPUT.print("headerValue: ");
+  DEBUG_OUTPUT.println(value);
 #endif
 
+  if (strcasecmp(line, "Content-Type") == 0) {
+    head.contentType = value;
+  } else if (strcasecmp(line, "Content-Length") == 0) {
+    head.contentLength = strtoul(value, NULL, 10);
+    return keep;
+  } else if (strcasecmp(line, "Host") == 0) {
+    head.host = value;
+  } else if (strcasecmp(line, "Connection") == 0) {
+    head.connection = value;
+  } else if (strcasecmp(line, "If-None-Match") == 0) {
+    head.ifNoneMatch = value;
+  } else if (strcasecmp(line, "Range") == 0) {
+    head.range = value;
+  } else {
+    return keep;
+  }
   return true;
 }
 
-// Try to read the requested amount of postdata. Return the number of bytes read.
-size_t RepRapWebServer::readPostdata(WiFiClient& client, uint8_t *buffer, size_t buflen)
+// Return true if we need the whole of a header with this name, so it must fit in the request buffer
+bool RepRapWebServer::_keepsHeader(const char* name, size_t length) const
 {
-  size_t bytesRead = 0;
-  while (bytesRead < buflen)
-  {
-    uint32_t startTime = millis();
-    while(client.available() == 0)
-    {
-      if (millis() - startTime > 200)  // 200ms max wait for a buffer full
-      {
-        return bytesRead;
-      }
-      yield();
+  static const char* const keptHeaders[] = { "Content-Type", "Content-Length", "Host", "Connection", "If-None-Match", "Range" };
+  for (size_t i = 0; i < sizeof(keptHeaders)/sizeof(keptHeaders[0]); ++i) {
+    if (strlen(keptHeaders[i]) == length && strncasecmp(keptHeaders[i], name, length) == 0) {
+      return true;
     }
+  }
+  for (int i = 0; i < _headerKeysCount; ++i) {
+    if (_currentHeaders[i].key.length() == length && strncasecmp(_currentHeaders[i].key.c_str(), name, length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
 
-    // Don't call readBytes here, it reads characters one at a time. Use read() instead.
-    size_t readThisTime = client.read(buffer, buflen - bytesRead);
-    buffer += readThisTime;
-    bytesRead += readThisTime;
+// Work out whether the client wants a persistent connection from the value of its Connection header
+bool RepRapWebServer::_parseConnectionHeader(const char* value, bool http11)
+{
+  if (strcasecmp(value, "close") == 0) {
+    return false;
   }
-  return bytesRead;
+  if (strcasecmp(value, "keep-alive") == 0) {
+    return true;
+  }
+  return http11;
+}
+
+// Parse a Range header holding a single byte range. Returns false if there is none.
+// On return, first is HTTP_RANGE_OPEN for a suffix range, in which case last is the suffix length, and last is HTTP_RANGE_OPEN if the range runs to the end.
+bool RepRapWebServer::_parseRange(size_t& first, size_t& last)
+{
+  const char *p = _rangeHeader;
+  if (strncmp(p, "bytes=", 6) != 0 || strchr(p, ',') != NULL) {
+    return false;
+  }
+  p += 6;
+  char *end;
+  first = last = HTTP_RANGE_OPEN;
+  if (isdigit(*p)) {
+    first = strtoul(p, &end, 10);
+    p = end;
+  }
+  if (*p++ != '-') {
+    return false;
+  }
+  if (isdigit(*p)) {
+    last = strtoul(p, &end, 10);
+    p = end;
+  }
+  return *p == '\0' && (first != HTTP_RANGE_OPEN || last != HTTP_RANGE_OPEN);
+}
+
+int RepRapWebServer::getRange(size_t size, size_t& start, size_t& length)
+{
+  start = 0;
+  length = size;
+  size_t first, last;
+  if (!_parseRange(first, last)) {
+    return 200;
+  }
+  if (first == HTTP_RANGE_OPEN) {
+    if (last == 0 || size == 0) {
+      return 416;                   // there are no bytes to send
+    }
+    length = (last < size) ? last : size;
+    start = size - length;
+  } else {
+    if (first >= size) {
+      return 416;
+    }
+    if (last == HTTP_RANGE_OPEN || last >= size) {
+      last = size - 1;
+    } else if (last < first) {
+      return 200;                   // invalid range, so ignore it
+    }
+    start = first;
+    length = last - first + 1;
+  }
+  return 206;
+}
+
+bool RepRapWebServer::getOpenRangeStart(size_t& start)
+{
+  size_t first, last;
+  if (!_parseRange(first, last) || first == HTTP_RANGE_OPEN || last != HTTP_RANGE_OPEN) {
+    return false;
+  }
+  start = first;
+  return true;
+}
+
+void RepRapWebServer::setContentRange(size_t start, size_t length, size_t size)
+{
+  String value = "bytes ";
+  value += String(start);
+  value += '-';
+  value += String(start + length - 1);
+  value += '/';
+  value += String(size);
+  sendHeader("Content-Range", value);
+}
+
+// Return true if we can keep the connection open after the request that is being parsed
+bool RepRapWebServer::_canKeepAlive(bool clientWantsKeepAlive)
+{
+  return clientWantsKeepAlive && _keepAliveTimeout != 0 && _currentConnection->requests + 1 < _keepAliveMaxRequests;
 }
 
 bool RepRapWebServer::_collectHeader(const char* headerName, const char* headerValue) {
   for (int i = 0; i < _headerKeysCount; i++) {
     if (_currentHeaders[i].key==headerName) {
-            _currentHeaders[i].value=headerValue;
+            _currentHeaders[i].value=headerValue;     // in the request buffer, so valid until the request has been handled
             return true;
         }
   }
   return false;
 }
 
-void RepRapWebServer::_parseArguments(String data) {
+// Copy the query into the arena and split it into arguments. Returns false, with _parseError set, if they don't fit in the arena.
+bool RepRapWebServer::_parseArguments(const char* data) {
+  _currentArgs = 0;
+  _currentArgCount = 0;
+  const size_t length = strlen(data);
+  if (length == 0) {
+    return true;
+  }
+  const char *copy = _arena.copy(data, length);
+  if (copy == NULL) {
+    _parseError = 414;
+    return false;
+  }
+  return _splitArguments(const_cast<char*>(copy));
+}
+
+// Split arguments held in the arena up in place and decode each value where it is.
+// Returns false, with _parseError set, if there is no room in the arena for the argument array.
+bool RepRapWebServer::_splitArguments(char* data) {
 #ifdef DEBUG
   DEBUG_OUTPUT.print("args: ");
   DEBUG_OUTPUT.println(data);
 #endif
-  if (_currentArgs)
-    delete[] _currentArgs;
   _currentArgs = 0;
-  if (data.length() == 0) {
-    _currentArgCount = 0;
-    return;
+  _currentArgCount = 0;
+  if (*data == '\0') {
+    return true;
   }
-  _currentArgCount = 1;
 
-  for (int i = 0; i < (int)data.length(); ) {
-    i = data.indexOf('&', i);
-    if (i == -1)
-      break;
-    ++i;
-    ++_currentArgCount;
+  int maxArgs = 1;
+  for (const char *p = data; (p = strchr(p, '&')) != NULL; ++p) {
+    ++maxArgs;
+  }
+  _currentArgs = (RequestArgument*)_arena.allocate(maxArgs * sizeof(RequestArgument));
+  if (_currentArgs == NULL) {
+    _parseError = 413;
+    return false;
   }
-#ifdef DEBUG
-  DEBUG_OUTPUT.print("args count: ");
-  DEBUG_OUTPUT.println(_currentArgCount);
-#endif
 
-  _currentArgs = new RequestArgument[_currentArgCount];
-  int pos = 0;
-  int iarg;
-  for (iarg = 0; iarg < _currentArgCount;) {
-    int equal_sign_index = data.indexOf('=', pos);
-    int next_arg_index = data.indexOf('&', pos);
+  for (char *p = data; p != NULL; ) {
+    char *next = strchr(p, '&');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+    char *value = strchr(p, '=');
+    if (value != NULL) {
+      *value++ = '\0';
+      RequestArgument& arg = _currentArgs[_currentArgCount++];
+      arg.key = p;
+      arg.value = value;
+      arg.valueLength = urlDecode(value, strlen(value));
 #ifdef DEBUG
-    DEBUG_OUTPUT.print("pos ");
-    DEBUG_OUTPUT.print(pos);
-    DEBUG_OUTPUT.print("=@ ");
-    DEBUG_OUTPUT.print(equal_sign_index);
-    DEBUG_OUTPUT.print(" &@ ");
-    DEBUG_OUTPUT.println(next_arg_index);
+      DEBUG_OUTPUT.print("arg key: ");
+      DEBUG_OUTPUT.print(arg.key);
+      DEBUG_OUTPUT.print(" value: ");
+      DEBUG_OUTPUT.println(arg.value);
 #endif
-    if ((equal_sign_index == -1) || ((equal_sign_index > next_arg_index) && (next_arg_index != -1))) {
+    }
 #ifdef DEBUG
+    else {
       DEBUG_OUTPUT.print("arg missing value: ");
-      DEBUG_OUTPUT.println(iarg);
-#endif
-      if (next_arg_index == -1)
-        break;
-      pos = next_arg_index + 1;
-      continue;
+      DEBUG_OUTPUT.println(p);
     }
-    RequestArgument& arg = _currentArgs[iarg];
-    arg.key = data.substring(pos, equal_sign_index);
-	arg.value = urlDecode(data.substring(equal_sign_index + 1, next_arg_index));
-#ifdef DEBUG
-    DEBUG_OUTPUT.print("arg ");
-    DEBUG_OUTPUT.print(iarg);
-    DEBUG_OUTPUT.print(" key: ");
-    DEBUG_OUTPUT.print(arg.key);
-    DEBUG_OUTPUT.print(" value: ");
-    DEBUG_OUTPUT.println(arg.value);
 #endif
-    ++iarg;
-    if (next_arg_index == -1)
-      break;
-    pos = next_arg_index + 1;
+    p = next;
   }
-  _currentArgCount = iarg;
 #ifdef DEBUG
   DEBUG_OUTPUT.print("args count: ");
   DEBUG_OUTPUT.println(_currentArgCount);
 #endif
+  _indexArguments();
+  return true;
+}
 
+void RepRapWebServer::_uploadWrite(const uint8_t *data, size_t len){
+  while (len != 0){
+    if (_currentUpload.currentSize == HTTP_UPLOAD_BUFLEN){
+      _callUploadHandler();
+      _currentUpload.totalSize += _currentUpload.currentSize;
+      _currentUpload.currentSize = 0;
+    }
+    size_t n = HTTP_UPLOAD_BUFLEN - _currentUpload.currentSize;
+    if (n > len) n = len;
+    memcpy(_currentUpload.buf + _currentUpload.currentSize, data, n);
+    _currentUpload.currentSize += n;
+    data += n;
+    len -= n;
+  }
 }
 
-void RepRapWebServer::_uploadWriteByte(uint8_t b){
-  if (_currentUpload.currentSize == HTTP_UPLOAD_BUFLEN){
-    if(_currentHandler && _currentHandler->canUpload(_currentUri))
-      _currentHandler->upload(*this, _currentUri, _currentUpload);
-    _currentUpload.totalSize += _currentUpload.currentSize;
-    _currentUpload.currentSize = 0;
+// Reads a multipart/form-data body from the client a block at a time and splits it at the delimiters.
+// The delimiter is CRLF "--" boundary. The body is read as if it started with CRLF so that the first delimiter looks like the others.
+class MultipartReader
+{
+public:
+  MultipartReader(WiFiClient& client, const String& boundary, uint32_t contentLength);
+  ~MultipartReader() { delete[] _buf; }
+
+  // Return a block of part data in the buffer, valid until the next call. On return, atDelimiter is true if the part ends after the block.
+  // Returns NULL if the client stopped sending before the end of the part.
+  const uint8_t *nextBodyBlock(size_t& n, bool& atDelimiter);
+
+  // Read what follows a delimiter. Returns 1 if it was the last one, 0 if part headers follow, -1 if the client stopped sending.
+  int afterDelimiter();
+
+  // Return the next CRLF-terminated line, terminated in place, or NULL if the client stopped sending or the line doesn't fit in the buffer
+  char *readLine();
+
+  // Discard whatever the client sends after the last delimiter, so that the next request on the connection starts in the right place
+  void finish();
+
+private:
+  bool _fill();
+  bool _ensure(size_t n);
+  int _find() const;
+
+  WiFiClient& _client;
+  uint8_t *_buf;
+  size_t _start;                // start of the unconsumed data in the buffer
+  size_t _end;                  // end of the data in the buffer
+  size_t _pending;              // amount of data to consume on the next call
+  uint32_t _remaining;          // amount of the body still to read from the client, if it sent a Content-Length
+  bool _lengthKnown;
+  char _delimiter[HTTP_MAX_BOUNDARY_LENGTH + 4];
+  size_t _delimiterLength;
+  uint8_t _skip[256];           // Boyer-Moore-Horspool shift for each byte value
+};
+
+MultipartReader::MultipartReader(WiFiClient& client, const String& boundary, uint32_t contentLength)
+: _client(client)
+, _buf(new uint8_t[HTTP_MULTIPART_BUFLEN])
+, _start(0)
+, _end(2)
+, _pending(0)
+, _remaining(contentLength)
+, _lengthKnown(contentLength != 0)
+{
+  _buf[0] = '\r';
+  _buf[1] = '\n';
+
+  size_t boundaryLength = boundary.length();
+  if (boundaryLength > HTTP_MAX_BOUNDARY_LENGTH) {
+    boundaryLength = HTTP_MAX_BOUNDARY_LENGTH;      // longer than RFC 2046 allows, so it won't match anyway
+  }
+  memcpy(_delimiter, "\r\n--", 4);
+  memcpy(_delimiter + 4, boundary.c_str(), boundaryLength);
+  _delimiterLength = boundaryLength + 4;
+
+  memset(_skip, _delimiterLength, sizeof(_skip));
+  for (size_t i = 0; i + 1 < _delimiterLength; ++i) {
+    _skip[(uint8_t)_delimiter[i]] = _delimiterLength - 1 - i;
   }
-  _currentUpload.buf[_currentUpload.currentSize++] = b;
 }
 
-uint8_t RepRapWebServer::_uploadReadByte(WiFiClient& client){
-  int res = client.read();
-  if(res == -1){
-    while(!client.available() && client.connected())
-      yield();
-    res = client.read();
+// Read more data from the client, waiting for some to arrive if necessary
+bool MultipartReader::_fill()
+{
+  if (_start != 0) {
+    memmove(_buf, _buf + _start, _end - _start);
+    _end -= _start;
+    _start = 0;
+  }
+  size_t space = HTTP_MULTIPART_BUFLEN - _end;
+  if (_lengthKnown && space > _remaining) {
+    space = _remaining;
+  }
+  if (space == 0) {
+    return false;
+  }
+
+  uint32_t startTime = millis();
+  while (_client.available() == 0) {
+    if (!_client.connected() || millis() - startTime > HTTP_MAX_DATA_WAIT) {
+      return false;
+    }
+    yield();
+  }
+  const int bytesRead = _client.read(_buf + _end, space);
+  if (bytesRead <= 0) {
+    return false;
   }
-  return (uint8_t)res;
+  _end += bytesRead;
+  _remaining -= bytesRead;
+  return true;
 }
 
-bool RepRapWebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len)
+bool MultipartReader::_ensure(size_t n)
+{
+  _start += _pending;
+  _pending = 0;
+  while (_end - _start < n) {
+    if (!_fill()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Search the buffered data for the delimiter
+int MultipartReader::_find() const
+{
+  const size_t last = _delimiterLength - 1;
+  for (size_t pos = _start; pos + last < _end; pos += _skip[_buf[pos + last]]) {
+    size_t i = last;
+    while (_buf[pos + i] == (uint8_t)_delimiter[i]) {
+      if (i == 0) {
+        return pos - _start;
+      }
+      --i;
+    }
+  }
+  return -1;
+}
+
+const uint8_t *MultipartReader::nextBodyBlock(size_t& n, bool& atDelimiter)
 {
-  UNUSED(len);
+  _start += _pending;
+  _pending = 0;
+  for (;;) {
+    const int match = _find();
+    if (match >= 0) {
+      n = match;
+      atDelimiter = true;
+      _pending = match + _delimiterLength;
+      return _buf + _start;
+    }
 
+    // All but the last few bytes are part data, because they can't be the start of a delimiter. Hand them over unless we can usefully read more first.
+    const size_t available = _end - _start;
+    if (available >= _delimiterLength && (available >= HTTP_MULTIPART_BUFLEN/2 || _client.available() == 0)) {
+      n = available - (_delimiterLength - 1);
+      atDelimiter = false;
+      _pending = n;
+      return _buf + _start;
+    }
+    if (!_fill()) {
+      return NULL;
+    }
+  }
+}
+
+int MultipartReader::afterDelimiter()
+{
+  if (!_ensure(2)) {
+    return -1;
+  }
+  if (_buf[_start] == '-' && _buf[_start + 1] == '-') {
+    _pending = 2;
+    return 1;
+  }
+  return (readLine() != NULL) ? 0 : -1;   // skip any padding and the CRLF
+}
+
+char *MultipartReader::readLine()
+{
+  _start += _pending;
+  _pending = 0;
+  size_t searchFrom = _start;
+  for (;;) {
+    for (size_t i = searchFrom; i + 1 < _end; ++i) {
+      if (_buf[i] == '\r' && _buf[i + 1] == '\n') {
+        _buf[i] = '\0';
+        char *line = (char*)_buf + _start;
+        _pending = i + 2 - _start;
+        return line;
+      }
+    }
+    searchFrom = (_end > _start) ? _end - 1 : _start;
+    const size_t oldStart = _start;
+    if (!_fill()) {
+      return NULL;
+    }
+    searchFrom -= oldStart;           // _fill() moved the data to the start of the buffer
+  }
+}
+
+void MultipartReader::finish()
+{
+  _start = _end = _pending = 0;
+  while (_lengthKnown && _remaining != 0 && _fill()) {
+    _end = 0;
+  }
+}
+
+// Find the value of a parameter such as name="value" in a header line
+static const char *getHeaderParam(const char *line, const char *param, size_t& length)
+{
+  const size_t paramLength = strlen(param);
+  for (const char *p = strstr(line, param); p != NULL; p = strstr(p + 1, param)) {
+    if ((p == line || p[-1] == ' ' || p[-1] == ';') && p[paramLength] == '=') {
+      p += paramLength + 1;
+      const char *end;
+      if (*p == '"') {
+        ++p;
+        end = strchr(p, '"');
+      } else {
+        end = strchr(p, ';');
+      }
+      if (end == NULL) {
+        end = p + strlen(p);
+      }
+      length = end - p;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+bool RepRapWebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len)
+{
 #ifdef DEBUG
   DEBUG_OUTPUT.print("Parse Form: Boundary: ");
   DEBUG_OUTPUT.print(boundary);
   DEBUG_OUTPUT.print(" Length: ");
   DEBUG_OUTPUT.println(len);
 #endif
-  String line;
-  int retry = 0;
-  do {
-    line = client.readStringUntil('\r');
-    ++retry;
-  } while (line.length() == 0 && retry < 3);
-
-  client.readStringUntil('\n');
-  //start reading the form
-  if (line == ("--"+boundary)){
-    RequestArgument* postArgs = new RequestArgument[32];
-    int postArgsLen = 0;
-    while(1){
-      String argName;
-      String argValue;
-      String argType;
-      String argFilename;
-      bool argIsFile = false;
-
-      line = client.readStringUntil('\r');
-      client.readStringUntil('\n');
-      if (line.startsWith("Content-Disposition")){
-        int nameStart = line.indexOf('=');
-        if (nameStart != -1){
-          argName = line.substring(nameStart+2);
-          nameStart = argName.indexOf('=');
-          if (nameStart == -1){
-            argName = argName.substring(0, argName.length() - 1);
-          } else {
-            argFilename = argName.substring(nameStart+2, argName.length() - 1);
-            argName = argName.substring(0, argName.indexOf('"'));
-            argIsFile = true;
-#ifdef DEBUG
-            DEBUG_OUTPUT.print("PostArg FileName: ");
-            DEBUG_OUTPUT.println(argFilename);
-#endif
-            //use GET to set the filename if uploading using blob
-            if (argFilename == "blob" && hasArg("filename")) argFilename = arg("filename");
-          }
+  MultipartReader reader(client, boundary, len);
+
+  // Skip the preamble
+  size_t n;
+  bool atDelimiter = false;
+  while (!atDelimiter) {
+    if (reader.nextBodyBlock(n, atDelimiter) == NULL) {
 #ifdef DEBUG
-          DEBUG_OUTPUT.print("PostArg Name: ");
-          DEBUG_OUTPUT.println(argName);
+      DEBUG_OUTPUT.println("Error: no boundary");
 #endif
-          argType = "text/plain";
-          line = client.readStringUntil('\r');
-          client.readStringUntil('\n');
-          if (line.startsWith("Content-Type")){
-            argType = line.substring(line.indexOf(':')+2);
-            //skip next line
-            client.readStringUntil('\r');
-            client.readStringUntil('\n');
-          }
+      return false;
+    }
+  }
+
+  // Form fields and everything we keep about them go in the arena. If they don't fit we reply 413 rather than carry on without some of them.
+  const int maxPostArgs = 32;
+  RequestArgument* postArgs = (RequestArgument*)_arena.allocate(maxPostArgs * sizeof(RequestArgument));
+  if (postArgs == NULL) {
+    _parseError = 413;
+    return false;
+  }
+  int postArgsLen = 0;
+  bool ok = false;
+  for (;;) {
+    const int state = reader.afterDelimiter();
+    if (state != 0) {
+      ok = (state == 1);
+      break;
+    }
+
+    const char* argName = "";
+    const char* argType = "text/plain";
+    const char* argFilename = NULL;
+    char *line;
+    while ((line = reader.readLine()) != NULL && *line != '\0') {
+      if (strncasecmp(line, "Content-Disposition:", 20) == 0) {
+        size_t length;
+        const char *p = getHeaderParam(line + 20, "name", length);
+        if (p != NULL) {
+          argName = _arena.copy(p, length);
+        }
+        p = getHeaderParam(line + 20, "filename", length);
+        if (p != NULL) {
+          argFilename = _arena.copy(p, length);
+        }
+      } else if (strncasecmp(line, "Content-Type:", 13) == 0) {
+        line += 13;
+        while (*line == ' ') ++line;
+        argType = _arena.copy(line, strlen(line));
+      }
+    }
+    if (line == NULL) {
+      break;                // client stopped sending
+    }
+    if (argName == NULL || argType == NULL || (argFilename == NULL && postArgsLen == maxPostArgs)) {
+      _parseError = 413;
+      break;
+    }
 #ifdef DEBUG
-          DEBUG_OUTPUT.print("PostArg Type: ");
-          DEBUG_OUTPUT.println(argType);
+    DEBUG_OUTPUT.print("PostArg Name: ");
+    DEBUG_OUTPUT.print(argName);
+    DEBUG_OUTPUT.print(" Type: ");
+    DEBUG_OUTPUT.println(argType);
 #endif
-          if (!argIsFile){
-            while(1){
-              line = client.readStringUntil('\r');
-              client.readStringUntil('\n');
-              if (line.startsWith("--"+boundary)) break;
-              if (argValue.length() > 0) argValue += "\n";
-              argValue += line;
-            }
+
+    if (argFilename == NULL) {
+      bool haveRoom = _arena.beginString();
+      const uint8_t *data;
+      do {
+        data = reader.nextBodyBlock(n, atDelimiter);
+        if (data == NULL) {
+          break;
+        }
+        if (haveRoom) {
+          haveRoom = _arena.append((const char*)data, n);
+        }
+      } while (!atDelimiter);
+      const char* argValue = (haveRoom) ? _arena.endString() : NULL;
+      if (data == NULL) {
+        break;
+      }
+      if (argValue == NULL) {
+        _parseError = 413;
+        break;
+      }
 #ifdef DEBUG
-            DEBUG_OUTPUT.print("PostArg Value: ");
-            DEBUG_OUTPUT.println(argValue);
-            DEBUG_OUTPUT.println();
+      DEBUG_OUTPUT.print("PostArg Value: ");
+      DEBUG_OUTPUT.println(argValue);
 #endif
-
-            RequestArgument& arg = postArgs[postArgsLen++];
-            arg.key = argName;
-            arg.value = argValue;
-
-            if (line == ("--"+boundary+"--")){
+      RequestArgument& arg = postArgs[postArgsLen++];
+      arg.key = argName;
+      arg.value = argValue;
+      arg.valueLength = strlen(argValue);
+    } else {
+      //use GET to set the filename if uploading using blob
+      const char* queryFilename = argValue("filename");
+      if (strcmp(argFilename, "blob") == 0 && queryFilename != NULL) argFilename = queryFilename;
+      _currentUpload.status = UPLOAD_FILE_START;
+      _currentUpload.name = argName;
+      _currentUpload.filename = argFilename;
+      _currentUpload.type = argType;
+      _currentUpload.totalSize = 0;
+      _currentUpload.currentSize = 0;
 #ifdef DEBUG
-              DEBUG_OUTPUT.println("Done Parsing POST");
+      DEBUG_OUTPUT.print("Start File: ");
+      DEBUG_OUTPUT.println(_currentUpload.filename);
 #endif
-              break;
-            }
-          } else {
-            _currentUpload.status = UPLOAD_FILE_START;
-            _currentUpload.name = argName;
-            _currentUpload.filename = argFilename;
-            _currentUpload.type = argType;
-            _currentUpload.totalSize = 0;
-            _currentUpload.currentSize = 0;
+      _callUploadHandler();
+      _currentUpload.status = UPLOAD_FILE_WRITE;
+      do {
+        const uint8_t *data = reader.nextBodyBlock(n, atDelimiter);
+        if (data == NULL) {
+          return _parseFormUploadAborted();
+        }
+        _uploadWrite(data, n);
+      } while (!atDelimiter);
+      _callUploadHandler();
+      _currentUpload.totalSize += _currentUpload.currentSize;
+      _currentUpload.status = UPLOAD_FILE_END;
+      _callUploadHandler();
 #ifdef DEBUG
-            DEBUG_OUTPUT.print("Start File: ");
-            DEBUG_OUTPUT.print(_currentUpload.filename);
-            DEBUG_OUTPUT.print(" Type: ");
-            DEBUG_OUTPUT.println(_currentUpload.type);
+      DEBUG_OUTPUT.print("End File: ");
+      DEBUG_OUTPUT.print(_currentUpload.filename);
+      DEBUG_OUTPUT.print(" Size: ");
+      DEBUG_OUTPUT.println(_currentUpload.totalSize);
 #endif
-            if(_currentHandler && _currentHandler->canUpload(_currentUri))
-              _currentHandler->upload(*this, _currentUri, _currentUpload);
-            _currentUpload.status = UPLOAD_FILE_WRITE;
-            uint8_t argByte = _uploadReadByte(client);
-readfile:
-            while(argByte != 0x0D){
-              if (!client.connected()) return _parseFormUploadAborted();
-              _uploadWriteByte(argByte);
-              argByte = _uploadReadByte(client);
-            }
-
-            argByte = _uploadReadByte(client);
-            if (!client.connected()) return _parseFormUploadAborted();
-            if (argByte == 0x0A){
-              argByte = _uploadReadByte(client);
-              if (!client.connected()) return _parseFormUploadAborted();
-              if ((char)argByte != '-'){
-                //continue reading the file
-                _uploadWriteByte(0x0D);
-                _uploadWriteByte(0x0A);
-                goto readfile;
-              } else {
-                argByte = _uploadReadByte(client);
-                if (!client.connected()) return _parseFormUploadAborted();
-                if ((char)argByte != '-'){
-                  //continue reading the file
-                  _uploadWriteByte(0x0D);
-                  _uploadWriteByte(0x0A);
-                  _uploadWriteByte((uint8_t)('-'));
-                  goto readfile;
-                }
-              }
-
-              uint8_t endBuf[boundary.length()];
-              client.readBytes(endBuf, boundary.length());
-
-              if (strstr((const char*)endBuf, boundary.c_str()) != NULL){
-                if(_currentHandler && _currentHandler->canUpload(_currentUri))
-                  _currentHandler->upload(*this, _currentUri, _currentUpload);
-                _currentUpload.totalSize += _currentUpload.currentSize;
-                _currentUpload.status = UPLOAD_FILE_END;
-                if(_currentHandler && _currentHandler->canUpload(_currentUri))
-                  _currentHandler->upload(*this, _currentUri, _currentUpload);
+    }
+  }
+
+  if (!ok) {
 #ifdef DEBUG
-                DEBUG_OUTPUT.print("End File: ");
-                DEBUG_OUTPUT.print(_currentUpload.filename);
-                DEBUG_OUTPUT.print(" Type: ");
-                DEBUG_OUTPUT.print(_currentUpload.type);
-                DEBUG_OUTPUT.print(" Size: ");
-                DEBUG_OUTPUT.println(_currentUpload.totalSize);
+    DEBUG_OUTPUT.println("Error: incomplete form");
 #endif
-                line = client.readStringUntil(0x0D);
-                client.readStringUntil(0x0A);
-                if (line == "--"){
+    return false;
+  }
+  reader.finish();
 #ifdef DEBUG
-                  DEBUG_OUTPUT.println("Done Parsing POST");
+  DEBUG_OUTPUT.println("Done Parsing POST");
 #endif
-                  break;
-                }
-                continue;
-              } else {
-                _uploadWriteByte(0x0D);
-                _uploadWriteByte(0x0A);
-                _uploadWriteByte((uint8_t)('-'));
-                _uploadWriteByte((uint8_t)('-'));
-                uint32_t i = 0;
-                while(i < boundary.length()){
-                  _uploadWriteByte(endBuf[i++]);
-                }
-                argByte = _uploadReadByte(client);
-                goto readfile;
-              }
-            } else {
-              _uploadWriteByte(0x0D);
-              goto readfile;
-            }
-            break;
-          }
+
+  // Form fields come before the query arguments, all in one array
+  if (postArgsLen + _currentArgCount > maxPostArgs) {
+    _parseError = 413;
+    return false;
+  }
+  for (int iarg = 0; iarg < _currentArgCount; iarg++){
+    postArgs[postArgsLen++] = _currentArgs[iarg];
+  }
+  _currentArgs = postArgs;
+  _currentArgCount = postArgsLen;
+  _indexArguments();
+  return true;
+}
+
+// Value of each hex digit, 0xFF for characters that aren't hex digits
+static const uint8_t hexDigitValues[256] =
+{
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// Return true if any byte of a word is '%' or '+', using the usual test for a zero byte on the word XORed with each of them
+static inline bool hasEncodedChar(uint32_t w)
+{
+  const uint32_t pc = w ^ 0x25252525u;
+  const uint32_t plus = w ^ 0x2B2B2B2Bu;
+  return ((((pc - 0x01010101u) & ~pc) | ((plus - 0x01010101u) & ~plus)) & 0x80808080u) != 0;
+}
+
+// Decode a URL-encoded string in place, turning '+' into space and %XX into the character it encodes. A '%' that isn't followed by two hex digits is kept.
+// Runs of characters that need no decoding are handled a word at a time. Returns the decoded length and null-terminates the result.
+size_t RepRapWebServer::urlDecode(char* text, size_t length)
+{
+  size_t in = 0;
+  size_t out = 0;
+  while (in < length) {
+    if (in + 4 <= length) {
+      uint32_t w;
+      memcpy(&w, text + in, 4);
+      if (!hasEncodedChar(w)) {
+        if (out != in) {
+          memcpy(text + out, &w, 4);
         }
+        in += 4;
+        out += 4;
+        continue;
       }
     }
 
-    int iarg;
-    int totalArgs = ((32 - postArgsLen) < _currentArgCount)?(32 - postArgsLen):_currentArgCount;
-    for (iarg = 0; iarg < totalArgs; iarg++){
-      RequestArgument& arg = postArgs[postArgsLen++];
-      arg.key = _currentArgs[iarg].key;
-      arg.value = _currentArgs[iarg].value;
-    }
-    if (_currentArgs) delete[] _currentArgs;
-    _currentArgs = new RequestArgument[postArgsLen];
-    for (iarg = 0; iarg < postArgsLen; iarg++){
-      RequestArgument& arg = _currentArgs[iarg];
-      arg.key = postArgs[iarg].key;
-      arg.value = postArgs[iarg].value;
-    }
-    _currentArgCount = iarg;
-    if (postArgs) delete[] postArgs;
-    return true;
+    char c = text[in++];
+    if (c == '+') {
+      c = ' ';
+    } else if (c == '%' && in + 2 <= length) {
+      const uint8_t hi = hexDigitValues[(uint8_t)text[in]];
+      const uint8_t lo = hexDigitValues[(uint8_t)text[in + 1]];
+      if ((hi | lo) < 0x10) {
+        c = (char)((hi << 4) | lo);
+        in += 2;
+      }
+    }
+    text[out++] = c;
   }
-#ifdef DEBUG
-  DEBUG_OUTPUT.print("Error: line: ");
-  DEBUG_OUTPUT.println(line);
-#endif
-  return false;
+  text[out] = '\0';
+  return out;
 }
 
-String RepRapWebServer::urlDecode(const String& text)
-{
-	String decoded = "";
-	char temp[] = "0x00";
-	unsigned int len = text.length();
-	unsigned int i = 0;
-	while (i < len)
-	{
-		char decodedChar;
-		char encodedChar = text.charAt(i++);
-		if ((encodedChar == '%') && (i + 1 < len))
-		{
-			temp[2] = text.charAt(i++);
-			temp[3] = text.charAt(i++);
-
-			decodedChar = strtol(temp, NULL, 16);
-		}
-		else {
-			if (encodedChar == '+')
-			{
-				decodedChar = ' ';
-			}
-			else {
-				decodedChar = encodedChar;  // normal ascii char
-			}
-		}
-		decoded += decodedChar;
-	}
-	return decoded;
+// Pass the current upload to the upload function of the route or handler that is handling the request
+void RepRapWebServer::_callUploadHandler(){
+  if (_currentRoute){
+    if (_currentRoute->ufn && _routeAccepts(*_currentRoute, HTTP_POST))
+      _currentRoute->ufn();
+  } else if (_currentHandler && _currentHandler->canUpload(_currentUri)){
+    _currentHandler->upload(*this, _currentUri, _currentUpload);
+  }
 }
 
 bool RepRapWebServer::_parseFormUploadAborted(){
   _currentUpload.status = UPLOAD_FILE_ABORTED;
-  if(_currentHandler && _currentHandler->canUpload(_currentUri))
-    _currentHandler->upload(*this, _currentUri, _currentUpload);
+  _callUploadHandler();
   return false;
 }
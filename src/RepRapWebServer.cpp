@@ -1,6 +1,6 @@
 /*
   ESP8266WebServer.cpp - Dead simple web-server.
-  Supports only one simultaneous client, knows how to handle GET and POST.
+  Keeps several client connections open and serves their requests in turn, knows how to handle GET and POST.
 
   Copyright (c) 2014 Ivan Grokhotkov. All rights reserved.
 
@@ -35,32 +35,66 @@
 RepRapWebServer::RepRapWebServer(IPAddress addr, int port)
 : _server(addr, port)
 , _currentMethod(HTTP_ANY)
+, _currentUri("")
+, _currentQuery("")
+, _headConnection(0)
+, _routeCount(0)
+, _currentRoute(0)
 , _currentHandler(0)
 , _firstHandler(0)
 , _lastHandler(0)
 , _currentArgCount(0)
 , _currentArgs(0)
+, _argsIndexed(false)
 , _headerKeysCount(0)
 , _currentHeaders(0)
 , _contentLength(0)
+, _responseLength(0)
+, _hostHeader("")
+, _ifNoneMatch("")
+, _rangeHeader("")
+, _cacheControl(HTTP_NO_CACHE)
 , _postLength(0)
+, _parseError(0)
 , _servingPrinter(false)
+, _currentConnection(0)
+, _nextConnection(0)
+, _currentKeepAlive(false)
+, _keepAliveTimeout(HTTP_KEEPALIVE_TIMEOUT)
+, _keepAliveMaxRequests(HTTP_KEEPALIVE_MAX_REQUESTS)
 {
 }
 
 RepRapWebServer::RepRapWebServer(int port)
 : _server(port)
 , _currentMethod(HTTP_ANY)
+, _currentUri("")
+, _currentQuery("")
+, _headConnection(0)
+, _routeCount(0)
+, _currentRoute(0)
 , _currentHandler(0)
 , _firstHandler(0)
 , _lastHandler(0)
 , _currentArgCount(0)
 , _currentArgs(0)
+, _argsIndexed(false)
 , _headerKeysCount(0)
 , _currentHeaders(0)
 , _contentLength(0)
+, _responseLength(0)
+, _hostHeader("")
+, _ifNoneMatch("")
+, _rangeHeader("")
+, _cacheControl(HTTP_NO_CACHE)
 , _postLength(0)
+, _parseError(0)
 , _servingPrinter(false)
+, _currentConnection(0)
+, _nextConnection(0)
+, _currentKeepAlive(false)
+, _keepAliveTimeout(HTTP_KEEPALIVE_TIMEOUT)
+, _keepAliveMaxRequests(HTTP_KEEPALIVE_MAX_REQUESTS)
 {
 }
 
@@ -77,6 +111,7 @@ RepRapWebServer::~RepRapWebServer() {
 }
 
 void RepRapWebServer::begin() {
+  _buildRouteIndex();
   _server.begin();
 }
 
@@ -89,11 +124,76 @@ void RepRapWebServer::on(const char* uri, HTTPMethod method, RepRapWebServer::TH
 }
 
 void RepRapWebServer::on(const char* uri, HTTPMethod method, RepRapWebServer::THandlerFunction fn, RepRapWebServer::THandlerFunction ufn) {
-  _addRequestHandler(new FunctionRequestHandler(fn, ufn, uri, method));
+  _addRoute(uri, method, false, fn, ufn);
 }
 
 void RepRapWebServer::onPrefix(const char* prefix, HTTPMethod method, RepRapWebServer::THandlerFunction fn, RepRapWebServer::THandlerFunction ufn) {
-  _addRequestHandler(new PrefixRequestHandler(fn, ufn, prefix, method));
+  _addRoute(prefix, method, true, fn, ufn);
+}
+
+void RepRapWebServer::_addRoute(const char* path, HTTPMethod method, bool prefix, RepRapWebServer::THandlerFunction fn, RepRapWebServer::THandlerFunction ufn) {
+  if (_routeCount == HTTP_MAX_ROUTES) {
+    // Table full, so fall back to the slower handler list
+    if (prefix) {
+      _addRequestHandler(new PrefixRequestHandler(fn, ufn, path, method));
+    } else {
+      _addRequestHandler(new FunctionRequestHandler(fn, ufn, path, method));
+    }
+    return;
+  }
+  Route& route = _routes[_routeCount++];
+  route.path = path;
+  route.hash = hashPath(path);
+  route.method = method;
+  route.prefix = prefix;
+  route.fn = fn;
+  route.ufn = ufn;
+  _buildRouteIndex();     // normally routes are all added before begin(), but keep the index valid if they aren't
+}
+
+// Build the hash index of exact routes. Routes with the same path and different methods occupy successive slots.
+void RepRapWebServer::_buildRouteIndex() {
+  memset(_routeIndex, 0xFF, sizeof(_routeIndex));
+  for (int i = 0; i < _routeCount; ++i) {
+    if (!_routes[i].prefix) {
+      size_t slot = _routes[i].hash & (HTTP_ROUTE_INDEX_SIZE - 1);
+      while (_routeIndex[slot] != 0xFF) {
+        slot = (slot + 1) & (HTTP_ROUTE_INDEX_SIZE - 1);
+      }
+      _routeIndex[slot] = (uint8_t)i;
+    }
+  }
+}
+
+// Find the route for a request. Exact routes take precedence over prefix routes.
+const RepRapWebServer::Route* RepRapWebServer::_findRoute(HTTPMethod method, const char* path) const {
+  uint32_t hash = hashPath(path);
+  for (size_t slot = hash & (HTTP_ROUTE_INDEX_SIZE - 1); _routeIndex[slot] != 0xFF; slot = (slot + 1) & (HTTP_ROUTE_INDEX_SIZE - 1)) {
+    const Route& route = _routes[_routeIndex[slot]];
+    if (route.hash == hash && _routeAccepts(route, method) && strcmp(route.path.c_str(), path) == 0) {
+      return &route;
+    }
+  }
+  for (int i = 0; i < _routeCount; ++i) {
+    const Route& route = _routes[i];
+    if (route.prefix && _routeAccepts(route, method) && strncmp(path, route.path.c_str(), route.path.length()) == 0) {
+      return &route;
+    }
+  }
+  return NULL;
+}
+
+// FNV-1a hash of a path
+uint32_t RepRapWebServer::hashPath(const char* path) {
+  return hashPath(path, strlen(path));
+}
+
+uint32_t RepRapWebServer::hashPath(const char* path, size_t length) {
+  uint32_t hash = 2166136261u;
+  while (length-- != 0) {
+    hash = (hash ^ (uint8_t)*path++) * 16777619u;
+  }
+  return hash;
 }
 
 void RepRapWebServer::addHandler(RequestHandler* handler) {
@@ -115,34 +215,213 @@ void RepRapWebServer::serveStatic(const char* uri, FS& fs, const char* path, con
     _addRequestHandler(new StaticRequestHandler(fs, path, uri, cache_header));
 }
 
+// Do a bounded amount of work on each connection and return, so that the caller can keep the SPI link and other clients going.
+// A request head that arrives over several calls is kept until it is complete, and files are sent a segment per call.
 void RepRapWebServer::handleClient() {
-  WiFiClient client = _server.available();
-  if (!client) {
-    return;
+  _acceptClients();
+  _checkConnections();
+  _streamFiles();
+
+  // Start reading the next request head, starting with the connection after the one we served last so that a busy client can't lock out the others
+  if (_headConnection == 0) {
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i) {
+      int index = (_nextConnection + i) % HTTP_MAX_CONNECTIONS;
+      Connection& conn = _connections[index];
+      if (conn.state == ConnectionState::Idle && conn.client.available()) {
+        _nextConnection = (index + 1) % HTTP_MAX_CONNECTIONS;
+        _beginRequestHead(conn);
+        break;
+      }
+    }
+  }
+
+  // Read what has arrived of the head, and serve the request once we have all of it
+  if (_headConnection != 0) {
+    Connection& conn = *_headConnection;
+    switch (_readRequestHead(conn.client)) {
+      case HeadStatus::Incomplete:
+        if (!conn.client.connected() || millis() - _headStartTime >= HTTP_MAX_DATA_WAIT) {
+          _closeConnection(conn);
+        }
+        break;
+
+      case HeadStatus::Failed:
+        _headConnection = 0;
+        conn.state = ConnectionState::Idle;
+        _currentConnection = &conn;
+        _rejectRequest(conn);
+        break;
+
+      case HeadStatus::Complete:
+        _headConnection = 0;
+        conn.state = ConnectionState::Idle;
+        _serveRequest(conn);
+        break;
+    }
   }
+}
+
+// Put any new clients into free connection slots
+void RepRapWebServer::_acceptClients() {
+  for (;;) {
+    WiFiClient client = _server.available();
+    if (!client) {
+      return;
+    }
+
+    // Find a free slot. If there isn't one, reuse one that is waiting to close, or else the persistent connection that has been idle longest.
+    Connection* slot = 0;
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS && slot == 0; ++i) {
+      if (_connections[i].state == ConnectionState::Free) {
+        slot = &_connections[i];
+      }
+    }
+    for (int i = 0; i < HTTP_MAX_CONNECTIONS && slot == 0; ++i) {
+      if (_connections[i].state == ConnectionState::Closing) {
+        slot = &_connections[i];
+      }
+    }
+    if (slot == 0) {
+      for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i) {
+        Connection& conn = _connections[i];
+        if (   conn.state == ConnectionState::Idle && conn.requests != 0 && !conn.client.available()
+            && (slot == 0 || (int32_t)(conn.lastActivity - slot->lastActivity) < 0)
+           ) {
+          slot = &conn;
+        }
+      }
+    }
+    if (slot == 0) {
+#ifdef DEBUG
+      DEBUG_OUTPUT.println("Too many clients");
+#endif
+      client.stop();
+      continue;
+    }
+    if (slot->state != ConnectionState::Free) {
+      _closeConnection(*slot);
+    }
 
 #ifdef DEBUG
-  DEBUG_OUTPUT.println("New client");
+    DEBUG_OUTPUT.println("New client");
 #endif
+    slot->client = client;
+    slot->state = ConnectionState::Idle;
+    slot->lastActivity = millis();
+    slot->requests = 0;
+  }
+}
 
-  // Wait for data from client to become available
-  uint16_t maxWait = HTTP_MAX_DATA_WAIT;
-  while(client.connected() && !client.available() && maxWait--){
-    delay(1);
+// Close connections that the client has closed, or that have been idle or waiting to close for too long
+void RepRapWebServer::_checkConnections() {
+  const uint32_t now = millis();
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i) {
+    Connection& conn = _connections[i];
+    switch (conn.state) {
+      case ConnectionState::Idle:
+        if (!conn.client.available()) {
+          // New clients get HTTP_MAX_DATA_WAIT to send their first request, persistent connections get the keep-alive timeout
+          const uint32_t timeout = (conn.requests == 0) ? HTTP_MAX_DATA_WAIT : _keepAliveTimeout;
+          if (!conn.client.connected() || now - conn.lastActivity >= timeout) {
+            _closeConnection(conn);
+          }
+        }
+        break;
+
+      case ConnectionState::Closing:
+        if (!conn.client.connected() || now - conn.lastActivity >= HTTP_MAX_CLOSE_WAIT) {
+          _closeConnection(conn);
+        }
+        break;
+
+      default:
+        break;
+    }
   }
+}
 
-  size_t postLength;
-  if (!_parseRequest(client, postLength)) {
+void RepRapWebServer::_closeConnection(Connection& conn) {
+  if (&conn == _headConnection) {
+    _headConnection = 0;
+  }
+  conn.client.stop();
+  conn.client = WiFiClient();
+  conn.file = File();
+  conn.state = ConnectionState::Free;
+}
+
+// Send the next segment of each file response, and finish the response when the whole body has gone
+void RepRapWebServer::_streamFiles() {
+  for (int i = 0; i < HTTP_MAX_CONNECTIONS; ++i) {
+    Connection& conn = _connections[i];
+    if (conn.state != ConnectionState::Streaming) {
+      continue;
+    }
+    if (!conn.client.connected()) {
+      _closeConnection(conn);
+      continue;
+    }
+    const size_t toRead = (conn.fileRemaining < HTTP_RESPONSE_BUFFER_SIZE) ? conn.fileRemaining : HTTP_RESPONSE_BUFFER_SIZE;
+    const size_t n = conn.file.read((uint8_t*)_responseBuf, toRead);
+    if (n == 0 || conn.client.write((const uint8_t*)_responseBuf, n, n == conn.fileRemaining) != n) {
+      _closeConnection(conn);         // we can't finish the body, and closing the connection tells the client that it is short
+      continue;
+    }
+    conn.fileRemaining -= n;
+    if (conn.fileRemaining == 0) {
+      conn.file = File();
+      _currentKeepAlive = conn.keepAlive;
+      _finishResponse(conn);
+    }
+  }
+}
+
+void RepRapWebServer::sendFileBody(File& file, size_t length) {
+  Connection& conn = *_currentConnection;
+  if (length == 0) {
+    return;
+  }
+  conn.file = file;
+  conn.fileRemaining = length;
+  conn.keepAlive = _currentKeepAlive;
+  conn.state = ConnectionState::Streaming;
+}
+
+// Parse and handle a request whose head has arrived on a connection
+void RepRapWebServer::_serveRequest(Connection& conn) {
+  uint32_t postLength;
+  _currentConnection = &conn;
+  if (!_parseRequest(conn.client, postLength)) {
+    _rejectRequest(conn);
     return;
   }
 
-  _currentClient = client;
+  _currentClient = conn.client;
   _postLength = postLength;
   _contentLength = CONTENT_LENGTH_NOT_SET;
-  _handleRequest();
-  if (postLength != 0)
-  {
-    client.flush();
+  bool deferred;
+  _handleRequest(deferred);
+}
+
+// Give up on a request that we couldn't parse, and close its connection
+void RepRapWebServer::_rejectRequest(Connection& conn) {
+  _sendParseError(conn);
+  _currentArgs = 0;
+  _currentArgCount = 0;
+  _arena.reset();
+  _closeConnection(conn);
+  _currentConnection = 0;
+}
+
+// Tell the client why we couldn't take its request, if we know, before the connection is closed
+void RepRapWebServer::_sendParseError(Connection& conn) {
+  if (_parseError != 0) {
+    conn.client.flush();                // discard the rest of the request
+    _currentClient = conn.client;
+    _currentKeepAlive = false;
+    _contentLength = CONTENT_LENGTH_NOT_SET;
+    send(_parseError, "text/plain", "");
+    _currentClient = WiFiClient();
   }
 }
 
@@ -160,51 +439,182 @@ void RepRapWebServer::sendHeader(const String& name, const String& value, bool f
   }
 }
 
-void RepRapWebServer::_prepareHeader(String& response, int code, const char* content_type, size_t contentLength)
+// Fixed parts of response headers
+static const char headerStatus[] PROGMEM = "HTTP/1.1 ";
+static const char headerNoCache[] PROGMEM = "Cache-Control: " HTTP_NO_CACHE "\r\nPragma: no-cache\r\nExpires: 0\r\n";
+static const char headerCacheControl[] PROGMEM = "Cache-Control: ";
+static const char headerContentType[] PROGMEM = "Content-Type: ";
+static const char headerContentLength[] PROGMEM = "Content-Length: ";
+static const char headerChunked[] PROGMEM = "Transfer-Encoding: chunked\r\n";
+static const char headerKeepAlive[] PROGMEM = "Connection: keep-alive\r\nKeep-Alive: timeout=";
+static const char headerKeepAliveMax[] PROGMEM = ", max=";
+static const char headerClose[] PROGMEM = "Connection: close\r\n\r\n";
+static const char headerLineEnd[] PROGMEM = "\r\n";
+static const char headerEnd[] PROGMEM = "\r\n\r\n";
+
+// Append to the response buffer, writing out what it holds when it is full
+void RepRapWebServer::_responseAppend(const char* data, size_t length)
+{
+    if (_responseLength + length > HTTP_RESPONSE_BUFFER_SIZE)
+    {
+        _responseFlush(false);
+        if (length > HTTP_RESPONSE_BUFFER_SIZE)
+        {
+            _currentClient.write((const uint8_t*)data, length, false);
+            return;
+        }
+    }
+    memcpy(_responseBuf + _responseLength, data, length);
+    _responseLength += length;
+}
+
+void RepRapWebServer::_responseAppend_P(PGM_P data)
+{
+    const size_t length = strlen_P(data);
+    if (_responseLength + length > HTTP_RESPONSE_BUFFER_SIZE)
+    {
+        _responseFlush(false);
+    }
+    memcpy_P(_responseBuf + _responseLength, data, length);
+    _responseLength += length;
+}
+
+void RepRapWebServer::_responseAppendNumber(uint32_t value)
 {
-    response = "HTTP/1.1 ";
-    response += String(code);
-    response += " ";
-    response += _responseCodeToString(code);
-    response += "\r\nCache-Control: no-cache, no-store, must-revalidate\r\nPragma: no-cache\r\nExpires: 0\r\n";
+    char digits[10];
+    size_t n = sizeof(digits);
+    do
+    {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    _responseAppend(digits + n, sizeof(digits) - n);
+}
 
+void RepRapWebServer::_responseFlush(bool last)
+{
+    _currentClient.write((const uint8_t*)_responseBuf, _responseLength, last);
+    _responseLength = 0;
+}
+
+// Start a response header with the status line and the cache headers
+void RepRapWebServer::_beginHeader(int code)
+{
+    _responseLength = 0;
+    _responseAppend_P(headerStatus);
+    _responseAppendNumber(code);
+    _responseAppend(" ", 1);
+    const char* reason = _responseCodeToString(code);
+    _responseAppend(reason, strlen(reason));
+    _responseAppend_P(headerLineEnd);
+    if (strcmp(_cacheControl, HTTP_NO_CACHE) == 0)
+    {
+        _responseAppend_P(headerNoCache);
+    }
+    else
+    {
+        _responseAppend_P(headerCacheControl);
+        _responseAppend(_cacheControl, strlen(_cacheControl));
+        _responseAppend_P(headerLineEnd);
+    }
+}
+
+void RepRapWebServer::_prepareHeader(int code, const char* content_type, size_t contentLength)
+{
     if (!content_type)
     {
         content_type = "text/html";
     }
-    sendHeader("Content-Type", content_type, true);
+    _beginHeader(code);
+    _responseAppend_P(headerContentType);
+    _responseAppend(content_type, strlen(content_type));
+    _responseAppend_P(headerLineEnd);
+    _endHeader(contentLength);
+}
+
+void RepRapWebServer::_prepareHeader(int code, const __FlashStringHelper *content_type, size_t contentLength)
+{
+    _beginHeader(code);
+    _responseAppend_P(headerContentType);
+    _responseAppend_P(reinterpret_cast<PGM_P>(content_type));
+    _responseAppend_P(headerLineEnd);
+    _endHeader(contentLength);
+}
 
-    if (_contentLength != CONTENT_LENGTH_UNKNOWN && _contentLength != CONTENT_LENGTH_NOT_SET)
+// Add the body length, or say how the client will find the end of the body
+void RepRapWebServer::_endHeader(size_t contentLength)
+{
+    if (_contentLength != CONTENT_LENGTH_NOT_SET)
+    {
+        contentLength = _contentLength;
+    }
+    if (contentLength != CONTENT_LENGTH_UNKNOWN)
+    {
+        _responseAppend_P(headerContentLength);
+        _responseAppendNumber(contentLength);
+        _responseAppend_P(headerLineEnd);
+    }
+    else if (_currentConnection->http11)
     {
-        sendHeader("Content-Length", String(_contentLength));
+        _responseAppend_P(headerChunked);
+        _currentConnection->chunked = true;
     }
     else
     {
-        sendHeader("Content-Length", String(contentLength));
+        // HTTP/1.0 clients don't understand chunks, so the end of the body is where we close the connection
+        _currentKeepAlive = false;
+        _currentConnection->keepAlive = false;
+        _currentConnection->closeDelimited = true;
     }
 
-    response += _responseHeaders;
-    response += "Connection: close\r\n\r\n";
-    _responseHeaders = String();
+    _finishHeader();
 }
 
-void RepRapWebServer::send(int code, size_t contentLength, const __FlashStringHelper *contentType, const uint8_t *data, size_t dataLength, bool isLast)
+// Append the headers set with sendHeader(), the connection headers and the blank line that ends the header
+void RepRapWebServer::_finishHeader()
 {
-    String header;
-    String contentTypeStr(contentType);
-    _prepareHeader(header, code, contentTypeStr.c_str(), contentLength);
-    sendContent(header, isLast && dataLength == 0);
-    if (dataLength != 0)
+    _responseAppend(_responseHeaders.c_str(), _responseHeaders.length());
+    if (_currentKeepAlive)
     {
-      sendContent(data, dataLength, isLast);
+        _responseAppend_P(headerKeepAlive);
+        _responseAppendNumber(_keepAliveTimeout/1000);
+        _responseAppend_P(headerKeepAliveMax);
+        _responseAppendNumber(_keepAliveMaxRequests - _currentConnection->requests - 1);
+        _responseAppend_P(headerEnd);
     }
+    else
+    {
+        _responseAppend_P(headerClose);
+    }
+    _responseHeaders = String();
+    _cacheControl = HTTP_NO_CACHE;
+}
+
+void RepRapWebServer::send(int code, size_t contentLength, const __FlashStringHelper *contentType, const uint8_t *data, size_t dataLength, bool isLast)
+{
+    _prepareHeader(code, contentType, contentLength);
+    sendContent(data, dataLength, isLast);
+}
+
+void RepRapWebServer::sendPrebuiltHeader(const char* header, size_t headerLength, bool last)
+{
+    _responseLength = 0;
+    _responseAppend(header, headerLength);
+    _finishHeader();
+    _responseFlush(last);
+}
+
+void RepRapWebServer::sendPrebuiltHeader(const char* header, size_t headerLength, const uint8_t *data, size_t dataLength)
+{
+    _responseLength = 0;
+    _responseAppend(header, headerLength);
+    _finishHeader();
+    sendContent(data, dataLength, true);
 }
 
 void RepRapWebServer::send(int code, const char* content_type, const String& content)
 {
-    String header;
-    _prepareHeader(header, code, content_type, content.length());
-    sendContent(header, false);
+    _prepareHeader(code, content_type, content.length());
     sendContent(content, true);
 }
 
@@ -218,9 +628,99 @@ void RepRapWebServer::send(int code, const String& content_type, const String& c
   send(code, (const char*)content_type.c_str(), content);
 }
 
+// Write slices after whatever the response buffer holds, in as few writes of up to a segment each as we can.
+// Whole segments are written straight from the slices. Only the pieces that would otherwise go out in a short segment
+// are copied into the buffer, to be joined up with what comes before or after them.
+// If flush is false, a short tail is left in the buffer for the next call.
+void RepRapWebServer::_writeSlices(const ResponseSlice *slices, size_t count, bool flush, bool last)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    const uint8_t *data = slices[i].data;
+    size_t length = slices[i].length;
+    if (length == 0)
+    {
+      continue;
+    }
+    if (_responseLength != 0)
+    {
+      // Top up the segment we are assembling
+      const size_t room = HTTP_RESPONSE_BUFFER_SIZE - _responseLength;
+      const size_t n = (length < room) ? length : room;
+      memcpy(_responseBuf + _responseLength, data, n);
+      _responseLength += n;
+      data += n;
+      length -= n;
+      if (_responseLength == HTTP_RESPONSE_BUFFER_SIZE)
+      {
+        _responseFlush(false);
+      }
+    }
+    if (length == 0)
+    {
+      continue;
+    }
+
+    // The buffer is empty here. Nothing follows the end of the final slice, so that goes out directly too.
+    const bool final = flush && i + 1 == count;
+    const size_t direct = (final) ? length : length - length % HTTP_RESPONSE_BUFFER_SIZE;
+    if (direct != 0)
+    {
+      _currentClient.write(data, direct, final && last);
+      if (final)
+      {
+        return;
+      }
+      data += direct;
+      length -= direct;
+    }
+    memcpy(_responseBuf, data, length);
+    _responseLength = length;
+  }
+  if (flush && (_responseLength != 0 || last))
+  {
+    _responseFlush(last);
+  }
+}
+
+void RepRapWebServer::sendContent(const ResponseSlice *slices, size_t count, bool last)
+{
+  if (_currentConnection != 0 && _currentConnection->chunked)
+  {
+    // All the slices make one chunk. The zero-length chunk that ends the body goes in the same write as the end of the last one.
+    static const char trailer[] = "\r\n0\r\n\r\n";
+    size_t dataLength = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+      dataLength += slices[i].length;
+    }
+    if (dataLength != 0)
+    {
+      char chunkHeader[12];
+      const ResponseSlice header = { (const uint8_t*)chunkHeader, (size_t)snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", (unsigned int)dataLength) };
+      const ResponseSlice end = { (const uint8_t*)trailer, (size_t)((last) ? 7 : 2) };
+      _writeSlices(&header, 1, false, false);
+      _writeSlices(slices, count, false, false);
+      _writeSlices(&end, 1, true, last);
+    }
+    else
+    {
+      const ResponseSlice end = { (const uint8_t*)trailer + 2, 5 };
+      _writeSlices(&end, (last) ? 1 : 0, true, last);
+    }
+    if (last)
+    {
+      _currentConnection->chunked = false;
+    }
+    return;
+  }
+  _writeSlices(slices, count, true, last);
+}
+
 void RepRapWebServer::sendContent(const uint8_t *content, size_t dataLength, bool last)
 {
-  _currentClient.write(content, dataLength, last);
+  const ResponseSlice slice = { content, dataLength };
+  sendContent(&slice, 1, last);
 }
 
 void RepRapWebServer::sendContent(const String& content, bool last)
@@ -228,12 +728,62 @@ void RepRapWebServer::sendContent(const String& content, bool last)
   sendContent((const uint8_t*)content.c_str(), content.length(), last);
 }
 
-String RepRapWebServer::arg(const char* name) {
+// Index the arguments by the hash of their keys. Duplicates stay in order along the probe sequence, so the first one is found.
+void RepRapWebServer::_indexArguments() {
+  _argsIndexed = (_currentArgCount <= HTTP_ARG_INDEX_SIZE/2);
+  if (!_argsIndexed)
+    return;
+  memset(_argIndex, 0xFF, sizeof(_argIndex));
   for (int i = 0; i < _currentArgCount; ++i) {
-    if (_currentArgs[i].key == name)
-      return _currentArgs[i].value;
+    RequestArgument& arg = _currentArgs[i];
+    arg.hash = hashPath(arg.key);
+    size_t slot = arg.hash & (HTTP_ARG_INDEX_SIZE - 1);
+    while (_argIndex[slot] != 0xFF) {
+      slot = (slot + 1) & (HTTP_ARG_INDEX_SIZE - 1);
+    }
+    _argIndex[slot] = (uint8_t)i;
   }
-  return String();
+}
+
+const RepRapWebServer::RequestArgument* RepRapWebServer::_findArg(const char* name) {
+  if (_currentArgCount == 0)
+    return NULL;
+  if (!_argsIndexed) {
+    for (int i = 0; i < _currentArgCount; ++i) {
+      if (strcmp(_currentArgs[i].key, name) == 0)
+        return &_currentArgs[i];
+    }
+    return NULL;
+  }
+  const uint32_t hash = hashPath(name);
+  for (size_t slot = hash & (HTTP_ARG_INDEX_SIZE - 1); _argIndex[slot] != 0xFF; slot = (slot + 1) & (HTTP_ARG_INDEX_SIZE - 1)) {
+    const RequestArgument& arg = _currentArgs[_argIndex[slot]];
+    if (arg.hash == hash && strcmp(arg.key, name) == 0)
+      return &arg;
+  }
+  return NULL;
+}
+
+String RepRapWebServer::arg(const char* name) {
+  const RequestArgument* arg = _findArg(name);
+  return (arg != NULL) ? String(arg->value) : String();
+}
+
+const char* RepRapWebServer::argValue(const char* name, size_t* length) {
+  const RequestArgument* arg = _findArg(name);
+  if (arg == NULL)
+    return NULL;
+  if (length != NULL)
+    *length = arg->valueLength;
+  return arg->value;
+}
+
+const char* RepRapWebServer::argValue(int i) {
+  return (i < _currentArgCount) ? _currentArgs[i].value : NULL;
+}
+
+const char* RepRapWebServer::argKey(int i) {
+  return (i < _currentArgCount) ? _currentArgs[i].key : NULL;
 }
 
 String RepRapWebServer::arg(int i) {
@@ -253,11 +803,7 @@ int RepRapWebServer::args() {
 }
 
 bool RepRapWebServer::hasArg(const char* name) {
-  for (int i = 0; i < _currentArgCount; ++i) {
-    if (_currentArgs[i].key == name)
-      return true;
-  }
-  return false;
+  return _findArg(name) != NULL;
 }
 
 String RepRapWebServer::header(const char* name) {
@@ -272,9 +818,10 @@ void RepRapWebServer::collectHeaders(const char* headerKeys[], const size_t head
   _headerKeysCount = headerKeysCount;
   if (_currentHeaders)
      delete[]_currentHeaders;
-  _currentHeaders = new RequestArgument[_headerKeysCount];
+  _currentHeaders = new RequestHeader[_headerKeysCount];
   for (int i = 0; i < _headerKeysCount; i++){
     _currentHeaders[i].key = headerKeys[i];
+    _currentHeaders[i].value = "";
   }
 }
 
@@ -296,16 +843,29 @@ int RepRapWebServer::headers() {
 
 bool RepRapWebServer::hasHeader(const char* name) {
   for (int i = 0; i < _headerKeysCount; ++i) {
-    if ((_currentHeaders[i].key == name) &&  (_currentHeaders[i].value.length() > 0))
+    if ((_currentHeaders[i].key == name) && (*_currentHeaders[i].value != '\0'))
       return true;
   }
   return false;
 }
 
+String RepRapWebServer::fullUri() {
+  String uri(_currentUri);
+  if (*_currentQuery != '\0') {
+    uri += '?';
+    uri += _currentQuery;
+  }
+  return uri;
+}
+
 String RepRapWebServer::hostHeader() {
   return _hostHeader;
 }
 
+bool RepRapWebServer::etagMatches(const char* etag) {
+  return strcmp(_ifNoneMatch, "*") == 0 || (*_ifNoneMatch != '\0' && strstr(_ifNoneMatch, etag) != NULL);
+}
+
 void RepRapWebServer::onFileUpload(THandlerFunction fn) {
   _fileUploadHandler = fn;
 }
@@ -314,13 +874,18 @@ void RepRapWebServer::onNotFound(THandlerFunction fn) {
   _notFoundHandler = fn;
 }
 
-void RepRapWebServer::_handleRequest() {
+// Handle the current request. On return, deferred is true if the handler will complete the response later.
+void RepRapWebServer::_handleRequest(bool& deferred) {
   bool handled = false;
-  if (!_currentHandler){
+  if (!_currentRoute && !_currentHandler){
 #ifdef DEBUG
     DEBUG_OUTPUT.println("request handler not found");
 #endif
   }
+  else if (_currentRoute) {
+    _currentRoute->fn();
+    handled = true;
+  }
   else {
     handled = _currentHandler->handle(*this, _currentMethod, _currentUri);
 #ifdef DEBUG
@@ -339,12 +904,73 @@ void RepRapWebServer::_handleRequest() {
     }
   }
 
-  uint16_t maxWait = HTTP_MAX_CLOSE_WAIT;
-  while(_currentClient.connected() && maxWait--) {
-    delay(1);
+  const ConnectionState state = _currentConnection->state;
+  if (_postLength != 0 && state != ConnectionState::Deferred) {
+    abandonRequestBody();               // the handler didn't take the postdata
+  }
+  deferred = (state == ConnectionState::Deferred || state == ConnectionState::Streaming);
+  if (!deferred) {
+    _finishResponse(*_currentConnection);
   }
+  _currentConnection = 0;
+  _currentRoute    = 0;
+  _currentHandler  = 0;
   _currentClient   = WiFiClient();
-  _currentUri      = String();
+  _currentUri      = "";
+  _currentQuery    = "";
+  _hostHeader      = "";
+  _ifNoneMatch     = "";
+  _rangeHeader     = "";
+  _currentArgs     = 0;
+  _currentArgCount = 0;
+  _currentUpload.filename = _currentUpload.name = _currentUpload.type = "";
+  _arena.reset();                       // frees the arguments and upload metadata
+}
+
+// Either keep the connection open for the next request, which may already have arrived,
+// or give the client time to close it. handleClient() closes it if the client doesn't.
+// If the client finds the end of the body by the connection closing, or it may still be sending a body we haven't read, we close it straight away.
+void RepRapWebServer::_finishResponse(Connection& conn) {
+  ++conn.requests;
+  if (conn.closeDelimited || conn.bodyUnread) {
+    conn.closeDelimited = conn.bodyUnread = false;
+    _closeConnection(conn);
+    return;
+  }
+  conn.state = (_currentKeepAlive && conn.client.connected()) ? ConnectionState::Idle : ConnectionState::Closing;
+  conn.lastActivity = millis();
+}
+
+RepRapWebServer::ConnectionHandle RepRapWebServer::deferResponse() {
+  _currentConnection->state = ConnectionState::Deferred;
+  _currentConnection->keepAlive = _currentKeepAlive;
+  return _currentConnection - _connections;
+}
+
+void RepRapWebServer::resumeResponse(ConnectionHandle handle) {
+  Connection& conn = _connections[handle];
+  _currentConnection = &conn;
+  _currentClient = conn.client;
+  _currentKeepAlive = conn.keepAlive;
+  _contentLength = CONTENT_LENGTH_NOT_SET;
+}
+
+void RepRapWebServer::completeResponse(ConnectionHandle handle) {
+  Connection& conn = _connections[handle];
+  if (conn.state == ConnectionState::Deferred) {
+    _currentKeepAlive = conn.keepAlive;
+    _finishResponse(conn);
+  }
+  if (_currentConnection == &conn) {
+    _currentConnection = 0;
+    _currentClient = WiFiClient();
+  }
+}
+
+void RepRapWebServer::abandonRequestBody() {
+  _currentKeepAlive = false;
+  _currentConnection->keepAlive = false;
+  _currentConnection->bodyUnread = true;
 }
 
 const char* RepRapWebServer::_responseCodeToString(int code) {
@@ -383,6 +1009,7 @@ const char* RepRapWebServer::_responseCodeToString(int code) {
     case 415: return "Unsupported Media Type";
     case 416: return "Requested range not satisfiable";
     case 417: return "Expectation Failed";
+    case 431: return "Request Header Fields Too Large";
     case 500: return "Internal Server Error";
     case 501: return "Not Implemented";
     case 502: return "Bad Gateway";
@@ -1,6 +1,6 @@
 /*
   ESP8266WebServer.h - Dead simple web-server.
-  Supports only one simultaneous client, knows how to handle GET and POST.
+  Keeps several client connections open and serves their requests in turn, knows how to handle GET and POST.
 
   Copyright (c) 2014 Ivan Grokhotkov. All rights reserved.
 
@@ -25,14 +25,30 @@
 #define REPRAPWEBSERVER_H
 
 #include <functional>
+#include <FS.h>
 
 enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_OPTIONS };
 enum HTTPUploadStatus { UPLOAD_FILE_START, UPLOAD_FILE_WRITE, UPLOAD_FILE_END, UPLOAD_FILE_ABORTED };
 
 #define HTTP_DOWNLOAD_UNIT_SIZE 1460
 #define HTTP_UPLOAD_BUFLEN 2048
+#define HTTP_MULTIPART_BUFLEN 1460 //size of the buffer used to split up multipart form data, must hold the longest part header line
+#define HTTP_MAX_BOUNDARY_LENGTH 70 //max length of a multipart boundary, from RFC 2046
+#define HTTP_ARG_INDEX_SIZE 64 //size of the argument hash index, a power of 2; requests with more than half this many arguments are searched linearly
+#define HTTP_REQUEST_ARENA_SIZE 2048 //size of the arena that the arguments and upload metadata of a request are allocated from, must be a multiple of 4
 #define HTTP_MAX_DATA_WAIT 1000 //ms to wait for the client to send the request
+#define HTTP_MAX_REQUEST_HEAD_LENGTH 1024 //max length of the request line and headers of a request
+#define HTTP_RESPONSE_BUFFER_SIZE 1460 //size of the buffer that a response header is built in and short writes are packed into, one TCP segment
 #define HTTP_MAX_CLOSE_WAIT 2000 //ms to wait for the client to close the connection
+#define HTTP_KEEPALIVE_TIMEOUT 5000 //default ms to keep an idle persistent connection open, 0 to disable keep-alive
+#define HTTP_KEEPALIVE_MAX_REQUESTS 100 //default max requests to serve on one persistent connection
+#define HTTP_MAX_CONNECTIONS 4 //max number of client connections to keep open at once
+#define HTTP_MAX_ROUTES 8 //max number of routes in the route table, further ones are added as request handlers
+#define HTTP_ROUTE_INDEX_SIZE 16 //size of the route hash index, must be a power of 2 greater than HTTP_MAX_ROUTES
+
+#define HTTP_NO_CACHE "no-cache, no-store, must-revalidate" //default Cache-Control value, for dynamic responses
+
+#define HTTP_RANGE_OPEN ((size_t) -1) //missing first or last position in a byte range
 
 #define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
 #define CONTENT_LENGTH_NOT_SET ((size_t) -2)
@@ -41,15 +57,16 @@ class RepRapWebServer;
 
 typedef struct {
   HTTPUploadStatus status;
-  String  filename;
-  String  name;
-  String  type;
+  const char* filename;   // these are only valid until the request has been handled
+  const char* name;
+  const char* type;
   size_t  totalSize;    // file size
   size_t  currentSize;  // size of data currently in buf
   uint8_t buf[HTTP_UPLOAD_BUFLEN];
 } HTTPUpload;
 
 #include "RequestHandler.h"
+#include "RequestArena.h"
 
 namespace fs {
 class FS;
@@ -76,7 +93,8 @@ public:
   void onFileUpload(THandlerFunction fn); //handle file uploads
 
   String uri() { return _currentUri; }
-  String fullUri() { return _currentFullUri; }
+  const char* uriCStr() const { return _currentUri; }
+  String fullUri();
   HTTPMethod method() { return _currentMethod; }
   WiFiClient& client() { return _currentClient; }
   HTTPUpload& upload() { return _currentUpload; }
@@ -86,6 +104,11 @@ public:
   String argName(int i);          // get request argument name by number
   int args();                     // get arguments count
   bool hasArg(const char* name);  // check if argument exists
+
+  // get request arguments without copying them, valid until the request has been handled
+  const char* argValue(const char* name, size_t* length = NULL);   // value by name, NULL if there is no such argument
+  const char* argValue(int i);                                    // value by number
+  const char* argKey(int i);                                      // name by number
   void collectHeaders(const char* headerKeys[], const size_t headerKeysCount); // set the request headers to collect
   String header(const char* name);   // get request header value by name
   String header(int i);              // get request header value by number
@@ -94,6 +117,13 @@ public:
   bool hasHeader(const char* name);  // check if header exists
 
   String hostHeader();            // get request host header if available or empty String if not
+  bool etagMatches(const char* etag);   // check whether the If-None-Match header matches an entity tag, which includes its quotes
+
+  // Byte ranges. Only a single range is supported, a request for several ranges gets the whole entity.
+  bool hasRange() const { return *_rangeHeader != '\0'; }
+  int getRange(size_t size, size_t& start, size_t& length);   // work out the part of an entity to send, returns 200 for all of it, 206 for a range or 416
+  bool getOpenRangeStart(size_t& start);                      // get the start of a "bytes=start-" range, for entities whose size we don't know
+  void setContentRange(size_t start, size_t length, size_t size);
 
   // send response to the client
   // code - HTTP response code, can be 200 or 404
@@ -104,53 +134,227 @@ public:
   void send(int code, char* content_type, const String& content);
   void send(int code, const String& content_type, const String& content);
 
+  // send a response header whose status line and fixed headers have been built in advance, e.g. for a static file
+  void sendPrebuiltHeader(const char* header, size_t headerLength, bool last = false);
+  void sendPrebuiltHeader(const char* header, size_t headerLength, const uint8_t *data, size_t dataLength);   // with the whole body
+
   void setContentLength(size_t contentLength) { _contentLength = contentLength; }
+  void setCacheControl(const char* value) { _cacheControl = value; }    // Cache-Control value for the next response header, must stay valid until it is sent
   void sendHeader(const String& name, const String& value, bool first = false);
   void sendContent(const uint8_t *content, size_t dataLength, bool last);
   void sendContent(const String& content, bool last = true);
 
+  // send body content gathered from several pieces of memory, e.g. a protocol header and a payload, in as few segments as possible
+  struct ResponseSlice {
+    const uint8_t *data;
+    size_t length;
+  };
+  void sendContent(const ResponseSlice *slices, size_t count, bool last);
+
+  // Deferred responses. A request handler may call deferResponse() and return without sending a response.
+  // The connection then takes no more requests until completeResponse() is called for it.
+  // In between, resumeResponse() makes it the current connection so that client(), send() and sendContent() use it.
+  typedef int ConnectionHandle;
+  ConnectionHandle deferResponse();
+  void resumeResponse(ConnectionHandle handle);
+  void completeResponse(ConnectionHandle handle);
+
+  // Send the rest of the current response's body from a file, a segment per call to handleClient(), so that a large file doesn't hold up
+  // other connections or the SPI link. The server keeps its own handle on the file and finishes the response when it has sent length bytes.
+  void sendFileBody(File& file, size_t length);
+
+  // Say that the current request's body won't all be read. The response then has Connection: close if it hasn't been sent yet,
+  // and the connection is closed when it has, because the rest of the body would be taken for the next request.
+  void abandonRequestBody();
+
   void servePrinter(bool b) { _servingPrinter = b; }
+  void setKeepAlive(uint32_t timeout, uint32_t maxRequests) { _keepAliveTimeout = timeout; _keepAliveMaxRequests = maxRequests; }
   uint32_t getPostLength() const { return _postLength; }
 
 template<typename T> size_t streamFile(T &file, const String& contentType){
-  setContentLength(file.size());
+  size_t start, length;
+  int code = getRange(file.size(), start, length);
+  sendHeader("Accept-Ranges", "bytes");
+  if (code == 416) {
+    sendHeader("Content-Range", "bytes */" + String(file.size()));
+    send(416, "text/plain", "");
+    return 0;
+  }
+  if (code == 206 && !file.seek(start, SeekSet)) {
+    // Can't get to the start of the range, so send the whole file if we can
+    if (!file.seek(0, SeekSet)) {
+      send(500, "text/plain", "");
+      return 0;
+    }
+    code = 200;
+    length = file.size();
+  }
+  setContentLength(length);
   if (String(file.name()).endsWith(".gz") &&
       contentType != "application/x-gzip" &&
       contentType != "application/octet-stream"){
     sendHeader("Content-Encoding", "gzip");
   }
-  send(200, contentType, "");
-  return _currentClient.write(file, HTTP_DOWNLOAD_UNIT_SIZE);
+  if (code == 206) {
+    setContentRange(start, length, file.size());
+  }
+  send(code, contentType, "");
+  return _sendFileBody(file, length);
 }
 
-  size_t readPostdata(WiFiClient& client, uint8_t *buffer, size_t buflen);
+  static uint32_t hashPath(const char* path);   // hash used to look up paths
+  static uint32_t hashPath(const char* path, size_t length);
+  static size_t urlDecode(char* text, size_t length);   // decode a URL-encoded string in place, returns the new length
 
 protected:
+  // Files are sent by handleClient() a segment at a time. Other kinds of stream are sent before streamFile() returns.
+  size_t _sendFileBody(File& file, size_t length) { sendFileBody(file, length); return length; }
+  template<typename T> size_t _sendFileBody(T &file, size_t length){
+    uint8_t *buf = new uint8_t[HTTP_DOWNLOAD_UNIT_SIZE];
+    size_t sent = 0;
+    while (sent < length) {
+      size_t toRead = (length - sent < HTTP_DOWNLOAD_UNIT_SIZE) ? length - sent : HTTP_DOWNLOAD_UNIT_SIZE;
+      size_t bytesRead = file.read(buf, toRead);
+      if (bytesRead == 0 || _currentClient.write(buf, bytesRead) != bytesRead) {
+        break;
+      }
+      sent += bytesRead;
+    }
+    delete[] buf;
+    return sent;
+  }
+
+  enum class ConnectionState
+  {
+    Free,               // slot not in use
+    Idle,               // waiting for a request from the client
+    ReadingHead,        // reading the request line and headers, which may arrive over several calls to handleClient()
+    Deferred,           // request handled, waiting for the response to be completed
+    Streaming,          // request handled, sending the body from a file a segment at a time
+    Closing             // response sent, waiting for the client to close the connection
+  };
+
+  enum class HeadStatus
+  {
+    Incomplete,         // the client hasn't sent all of the head yet
+    Complete,
+    Failed
+  };
+
+  // Parts of the request line and the headers we act on, pointing into the request buffer
+  struct RequestHead {
+    const char* method;
+    const char* path;
+    const char* query;
+    const char* version;
+    const char* host;
+    const char* contentType;
+    const char* connection;
+    const char* ifNoneMatch;
+    const char* range;
+    uint32_t contentLength;
+  };
+
+  // A handler function registered with on() or onPrefix()
+  struct Route {
+    String path;
+    uint32_t hash;              // hash of the path, only used for exact routes
+    HTTPMethod method;
+    bool prefix;                // true if the route matches all paths that start with its path
+    THandlerFunction fn;
+    THandlerFunction ufn;
+  };
+
+  struct Connection {
+    WiFiClient client;
+    ConnectionState state = ConnectionState::Free;
+    uint32_t lastActivity = 0;  // when the connection was accepted or last changed state
+    uint32_t requests = 0;      // number of requests served on this connection
+    bool keepAlive = false;     // whether to keep the connection open after a deferred response
+    bool http11 = false;        // whether the current request was HTTP/1.1
+    bool chunked = false;       // true while sending a response with chunked transfer encoding
+    bool closeDelimited = false;  // true if the body of the current response ends where we close the connection
+    bool bodyUnread = false;    // true if we won't read all of the body of the current request
+    File file;                  // file we are sending the response body from, while Streaming
+    size_t fileRemaining = 0;   // bytes of it still to send
+  };
+
   void _addRequestHandler(RequestHandler* handler);
-  void _handleRequest();
+  void _addRoute(const char* path, HTTPMethod method, bool prefix, THandlerFunction fn, THandlerFunction ufn);
+  void _buildRouteIndex();
+  const Route* _findRoute(HTTPMethod method, const char* path) const;
+  static bool _routeAccepts(const Route& route, HTTPMethod method) { return route.method == HTTP_ANY || route.method == method; }
+  void _callUploadHandler();
+  void _acceptClients();
+  void _checkConnections();
+  void _closeConnection(Connection& conn);
+  void _serveRequest(Connection& conn);
+  void _handleRequest(bool& deferred);
+  void _finishResponse(Connection& conn);
   bool _parseRequest(WiFiClient& client, uint32_t& postLength);
-  void _parseArguments(String data);
+  void _beginRequestHead(Connection& conn);
+  HeadStatus _readRequestHead(WiFiClient& client);
+  void _rejectRequest(Connection& conn);
+  void _streamFiles();
+  bool _readBody(WiFiClient& client, uint8_t* buf, size_t length);
+  bool _parseRequestLine(char* line, RequestHead& head);
+  bool _parseHeaderLine(char* line, RequestHead& head);
+  bool _keepsHeader(const char* name, size_t length) const;
+  bool _parseArguments(const char* data);
+  bool _splitArguments(char* data);
+  void _sendParseError(Connection& conn);
+  void _indexArguments();
   static const char* _responseCodeToString(int code);
   bool _parseForm(WiFiClient& client, String boundary, uint32_t len);
   bool _parseFormUploadAborted();
-  void _uploadWriteByte(uint8_t b);
-  uint8_t _uploadReadByte(WiFiClient& client);
-  void _prepareHeader(String& response, int code, const char* content_type, size_t contentLength);
+  void _uploadWrite(const uint8_t *data, size_t len);
+  void _beginHeader(int code);
+  void _prepareHeader(int code, const char* content_type, size_t contentLength);
+  void _prepareHeader(int code, const __FlashStringHelper *content_type, size_t contentLength);
+  void _endHeader(size_t contentLength);
+  void _finishHeader();
+  void _responseAppend(const char* data, size_t length);
+  void _responseAppend_P(PGM_P data);
+  void _responseAppendNumber(uint32_t value);
+  void _responseFlush(bool last);
+  void _writeSlices(const ResponseSlice *slices, size_t count, bool flush, bool last);
   bool _collectHeader(const char* headerName, const char* headerValue);
-  String urlDecode(const String& text);
+  bool _parseConnectionHeader(const char* value, bool http11);
+  bool _canKeepAlive(bool clientWantsKeepAlive);
+  bool _parseRange(size_t& first, size_t& last);
 
   struct RequestArgument {
-    String key;
-    String value;
+    const char* key;
+    const char* value;
+    size_t valueLength;
+    uint32_t hash;              // hash of the key
+  };
+
+  const RequestArgument* _findArg(const char* name);
+
+  struct RequestHeader {
+    String key;                 // set by collectHeaders()
+    const char* value;          // points into the request buffer, empty if the request didn't have the header
   };
 
   WiFiServer  _server;
 
   WiFiClient  _currentClient;
   HTTPMethod  _currentMethod;
-  String      _currentUri;
-  String      _currentFullUri;
-
+  const char* _currentUri;
+  const char* _currentQuery;
+  char        _requestBuf[HTTP_MAX_REQUEST_HEAD_LENGTH];   // request line and headers of the current request, split up in place
+  RequestHead _head;                    // the parts of the head in _requestBuf
+  Connection* _headConnection;          // connection whose request head is being read into _requestBuf, if any
+  size_t      _headLength;              // bytes of the head kept in _requestBuf
+  size_t      _headLineStart;           // where the line being read starts in _requestBuf
+  bool        _headSkipping;            // true while we are discarding the rest of a header that we don't need
+  uint32_t    _headStartTime;           // when we started reading the head
+
+  Route            _routes[HTTP_MAX_ROUTES];
+  uint8_t          _routeIndex[HTTP_ROUTE_INDEX_SIZE];      // exact routes by path hash, 0xFF if empty
+  int              _routeCount;
+  const Route*     _currentRoute;
   RequestHandler*  _currentHandler;
   RequestHandler*  _firstHandler;
   RequestHandler*  _lastHandler;
@@ -159,17 +363,33 @@ protected:
 
   int              _currentArgCount;
   RequestArgument* _currentArgs;
+  uint8_t          _argIndex[HTTP_ARG_INDEX_SIZE];   // arguments by key hash, 0xFF if empty
+  bool             _argsIndexed;
   HTTPUpload       _currentUpload;
+  RequestArena<HTTP_REQUEST_ARENA_SIZE> _arena;
 
   int              _headerKeysCount;
-  RequestArgument* _currentHeaders;
+  RequestHeader*   _currentHeaders;
   size_t           _contentLength;
   String           _responseHeaders;
+  char             _responseBuf[HTTP_RESPONSE_BUFFER_SIZE];
+  size_t           _responseLength;
 
-  String           _hostHeader;
+  const char*      _hostHeader;
+  const char*      _ifNoneMatch;
+  const char*      _rangeHeader;
+  const char*      _cacheControl;
 
   uint32_t _postLength;
+  int _parseError;                      // status to reply with if _parseRequest fails, or 0 to close the connection without a reply
   bool _servingPrinter;
+
+  Connection  _connections[HTTP_MAX_CONNECTIONS];
+  Connection* _currentConnection;       // connection whose request is being handled
+  int         _nextConnection;          // where to start looking for the next request, so that the connections are served in turn
+  bool        _currentKeepAlive;        // true if the connection is to be kept open after the current request
+  uint32_t    _keepAliveTimeout;
+  uint32_t    _keepAliveMaxRequests;
 };
 
 
@@ -7,6 +7,8 @@
 #include <ESP8266SSDP.h>
 #include "PooledStrings.cpp"
 #include "SPITransaction.h"
+#include "HardwareSPITransport.h"
+#include "AssetIndex.h"
 #include "Config.h"
 
 extern "C" {
@@ -31,6 +33,7 @@ RepRapWebServer server(80);
 WiFiServer tcp(23);
 WiFiClient tcpclient;
 DNSServer dns;
+HardwareSPITransport spiTransport;
 String wifiConfigHtml;
 
 enum class OperatingState
@@ -42,15 +45,141 @@ enum class OperatingState
 
 OperatingState currentState = OperatingState::Unknown;
 
+// State of a rr_ request that we are passing to the SAM
+enum class RrJobState
+{
+    Free = 0,
+    Queued = 1,         // waiting to be sent to the SAM
+    Sent = 2            // sent to the SAM, waiting for the rest of the reply
+};
+
+// Who a rr_ request is for
+enum class RrJobOwner
+{
+    Http = 0,           // a web client, which gets the reply on its connection
+    Telnet = 1          // the telnet bridge
+};
+
+struct RrJob
+{
+    RrJobState state;
+    RrJobOwner owner;
+    uint32_t seq;                                   // sequence number, which the SAM returns in its reply
+    RepRapWebServer::ConnectionHandle connection;   // connection to send the reply on
+    uint32_t ip;                                    // IP address of the client
+    String request;                                 // the request to send to the SAM, freed once sent
+    uint32_t postLength;                            // amount of postdata still to be sent to the SAM
+    size_t postFill;                                // amount of postdata in the SPI buffer we are filling
+    uint32_t fillStartTime;                         // when we started filling that buffer
+    uint32_t fragment;                              // number of the next postdata fragment
+    uint32_t lastActivity;                          // when we last sent or received anything for this request
+    bool replyStarted;                              // true if we have sent part of the reply to the client
+    uint32_t rangeStart;                            // offset of the first byte the client asked for, if it sent a Range header
+};
+
+RrJob rrJobs[maxQueuedRrRequests];
+uint32_t nextRrSeq = 1;
+size_t rrRequestsAtSamLimit = maxRrRequestsAtSam;     // raised if the SAM tells us that it returns the seq of each request
+
+// State of the telnet bridge, which passes G-code from a client on port 23 to the SAM in rr_gcode requests and relays rr_reply output back
+enum class TelnetState
+{
+    Idle = 0,           // no client
+    Connecting = 1,     // client connected, waiting for it to send the password to open a session at the SAM with
+    Authorising = 2,    // waiting for the SAM to reply to rr_connect
+    Ready = 3,          // passing G-code and replies
+    Disconnecting = 4   // client has gone, need to close the session at the SAM
+};
+
+TelnetState telnetState = TelnetState::Idle;
+uint32_t telnetIp;                            // IP address of the client, kept so that we can close its session after it has gone
+RrJob *telnetJob = nullptr;                   // the request we have at the SAM or queued for it, if any
+char telnetLines[telnetBufferSize];           // G-code received from the client and not yet sent to the SAM
+size_t telnetFill = 0;
+bool telnetDiscarding = false;                // true while we are throwing away the rest of a line that was too long for the buffer
+size_t telnetSamSpace = 0;                    // space in the SAM's G-code buffer when it last told us
+uint32_t telnetLastPoll;                      // when we last asked the SAM for its G-code buffer space or replies
+const char telnetPasswordPrompt[] = "Please enter your password:\n";
+
+// Network info that we send to the SAM, kept so that we can answer ttGetNetworkInfo without building it again
+struct NetworkInfo
+{
+  uint32_t formatVersion;
+  uint32_t ip;
+  uint32_t freeHeap;
+  uint32_t resetReason;
+  uint32_t flashSize;
+  int32_t rssi;
+  uint16_t operatingState;
+  uint16_t vcc;
+  char firmwareVersion[16];
+  char hostName[64];
+  char ssid[32];
+  uint32_t spiDataLength;
+  uint32_t minSpiDataLength;
+  uint32_t maxSpiDataLength;
+  uint32_t capabilities;                      // SPITransaction::cap* flags, added in format version 4
+};
+
+NetworkInfo networkInfo;
+
+// Network configuration sent by the SAM in a ttNetworkConfig message, laid out as we keep it in EEPROM
+struct NetworkConfig
+{
+  char ssid[32];
+  char password[64];
+  char hostName[64];
+};
+
+// Handlers for messages from the SAM that are not replies to rr_ requests, indexed by opcode.
+// The message is freed as soon as its handler returns, so a handler must copy anything it needs and queue its reply with QueueSamMessage.
+typedef void (*SamMessageHandler)(const uint8_t *data, size_t length, bool isRequest);
+
+const uint32_t firstSamOpcode = 0x80;
+const size_t numSamOpcodes = 16;
+SamMessageHandler samMessageHandlers[numSamOpcodes] = { 0 };
+
+// Replies and info messages for the SAM that are waiting for a free SPI output buffer.
+// Keeping them here lets us free each incoming message at once, so that the input buffers never wait for the output ones,
+// which may be full of postdata. There is at most one message of each kind, so the queue can't overflow.
+struct PendingSamMessage
+{
+  uint32_t opcode;
+  bool isReply;
+  bool withNetworkInfo;                       // true to send our network info, false to send the return code
+  uint32_t rc;
+};
+
+const size_t maxPendingSamMessages = 4;
+PendingSamMessage pendingSamMessages[maxPendingSamMessages];
+size_t numPendingSamMessages = 0;
+
+bool reconnecting = false;                    // true if the SAM has asked us to connect and we haven't yet
+bool restartPending = false;                  // true if the SAM has asked us to connect while we are an access point
+uint32_t restartTime;                         // when it asked
+
 ADC_MODE(ADC_VCC);          // need this for the ESP.getVcc() call to work
 
 void fsHandler();
 void handleRr();
 void handleRrUpload();
+void SpinRrJobs();
+bool HandleRrReply();
+void SpinTelnet();
+void HandleTelnetReply(const uint8_t *data, size_t length, uint32_t fragment);
+void RefuseTelnetClient();
 
-void urldecode(String &input);
 void StartAccessPoint();
 void SendInfoToSam();
+bool DispatchSamMessage();
+void RegisterSamMessageHandler(uint32_t opcode, SamMessageHandler handler);
+void QueueSamMessage(uint32_t opcode, bool isReply, bool withNetworkInfo, uint32_t rc);
+void SendPendingSamMessages();
+void HandleNetworkConfig(const uint8_t *data, size_t length, bool isRequest);
+void HandleNetworkEnable(const uint8_t *data, size_t length, bool isRequest);
+void HandleGetNetworkInfo(const uint8_t *data, size_t length, bool isRequest);
+void HandleMachineConfigChanged(const uint8_t *data, size_t length, bool isRequest);
+void HandleEnablePipelining(const uint8_t *data, size_t length, bool isRequest);
 bool TryToConnect();
 
 void setup() {
@@ -59,8 +188,13 @@ void setup() {
   EEPROM.begin(512);
   delay(20);
 
-  // Set up the SPI subsystem
-  SPITransaction::Init();
+  // Set up the SPI subsystem and the handlers for messages from the SAM
+  SPITransaction::Init(spiTransport);
+  RegisterSamMessageHandler(SPITransaction::ttNetworkConfig, HandleNetworkConfig);
+  RegisterSamMessageHandler(SPITransaction::ttNetworkEnable, HandleNetworkEnable);
+  RegisterSamMessageHandler(SPITransaction::ttGetNetworkInfo, HandleGetNetworkInfo);
+  RegisterSamMessageHandler(SPITransaction::ttMachineConfigChanged, HandleMachineConfigChanged);
+  RegisterSamMessageHandler(SPITransaction::ttEnablePipelining, HandleEnablePipelining);
 
   // Try to connect using the saved parameters
   bool success = TryToConnect();
@@ -79,6 +213,8 @@ void setup() {
     SSDP.begin();
       
     SPIFFS.begin();
+    AssetIndex::Build();
+    Serial.println("Indexed " + String(AssetIndex::Count()) + " paths, free heap " + String(ESP.getFreeHeap()));
   
     server.servePrinter(true);
     server.onNotFound(fsHandler);
@@ -111,6 +247,12 @@ void loop()
   {
   case OperatingState::Client:
     server.handleClient();
+    if (reconnecting && WiFi.status() == WL_CONNECTED)
+    {
+      reconnecting = false;
+      mdns.begin(webhostname, WiFi.localIP());
+      SendInfoToSam();
+    }
     break;
 
   case OperatingState::AccessPoint:
@@ -122,8 +264,18 @@ void loop()
     break;
   }
     
+  if (currentState == OperatingState::Client)
+  {
+    SpinTelnet();
+  }
   SPITransaction::DoTransaction();
-  if (SPITransaction::DataReady())
+  SendPendingSamMessages();
+  SpinRrJobs();
+  if (restartPending && numPendingSamMessages == 0 && millis() - restartTime >= 100)
+  {
+    ESP.restart();                    // the reply to the SAM has had time to go
+  }
+  if (SPITransaction::DataReady() && !HandleRrReply() && !DispatchSamMessage())
   {
     Serial.print("Incoming data, opcode=");
     Serial.print(SPITransaction::GetOpcode(), HEX);
@@ -134,6 +286,25 @@ void loop()
     Serial.println();
     SPITransaction::IncomingDataTaken();
   }
+
+#ifdef SPI_DEBUG
+  static uint32_t lastStatsTime = 0;
+  if (millis() - lastStatsTime >= 10000)
+  {
+    uint32_t count, minMicros, maxMicros, averageMicros;
+    SPITransaction::GetLatencyStats(count, minMicros, maxMicros, averageMicros);
+    Serial.print("SPI ready latency: count=");
+    Serial.print(count);
+    Serial.print(" min=");
+    Serial.print(minMicros);
+    Serial.print(" max=");
+    Serial.print(maxMicros);
+    Serial.print(" avg=");
+    Serial.println(averageMicros);
+    SPITransaction::ResetLatencyStats();
+    lastStatsTime = millis();
+  }
+#endif
   yield();
 }
 
@@ -203,13 +374,11 @@ void StartAccessPoint()
       server.send(500, FPSTR(STR_MIME_TEXT_PLAIN), F("Got no data, go back and retry"));
       return;
     }
-    for (uint8_t e = 0; e < server.args(); e++) {
-      String argument = server.arg(e);
-      urldecode(argument);
-      if (server.argName(e) == "password") argument.toCharArray(pass, 64);//pass = server.arg(e);
-      else if (server.argName(e) == "ssid") argument.toCharArray(ssid, 32);//ssid = server.arg(e);
-      else if (server.argName(e) == "webhostname") argument.toCharArray(webhostname, 64);
-    }
+    // Values are already decoded by the server and stay valid until we return
+    const char *argument;
+    if ((argument = server.argValue("password")) != NULL) strlcpy(pass, argument, 64);
+    if ((argument = server.argValue("ssid")) != NULL) strlcpy(ssid, argument, 32);
+    if ((argument = server.argValue("webhostname")) != NULL) strlcpy(webhostname, argument, 64);
     EEPROM.put(0, ssid);
     EEPROM.put(32, pass);
     EEPROM.put(32+64, webhostname);
@@ -223,84 +392,277 @@ void StartAccessPoint()
   Serial.println(WiFi.softAPIP().toString());
 }
 
+// Take a snapshot of our network state for the SAM
+void UpdateNetworkInfo()
+{
+  networkInfo.formatVersion = 4;
+  networkInfo.ip = static_cast<uint32_t>(WiFi.localIP());
+  networkInfo.freeHeap = ESP.getFreeHeap();
+  networkInfo.resetReason = ESP.getResetInfoPtr()->reason;
+  networkInfo.flashSize = ESP.getFlashChipRealSize();
+  networkInfo.rssi = WiFi.RSSI();
+  networkInfo.operatingState = (uint32_t)currentState;
+  networkInfo.vcc = ESP.getVcc();
+  strncpy(networkInfo.firmwareVersion, firmwareVersion, sizeof(networkInfo.firmwareVersion));
+  memcpy(networkInfo.hostName, webhostname, sizeof(networkInfo.hostName));
+  switch (currentState)
+  {
+  case OperatingState::Client:
+    memcpy(networkInfo.ssid, ssid, sizeof(networkInfo.ssid));
+    break;
+
+  case OperatingState::AccessPoint:
+    strncpy(networkInfo.ssid, softApName, sizeof(networkInfo.ssid));
+    break;
+
+  default:
+    networkInfo.ssid[0] = 0;
+    break;
+  }
+  networkInfo.spiDataLength = SPITransaction::GetMaxDataLength();
+  networkInfo.minSpiDataLength = minNegotiatedSpiFileData;
+  networkInfo.maxSpiDataLength = maxNegotiatedSpiFileData;
+  networkInfo.capabilities = SPITransaction::GetCapabilities();
+}
+
 // Schedule an info message to the SAM processor
 void SendInfoToSam()
 {
+  UpdateNetworkInfo();
+  QueueSamMessage(SPITransaction::ttNetworkInfo, false, true, 0);
+}
+
+// Register the handler for messages from the SAM with the specified opcode, which must be in the range the table covers
+void RegisterSamMessageHandler(uint32_t opcode, SamMessageHandler handler)
+{
+  samMessageHandlers[opcode - firstSamOpcode] = handler;
+}
+
+// If the incoming SPI message has a handler, pass it on, free the message and return true
+bool DispatchSamMessage()
+{
+  const uint32_t opcode = SPITransaction::GetOpcode();
+  const uint32_t index = (opcode & 0xFF) - firstSamOpcode;
+  if ((opcode & 0xFF000000) == SPITransaction::trTypeResponse || index >= numSamOpcodes || samMessageHandlers[index] == nullptr)
   {
-    struct
-    {
-      uint32_t formatVersion;
-      uint32_t ip;
-      uint32_t freeHeap;
-      uint32_t resetReason;
-      uint32_t flashSize;
-      int32_t rssi;
-      uint16_t operatingState;
-      uint16_t vcc;
-      char firmwareVersion[16];
-      char hostName[64];
-      char ssid[32];
-    } response;
-
-    response.formatVersion = 2;
-    response.ip = static_cast<uint32_t>(WiFi.localIP());
-    response.freeHeap = ESP.getFreeHeap();
-    response.resetReason = ESP.getResetInfoPtr()->reason;
-    response.flashSize = ESP.getFlashChipRealSize();
-    response.rssi = WiFi.RSSI();
-    response.operatingState = (uint32_t)currentState;
-    response.vcc = ESP.getVcc();
-    strncpy(response.firmwareVersion, firmwareVersion, sizeof(response.firmwareVersion));
-    memcpy(response.hostName, webhostname, sizeof(response.hostName));
-    switch (currentState)
-    {
-    case OperatingState::Client:
-      memcpy(response.ssid, ssid, sizeof(response.ssid));
-      break;
+    return false;
+  }
+  size_t length;
+  const uint8_t *data = (const uint8_t*)SPITransaction::GetData(length);
+  samMessageHandlers[index](data, length, (opcode & 0xFF000000) == SPITransaction::trTypeRequest);
+  SPITransaction::IncomingDataTaken();
+  SendPendingSamMessages();
+  return true;
+}
 
-    case OperatingState::AccessPoint:
-      strncpy(response.ssid, softApName, sizeof(response.ssid));
-      break;
+// Queue a message for the SAM carrying our network info or a return code, replacing any message of the same kind that hasn't gone yet
+void QueueSamMessage(uint32_t opcode, bool isReply, bool withNetworkInfo, uint32_t rc)
+{
+  size_t i = 0;
+  while (i < numPendingSamMessages && (pendingSamMessages[i].opcode != opcode || pendingSamMessages[i].isReply != isReply))
+  {
+    ++i;
+  }
+  if (i == numPendingSamMessages)
+  {
+    if (numPendingSamMessages == maxPendingSamMessages)
+    {
+      return;                           // can't happen while there are no more kinds of message than slots
+    }
+    ++numPendingSamMessages;
+  }
+  pendingSamMessages[i].opcode = opcode;
+  pendingSamMessages[i].isReply = isReply;
+  pendingSamMessages[i].withNetworkInfo = withNetworkInfo;
+  pendingSamMessages[i].rc = rc;
+  SendPendingSamMessages();
+}
 
-    default:
-      response.ssid[0] = 0;
+// Send queued messages to the SAM, oldest first, for as long as there are free SPI output buffers
+void SendPendingSamMessages()
+{
+  while (numPendingSamMessages != 0)
+  {
+    PendingSamMessage& msg = pendingSamMessages[0];
+    const void *data = &msg.rc;
+    size_t length = sizeof(msg.rc);
+    if (msg.withNetworkInfo)
+    {
+      networkInfo.spiDataLength = SPITransaction::GetMaxDataLength();     // the SAM may have changed it since we took the snapshot
+      data = &networkInfo;
+      length = sizeof(networkInfo);
+    }
+    const bool sent = (msg.isReply)
+                        ? SPITransaction::ScheduleReplyMessage(msg.opcode, data, length)
+                        : SPITransaction::ScheduleInfoMessage(msg.opcode, data, length);
+    if (!sent)
+    {
       break;
     }
-    SPITransaction::ScheduleInfoMessage(SPITransaction::ttNetworkInfo, &response, sizeof(response));
+    --numPendingSamMessages;
+    for (size_t i = 0; i < numPendingSamMessages; ++i)
+    {
+      pendingSamMessages[i] = pendingSamMessages[i + 1];
+    }
   }
 }
 
+// Reply to a request from the SAM with a return code
+static void ReplyToSam(uint32_t opcode, bool isRequest, uint32_t rc)
+{
+  if (isRequest)
+  {
+    QueueSamMessage(opcode, true, false, rc);
+  }
+}
+
+// The SAM has sent us a new SSID, password and host name. Save them for the next time we connect.
+void HandleNetworkConfig(const uint8_t *data, size_t length, bool isRequest)
+{
+  if (length < sizeof(NetworkConfig))
+  {
+    ReplyToSam(SPITransaction::ttNetworkConfig, isRequest, 1);
+    return;
+  }
+  const NetworkConfig *config = reinterpret_cast<const NetworkConfig*>(data);
+  strlcpy(ssid, config->ssid, sizeof(ssid));
+  strlcpy(pass, config->password, sizeof(pass));
+  strlcpy(webhostname, config->hostName, sizeof(webhostname));
+  EEPROM.put(0, ssid);
+  EEPROM.put(32, pass);
+  EEPROM.put(32+64, webhostname);
+  EEPROM.commit();
+  ReplyToSam(SPITransaction::ttNetworkConfig, isRequest, 0);
+}
+
+// The SAM wants us to connect using the saved network configuration, or to disconnect.
+// In client mode we reconnect without blocking and tell the SAM our new address from loop(). In access point mode we restart, because the web server was set up for configuration.
+void HandleNetworkEnable(const uint8_t *data, size_t length, bool isRequest)
+{
+  ReplyToSam(SPITransaction::ttNetworkEnable, isRequest, 0);
+  const bool enable = (length < sizeof(uint32_t)) || *reinterpret_cast<const uint32_t*>(data) != 0;
+  if (currentState != OperatingState::Client)
+  {
+    if (enable)
+    {
+      restartTime = millis();
+      restartPending = true;
+    }
+  }
+  else if (enable)
+  {
+    WiFi.disconnect();
+    wifi_station_set_hostname(webhostname);
+    WiFi.begin(ssid, pass);
+    reconnecting = true;
+  }
+  else
+  {
+    WiFi.disconnect();
+    reconnecting = false;
+    UpdateNetworkInfo();
+  }
+}
+
+// The SAM wants our network info. Send the snapshot we took when our state last changed.
+void HandleGetNetworkInfo(const uint8_t *data, size_t length, bool isRequest)
+{
+  QueueSamMessage((isRequest) ? SPITransaction::ttGetNetworkInfo : SPITransaction::ttNetworkInfo, isRequest, true, 0);
+}
+
+// The machine configuration has changed, so anything we remember about the SAM may be out of date
+void HandleMachineConfigChanged(const uint8_t *data, size_t length, bool isRequest)
+{
+  telnetSamSpace = 0;                 // ask again before sending it more G-code
+  SendInfoToSam();
+}
+
+// The SAM returns the seq of each rr_ request in its reply, so we can let it have several at once
+void HandleEnablePipelining(const uint8_t *data, size_t length, bool isRequest)
+{
+  const uint32_t requested = (length >= sizeof(uint32_t)) ? *reinterpret_cast<const uint32_t*>(data) : maxPipelinedRrRequests;
+  rrRequestsAtSamLimit = std::max<size_t>(std::min<size_t>(requested, maxPipelinedRrRequests), 1);
+  ReplyToSam(SPITransaction::ttEnablePipelining, isRequest, 0);
+}
+
 void fsHandler()
 {
-  String path = server.uri();
-  if (path.endsWith("/"))
+  const AssetIndex::Asset *asset = AssetIndex::Find(server.uriCStr());
+  char header[AssetIndex::maxHeaderLength];
+  if (asset != nullptr && server.etagMatches(asset->etag))
   {
-    path += F("reprap.htm");            // default to reprap.htm as the index page
+    const size_t headerLength = AssetIndex::FormatHeader(*asset, true, header, sizeof(header));
+    if (headerLength != 0)
+    {
+      server.sendPrebuiltHeader(header, headerLength, true);
+      return;
+    }
   }
-  File dataFile = SPIFFS.open(path, "r");
-  if (!dataFile && !path.endsWith(".gz") && path.length() <= 29)
+
+  if (asset != nullptr && server.hasRange())
   {
-    // Requested file not found and wasn't a zipped file, so see if we have a zipped version
-    dataFile = SPIFFS.open(path + ".gz", "r");
+    // Range requests are rare, so let streamFile() build the header
+    File dataFile = AssetIndex::Open(*asset);
+    if (dataFile)
+    {
+      server.sendHeader("ETag", asset->etag);
+      server.streamFile(dataFile, String(FPSTR(AssetIndex::MimeType(*asset))));       // the server sends the file from handleClient() and closes it when done
+      return;
+    }
+  }
+
+  File dataFile;
+  if (asset != nullptr && asset->data == nullptr)
+  {
+    dataFile = AssetIndex::Open(*asset);
   }
-  if (!dataFile)
+  const size_t headerLength = (asset != nullptr) ? AssetIndex::FormatHeader(*asset, false, header, sizeof(header)) : 0;
+  if (headerLength == 0 || (asset->data == nullptr && !dataFile))
   {
     server.send(404, FPSTR(STR_MIME_APPLICATION_JSON), "{\"err\": \"404: " + server.uri() + " NOT FOUND\"}");
     return;
   }
-  // No need to add the file size or encoding headers here because streamFile() does that automatically
-  String dataType;
-  if (path.endsWith(".html") || path.endsWith(".htm")) dataType = FPSTR(STR_MIME_TEXT_HTML);
-  else if (path.endsWith(".css")) dataType = F("text/css");
-  else if (path.endsWith(".js")) dataType = F("application/javascript");
-  else if (path.endsWith(".gz")) dataType = F("application/x-gzip");
-  else dataType = FPSTR(STR_MIME_TEXT_PLAIN);
-  server.streamFile(dataFile, dataType);    // this will automatically set the content encoding if it is a zipped file
-  server.client().stop();
-  dataFile.close();
+
+  if (asset->data != nullptr)
+  {
+    server.sendPrebuiltHeader(header, headerLength, asset->data, asset->size);
+  }
+  else
+  {
+    server.sendPrebuiltHeader(header, headerLength);
+    server.sendFileBody(dataFile, asset->size);
+  }
 }
 
-// Handle a rr_ request from the client
+// Find a free rr_ request slot, or return nullptr if they are all in use
+static RrJob *FindFreeRrJob()
+{
+  for (size_t i = 0; i < maxQueuedRrRequests; ++i)
+  {
+    if (rrJobs[i].state == RrJobState::Free)
+    {
+      return &rrJobs[i];
+    }
+  }
+  return nullptr;
+}
+
+// Queue a rr_ request whose owner, IP address, request and postdata length have been set up
+static void QueueRrJob(RrJob& job)
+{
+  job.seq = nextRrSeq++;
+  if (nextRrSeq == 0)
+  {
+    nextRrSeq = 1;                    // sequence number 0 means that the SAM didn't tell us which request a reply is for
+  }
+  job.fragment = 1;
+  job.postFill = 0;
+  job.replyStarted = false;
+  job.lastActivity = millis();
+  job.state = RrJobState::Queued;
+}
+
+// Queue a rr_ request from the client. The response is sent from loop() when the SAM replies.
 void handleRr() {
 #ifdef SPI_DEBUG
   Serial.print("handleRr: ");
@@ -308,179 +670,603 @@ void handleRr() {
   Serial.println();
 #endif
 
-  uint32_t postLength = server.getPostLength();
-  String text = server.fullUri();
-  if (postLength != 0)
+  RrJob *job = FindFreeRrJob();
+  if (job == nullptr)
+  {
+    server.send(503, FPSTR(STR_MIME_APPLICATION_JSON), FPSTR(STR_JSON_ERR_1));
+    return;
+  }
+
+  job->postLength = server.getPostLength();
+  job->request = server.fullUri();
+  if (job->postLength != 0)
+  {
+    job->request += "&length=" + (String)job->postLength;    // pass the post length to the SAM as well
+  }
+  size_t rangeStart;
+  if (strcmp(server.uriCStr(), "/rr_download") == 0 && server.getOpenRangeStart(rangeStart) && rangeStart != 0)
+  {
+    job->request += "&offset=" + (String)rangeStart;        // the SAM replies with code 206 if it starts the download at this offset
+    job->rangeStart = rangeStart;
+  }
+  else
   {
-    text += "&length=" + (String)postLength;    // pass the post length to the SAM as well
+    job->rangeStart = 0;
   }
-  const uint32_t ip = static_cast<uint32_t>(server.client().remoteIP());
-  SPITransaction::ScheduleRequestMessage(SPITransaction::trTypeRequest | SPITransaction::ttRr, ip, postLength == 0, text.c_str() + 4, text.length() - 4);
-  uint32_t now = millis();
-  bool hadReply = false;
-  uint32_t fragment = 1;
-  do
+  job->ip = static_cast<uint32_t>(server.client().remoteIP());
+  job->owner = RrJobOwner::Http;
+  job->connection = server.deferResponse();
+  QueueRrJob(*job);
+}
+
+// Find the oldest rr_ request in the specified state
+static RrJob *FindOldestRrJob(RrJobState state)
+{
+  RrJob *oldest = nullptr;
+  for (size_t i = 0; i < maxQueuedRrRequests; ++i)
   {
-    // Send our data and/or get a response
-    SPITransaction::DoTransaction();              // try to do a transaction, if the SAM is willing
+    RrJob& job = rrJobs[i];
+    if (job.state == state && (oldest == nullptr || (int32_t)(job.seq - oldest->seq) < 0))
+    {
+      oldest = &job;
+    }
+  }
+  return oldest;
+}
 
-    // See if we have a response yet
-    if (SPITransaction::DataReady())
+// Finish a rr_ request and free its slot
+static void CompleteRrJob(RrJob& job)
+{
+  if (job.owner == RrJobOwner::Telnet)
+  {
+    telnetJob = nullptr;
+    job.request = String();
+    job.state = RrJobState::Free;
+    if (telnetState == TelnetState::Authorising)
+    {
+      RefuseTelnetClient();             // the SAM didn't reply to rr_connect
+    }
+    return;
+  }
+  server.resumeResponse(job.connection);
+  if (job.postLength != 0)
+  {
+    server.abandonRequestBody();      // the rest of the postdata would be taken for the next request, so close the connection
+    if (job.state == RrJobState::Sent)
     {
-      uint32_t opcode = SPITransaction::GetOpcode();
-      size_t length;
-      const uint8_t *data = (const uint8_t*)SPITransaction::GetData(length);
-      if (opcode == (SPITransaction::trTypeResponse | SPITransaction::ttRr))
+      SPITransaction::CancelPostdataMessage();      // give up the SPI buffer we were filling, if any
+    }
+  }
+  server.completeResponse(job.connection);
+  job.request = String();
+  job.state = RrJobState::Free;
+}
+
+// Send queued rr_ requests and their postdata to the SAM, and give up on requests that the SAM hasn't replied to
+void SpinRrJobs()
+{
+  // See whether we can send another request to the SAM. We can't if a request that is already there still has postdata to send.
+  size_t numAtSam = 0;
+  RrJob *sendingPostdata = nullptr;
+  for (size_t i = 0; i < maxQueuedRrRequests; ++i)
+  {
+    RrJob& job = rrJobs[i];
+    if (job.state == RrJobState::Sent)
+    {
+      ++numAtSam;
+      if (job.postLength != 0)
       {
-#ifdef SPI_DEBUG
-        Serial.print("Reply");
-        for (size_t i = 0; i <= length; ++i)
-        {
-          Serial.print(" ");
-          Serial.print((unsigned int)data[i], HEX);
-        }
-        Serial.println();
-#endif
-        bool isLast;
-        uint32_t fragment = SPITransaction::GetFragment(isLast);
-        if (fragment == 0 && length >= 8)
+        sendingPostdata = &job;
+      }
+    }
+  }
+
+  if (numAtSam < rrRequestsAtSamLimit && sendingPostdata == nullptr)
+  {
+    RrJob *job = FindOldestRrJob(RrJobState::Queued);
+    if (job != nullptr)
+    {
+      if (job->owner == RrJobOwner::Http)
+      {
+        server.resumeResponse(job->connection);
+      }
+      if (job->owner == RrJobOwner::Http && !server.client().connected())
+      {
+        CompleteRrJob(*job);          // the client has gone away, so don't bother the SAM with it
+      }
+      else if (SPITransaction::ScheduleRequestMessage(SPITransaction::trTypeRequest | SPITransaction::ttRr, job->ip, job->seq, job->postLength == 0,
+                                                      job->request.c_str() + 4, job->request.length() - 4))
+      {
+        job->request = String();
+        job->state = RrJobState::Sent;
+        job->lastActivity = millis();
+        if (job->postLength != 0)
         {
-          uint32_t rc = *(const uint32_t*)data;
-          uint32_t contentLength = *(const uint32_t*)(data + 4);
-          if (rc & SPITransaction::rcJson)
-          {
-            server.send(rc & SPITransaction::rcNumber, contentLength, FPSTR(STR_MIME_APPLICATION_JSON), data + 8, length - 8, isLast);
-          }
-          else
-          {
-            server.send(rc & SPITransaction::rcNumber, contentLength, FPSTR(STR_MIME_TEXT_PLAIN), data + 8, length - 8, isLast);
-          }
+          sendingPostdata = job;
         }
-        else
+      }
+    }
+  }
+
+  // Move postdata from the network into the SPI buffer reserved for it, without waiting for any to arrive.
+  // We only read from the client when we have an SPI buffer to put the data in. While all the buffers are busy the data stays in the
+  // TCP stack, which closes the receive window so that the client stops sending until the SAM has caught up.
+  if (sendingPostdata != nullptr)
+  {
+    RrJob& job = *sendingPostdata;
+    uint8_t* buf;
+    size_t len;
+    if (SPITransaction::GetBufferAddress(&buf, len))      // if there is a free output buffer, or we are already filling one
+    {
+      if (len > job.postLength)
+      {
+        len = job.postLength;
+      }
+      server.resumeResponse(job.connection);
+      WiFiClient& client = server.client();
+      size_t available = client.available();
+      if (available != 0 && job.postFill < len)
+      {
+        if (job.postFill == 0)
         {
-          server.sendContent(data, length, isLast);
+          job.fillStartTime = millis();
         }
-        SPITransaction::IncomingDataTaken();
-        if (isLast)
+        if (available > len - job.postFill)
         {
-#if 0
-          // Actually we should be able to close the connection here, but this can sometimes
-          // lead to misbehaviour - especially when dealing with lots of fileinfo requests
-          server.client().stop();
-#endif
-          hadReply = true;
+          available = len - job.postFill;
         }
-        else
+        const int bytesRead = client.read(buf + job.postFill, available);
+        if (bytesRead > 0)
         {
-          // Make sure this request doesn't time out if we're still sending, else we break rr_download for large files
-          now = millis();
+          job.postFill += bytesRead;
+          job.lastActivity = millis();
         }
-       }
+      }
+
+      // Send the buffer when it is full or holds the end of the postdata, or when the client has paused so that the SAM isn't kept waiting
+      if (job.postFill == len || (job.postFill != 0 && client.available() == 0 && millis() - job.fillStartTime >= postdataFlushTime))
+      {
+        job.postLength -= job.postFill;
+#ifdef SPI_DEBUG
+        Serial.print("sending POST fragment, bytes=");
+        Serial.print(job.postFill);
+        Serial.print(" remaining=");
+        Serial.println(job.postLength);
+#endif
+        SPITransaction::SchedulePostdataMessage(SPITransaction::trTypeRequest | SPITransaction::ttRr, job.ip, job.seq, job.postFill, job.fragment, job.postLength == 0);
+        ++job.fragment;
+        job.postFill = 0;
+      }
+      else if (job.postFill == 0)
+      {
+        SPITransaction::CancelPostdataMessage();    // don't hold on to an empty buffer, because other messages may need it
+      }
+    }
+  }
+
+  // Time out requests that the SAM hasn't replied to
+  for (size_t i = 0; i < maxQueuedRrRequests; ++i)
+  {
+    RrJob& job = rrJobs[i];
+    if (job.state == RrJobState::Sent && millis() - job.lastActivity >= rrReplyTimeout)
+    {
+      if (job.owner == RrJobOwner::Telnet)
+      {
+        CompleteRrJob(job);
+        continue;
+      }
+      server.resumeResponse(job.connection);
+      if (job.postLength != 0)
+      {
+        server.abandonRequestBody();    // so that the error reply says we are closing the connection
+      }
+      if (job.replyStarted)
+      {
+        server.client().stop();       // we can't send an error part way through a reply
+      }
       else
       {
-//        Serial.print("Incoming data, opcode=");
-//        Serial.print(opcode, HEX);
-//        Serial.print(", length=");
-//        Serial.print(length);
-//        Serial.println();
-        SPITransaction::IncomingDataTaken();
+        server.send(200, FPSTR(STR_MIME_APPLICATION_JSON), FPSTR(STR_JSON_ERR_1));
       }
+      CompleteRrJob(job);
     }
+  }
+}
 
-    // Send our next fragment of postdata
-    if (postLength != 0)
+// If the incoming SPI message is a reply to a rr_ request, send it to the client and return true
+bool HandleRrReply()
+{
+  if (SPITransaction::GetOpcode() != (SPITransaction::trTypeResponse | SPITransaction::ttRr))
+  {
+    return false;
+  }
+
+  // Find the request that this is a reply to. If the SAM didn't give us a sequence number, it must be the oldest one we sent.
+  const uint32_t seq = SPITransaction::GetSeq();
+  RrJob *job = nullptr;
+  if (seq == 0)
+  {
+    job = FindOldestRrJob(RrJobState::Sent);
+  }
+  else
+  {
+    for (size_t i = 0; i < maxQueuedRrRequests; ++i)
     {
-      uint8_t* buf;
-      size_t len;
-      if (SPITransaction::GetBufferAddress(&buf, len))      // if the output buffer is free
+      if (rrJobs[i].state == RrJobState::Sent && rrJobs[i].seq == seq)
       {
-        if (len > postLength)
-        {
-          len = postLength;
-        }
-        size_t len2 = server.readPostdata(server.client(), buf, len);
-        if (len2 != len)
-        {
-          Serial.print("read ");
-          Serial.print(len2);
-          Serial.print(" bytes but ");
-          Serial.print(postLength);
-          Serial.println(" remaining");
-        }
-        if (len2 != 0)
-        {
-          postLength -= len2;
+        job = &rrJobs[i];
+        break;
+      }
+    }
+  }
+  if (job == nullptr)
+  {
+    SPITransaction::IncomingDataTaken();          // probably a reply to a request that timed out
+    return true;
+  }
+
+  // Send the data straight from the SPI buffer, and let the SAM send the next fragment into another buffer while the network is busy with this one
+  size_t length;
+  const uint8_t *data = (const uint8_t*)SPITransaction::GetData(length);
+  bool isLast;
+  uint32_t fragment = SPITransaction::GetFragment(isLast);
+  SPITransaction::IncomingMessage msg = SPITransaction::HoldIncoming();
 #ifdef SPI_DEBUG
-          Serial.print("sending POST fragment, bytes=");
-          Serial.print(len2);
-          Serial.print(" remaining=");
-          Serial.println(postLength);
+  Serial.print("Reply");
+  for (size_t i = 0; i <= length; ++i)
+  {
+    Serial.print(" ");
+    Serial.print((unsigned int)data[i], HEX);
+  }
+  Serial.println();
 #endif
-          SPITransaction::SchedulePostdataMessage(SPITransaction::trTypeRequest | SPITransaction::ttRr, ip, len2, fragment, postLength == 0);
-          ++fragment;
-          now = millis();
+  if (job->owner == RrJobOwner::Telnet)
+  {
+    HandleTelnetReply(data, length, fragment);
+  }
+  else
+  {
+    server.resumeResponse(job->connection);
+    if (fragment == 0 && length >= 8)
+    {
+      uint32_t rc = *(const uint32_t*)data;
+      uint32_t contentLength = *(const uint32_t*)(data + 4);
+      const size_t replyLength = (contentLength == SPITransaction::contentLengthUnknown) ? CONTENT_LENGTH_UNKNOWN : contentLength;    // sent chunked
+      int code = rc & SPITransaction::rcNumber;
+      if (code == 206 && replyLength != CONTENT_LENGTH_UNKNOWN)
+      {
+        // Partial download, which the SAM only sends if we passed it an offset. The content length is the number of bytes from the offset to the end of the file.
+        if (contentLength == 0)
+        {
+          code = 416;                     // the offset is the end of the file, so there is nothing in the range
+          server.sendHeader("Content-Range", "bytes */" + String(job->rangeStart));
         }
         else
         {
-          Serial.println("read 0 bytes");
+          server.setContentRange(job->rangeStart, contentLength, job->rangeStart + contentLength);
         }
       }
+      if (rc & SPITransaction::rcJson)
+      {
+        server.send(code, replyLength, FPSTR(STR_MIME_APPLICATION_JSON), data + 8, length - 8, isLast);
+      }
       else
       {
-        yield();
-        //delay(1);
+        server.send(code, replyLength, FPSTR(STR_MIME_TEXT_PLAIN), data + 8, length - 8, isLast);
       }
     }
     else
     {
-      yield();
-      //delay(1);
+      server.sendContent(data, length, isLast);
     }
-    
-    // Quit if all done
-    if (hadReply && postLength == 0)
+  }
+  SPITransaction::ReleaseIncoming(msg);
+  job->replyStarted = true;
+
+  if (isLast)
+  {
+    CompleteRrJob(*job);
+  }
+  else
+  {
+    // Make sure this request doesn't time out if we're still sending, else we break rr_download for large files
+    job->lastActivity = millis();
+  }
+  return true;
+}
+
+void handleRrUpload() {
+}
+
+// Return true if a character can go in a URL query without being encoded
+static bool IsUnreserved(char c)
+{
+  return isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' || c == '~';
+}
+
+// Append text to a URL query, percent-encoding the characters that need it
+static void AppendUrlEncoded(String& s, const char *text, size_t length)
+{
+  static const char hexDigits[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < length; ++i)
+  {
+    const char c = text[i];
+    if (IsUnreserved(c))
     {
-      return;
+      s += c;
     }
-  } while (millis() - now < 5000);
-  
-  server.send(200, FPSTR(STR_MIME_APPLICATION_JSON), FPSTR(STR_JSON_ERR_1));
+    else
+    {
+      s += '%';
+      s += hexDigits[(unsigned char)c >> 4];
+      s += hexDigits[c & 0x0F];
+    }
+  }
 }
 
-void handleRrUpload() {
+// Put as many whole lines of telnet G-code as fit in the SAM's G-code buffer and in one SPI packet into a rr_gcode request,
+// and remove them from our buffer. Return false if there is no complete line that fits.
+static bool BuildTelnetBatch(String& request)
+{
+  static const char prefix[] = "/rr_gcode?gcode=";
+  const size_t maxEncoded = SPITransaction::GetMaxDataLength() - (sizeof(prefix) - 1 - 4);     // the SAM doesn't get the leading "/rr_"
+  size_t taken = 0, encodedTaken = 0, encoded = 0;
+  for (size_t i = 0; i < telnetFill; ++i)
+  {
+    encoded += (IsUnreserved(telnetLines[i])) ? 1 : 3;
+    if (encoded > maxEncoded)
+    {
+      if (taken == 0)
+      {
+        // This line will never fit in a packet, so throw it away
+        const char *end = (const char*)memchr(telnetLines, '\n', telnetFill);
+        taken = (end != nullptr) ? end + 1 - telnetLines : telnetFill;
+        memmove(telnetLines, telnetLines + taken, telnetFill - taken);
+        telnetFill -= taken;
+        tcpclient.print("Error: line too long\n");
+        return false;
+      }
+      break;
+    }
+    if (i + 1 > telnetSamSpace)
+    {
+      break;
+    }
+    if (telnetLines[i] == '\n')
+    {
+      taken = i + 1;
+      encodedTaken = encoded;
+    }
+  }
+  if (taken == 0)
+  {
+    return false;
+  }
+
+  request = prefix;
+  request.reserve(sizeof(prefix) - 1 + encodedTaken);
+  AppendUrlEncoded(request, telnetLines, taken);
+  memmove(telnetLines, telnetLines + taken, telnetFill - taken);
+  telnetFill -= taken;
+  telnetSamSpace -= taken;                  // until the SAM tells us how much space is left
+  return true;
+}
+
+// Take the first line that the telnet client has sent as its password, and build a rr_connect request with it.
+// Return false if there is no complete line yet.
+static bool BuildTelnetConnect(String& request)
+{
+  const char *end = (const char*)memchr(telnetLines, '\n', telnetFill);
+  if (end == nullptr)
+  {
+    return false;
+  }
+  const size_t length = end - telnetLines;
+  const size_t passwordLength = (length != 0 && telnetLines[length - 1] == '\r') ? length - 1 : length;   // most clients end lines with CR LF
+  request = "/rr_connect?password=";
+  AppendUrlEncoded(request, telnetLines, passwordLength);
+  memmove(telnetLines, end + 1, telnetFill - length - 1);
+  telnetFill -= length + 1;
+  return true;
+}
+
+// Service the telnet bridge. We serve one client at a time and turn others away.
+// The client is asked for the printer's password first, as RepRapFirmware's own telnet server does, because the SAM checks it in rr_connect.
+// G-code lines are batched into rr_gcode requests that go through the same queue as rr_ requests from web clients,
+// and the SAM's replies are fetched with rr_reply and passed back to the client.
+void SpinTelnet()
+{
+  if (tcp.hasClient())
+  {
+    if (telnetState == TelnetState::Idle)
+    {
+      tcpclient = tcp.available();
+      telnetIp = static_cast<uint32_t>(tcpclient.remoteIP());
+      telnetFill = 0;
+      telnetDiscarding = false;
+      telnetSamSpace = 0;
+      telnetLastPoll = millis();
+      telnetState = TelnetState::Connecting;
+      tcpclient.print(telnetPasswordPrompt);
+    }
+    else
+    {
+      tcp.available().stop();
+    }
+  }
+
+  if (telnetState == TelnetState::Connecting || telnetState == TelnetState::Authorising || telnetState == TelnetState::Ready)
+  {
+    // Read only while we have room. When the buffer is full the data stays in the TCP stack, which closes the receive window
+    // so that the client stops sending until the SAM has caught up.
+    size_t available = tcpclient.available();
+    if (available != 0 && telnetFill < telnetBufferSize)
+    {
+      if (available > telnetBufferSize - telnetFill)
+      {
+        available = telnetBufferSize - telnetFill;
+      }
+      const int bytesRead = tcpclient.read((uint8_t*)telnetLines + telnetFill, available);
+      const size_t readStart = telnetFill;
+      for (int i = 0; i < bytesRead; ++i)
+      {
+        const char c = telnetLines[readStart + i];
+        if (c == '\r')
+        {
+          continue;
+        }
+        if (telnetDiscarding)
+        {
+          telnetDiscarding = (c != '\n');
+          continue;
+        }
+        telnetLines[telnetFill++] = c;
+      }
+      if (telnetFill == telnetBufferSize && memchr(telnetLines, '\n', telnetFill) == nullptr)
+      {
+        // The line is too long for the buffer, so throw it all away rather than send part of it as a command
+        telnetFill = 0;
+        telnetDiscarding = true;
+        tcpclient.print("Error: line too long\n");
+      }
+    }
+    else if (available == 0 && !tcpclient.connected())
+    {
+      telnetFill = 0;
+      telnetState = TelnetState::Disconnecting;
+    }
+  }
+
+  // Queue the next request, unless we already have one in the queue or at the SAM
+  if (telnetJob != nullptr || telnetState == TelnetState::Idle)
+  {
+    return;
+  }
+  RrJob *job = FindFreeRrJob();
+  if (job == nullptr)
+  {
+    return;
+  }
+
+  String request;
+  const uint32_t now = millis();
+  if (telnetState == TelnetState::Connecting)
+  {
+    if (!BuildTelnetConnect(request))
+    {
+      return;                               // wait for the password
+    }
+    telnetState = TelnetState::Authorising;
+  }
+  else if (telnetState == TelnetState::Disconnecting)
+  {
+    request = "/rr_disconnect";
+    telnetState = TelnetState::Idle;
+  }
+  else if (telnetState == TelnetState::Authorising)
+  {
+    return;                                 // wait for the reply to rr_connect
+  }
+  else if (now - telnetLastPoll >= telnetPollInterval)
+  {
+    // Ask for replies. If we have G-code waiting, every other poll asks for the space in the SAM's G-code buffer instead.
+    static bool askForSpace = false;
+    askForSpace = !askForSpace && memchr(telnetLines, '\n', telnetFill) != nullptr;
+    request = (askForSpace) ? "/rr_gcode?gcode=" : "/rr_reply";
+    telnetLastPoll = now;
+  }
+  else if (!BuildTelnetBatch(request))
+  {
+    return;
+  }
+
+  job->owner = RrJobOwner::Telnet;
+  job->ip = telnetIp;
+  job->request = request;
+  job->postLength = 0;
+  job->rangeStart = 0;
+  QueueRrJob(*job);
+  telnetJob = job;
 }
 
-void urldecode(String &input) { // LAL ^_^
-  input.replace("%0A", String('\n'));
-  input.replace("%20", " ");
-  input.replace("+", " ");
-  input.replace("%21", "!");
-  input.replace("%22", "\"");
-  input.replace("%23", "#");
-  input.replace("%24", "$");
-  input.replace("%25", "%");
-  input.replace("%26", "&");
-  input.replace("%27", "\'");
-  input.replace("%28", "(");
-  input.replace("%29", ")");
-  input.replace("%30", "*");
-  input.replace("%31", "+");
-  input.replace("%2C", ",");
-  input.replace("%2E", ".");
-  input.replace("%2F", "/");
-  input.replace("%2C", ",");
-  input.replace("%3A", ":");
-  input.replace("%3A", ";");
-  input.replace("%3C", "<");
-  input.replace("%3D", "=");
-  input.replace("%3E", ">");
-  input.replace("%3F", "?");
-  input.replace("%40", "@");
-  input.replace("%5B", "[");
-  input.replace("%5C", "\\");
-  input.replace("%5D", "]");
-  input.replace("%5E", "^");
-  input.replace("%5F", "-");
-  input.replace("%60", "`");
+// Find a key such as "\"err\":" in a JSON reply and return the number after it
+static bool FindJsonNumber(const uint8_t *data, size_t length, const char *key, size_t& value)
+{
+  const size_t keyLength = strlen(key);
+  for (size_t i = 0; i + keyLength < length; ++i)
+  {
+    if (memcmp(data + i, key, keyLength) == 0 && isdigit(data[i + keyLength]))
+    {
+      value = 0;
+      for (size_t j = i + keyLength; j < length && isdigit(data[j]); ++j)
+      {
+        value = value * 10 + (data[j] - '0');
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Tell the telnet client that the SAM wouldn't open a session for it, and close the connection. There is no session to close at the SAM.
+void RefuseTelnetClient()
+{
+  tcpclient.print("Error: printer refused the connection\n");
+  tcpclient.stop();
+  telnetFill = 0;
+  telnetState = TelnetState::Idle;
 }
 
+// Handle a fragment of the reply to one of the telnet bridge's requests
+void HandleTelnetReply(const uint8_t *data, size_t length, uint32_t fragment)
+{
+  static bool relaying = false;             // true while we are passing the reply to a rr_reply request to the client
+  if (fragment == 0)
+  {
+    if (length < 8)
+    {
+      relaying = false;
+      return;
+    }
+    const uint32_t rc = *(const uint32_t*)data;
+    data += 8;
+    length -= 8;
+    relaying = (rc & SPITransaction::rcJson) == 0;
+    if (telnetState == TelnetState::Authorising)
+    {
+      // Reply to rr_connect, which has "err":0 if the SAM has opened a session for us and "err":1 if the password was wrong
+      size_t err;
+      const bool haveErr = FindJsonNumber(data, length, "\"err\":", err);
+      if (haveErr && err == 1)
+      {
+        // Let the client try again. Anything it sent after the wrong password was meant for a session it didn't get.
+        relaying = false;
+        telnetFill = 0;
+        telnetState = TelnetState::Connecting;
+        tcpclient.print("Invalid password\n");
+        tcpclient.print(telnetPasswordPrompt);
+        return;
+      }
+      if (!haveErr || err != 0)
+      {
+        relaying = false;
+        RefuseTelnetClient();
+        return;
+      }
+      telnetState = TelnetState::Ready;
+    }
+    else if (!relaying)
+    {
+      // Reply to rr_gcode or rr_disconnect. Only rr_gcode tells us the space left in the SAM's G-code buffer.
+      size_t space;
+      if (FindJsonNumber(data, length, "\"buff\":", space))
+      {
+        telnetSamSpace = space;
+      }
+    }
+  }
+  if (relaying && length != 0 && tcpclient.connected())
+  {
+    tcpclient.write(data, length);
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef REQUESTARENA_H
+#define REQUESTARENA_H
+
+// Bump allocator for the state that is built up while parsing a request: arguments, form fields and upload metadata.
+// Everything is freed at once by reset() when the request has been handled, so parsing never fragments the heap.
+template<size_t Size> class RequestArena {
+public:
+  RequestArena() : _used(0), _stringStart(0) {}
+
+  void reset() { _used = 0; }
+  size_t used() const { return _used; }
+
+  // Allocate a block aligned for pointers, or return nullptr if there is no room
+  void* allocate(size_t n) {
+    if (n > Size - _used) {
+      return nullptr;
+    }
+    void* p = _bytes() + _used;
+    _used = _align(_used + n);
+    return p;
+  }
+
+  // Copy a string into the arena and null-terminate it, or return nullptr if there is no room
+  const char* copy(const char* s, size_t length) {
+    char* p = (char*)allocate(length + 1);
+    if (p != nullptr) {
+      memcpy(p, s, length);
+      p[length] = '\0';
+    }
+    return p;
+  }
+
+  // Build up a string whose length isn't known in advance. Nothing else may be allocated until endString() has been called.
+  // If the arena fills up, the string is truncated and append() returns false.
+  bool beginString() {
+    _stringStart = _used;
+    return _used < Size;
+  }
+
+  bool append(const char* s, size_t length) {
+    bool fits = true;
+    if (length > Size - 1 - _used) {
+      length = Size - 1 - _used;
+      fits = false;
+    }
+    memcpy(_bytes() + _used, s, length);
+    _used += length;
+    return fits;
+  }
+
+  const char* endString() {
+    char* s = _bytes() + _stringStart;
+    _bytes()[_used] = '\0';
+    _used = _align(_used + 1);
+    return s;
+  }
+
+private:
+  static size_t _align(size_t n) { return (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1); }
+  char* _bytes() { return reinterpret_cast<char*>(_buf); }
+
+  alignas(void*) uint32_t _buf[Size/4];
+  size_t _used;
+  size_t _stringStart;
+};
+
+#endif //REQUESTARENA_H
@@ -169,7 +169,7 @@ public:
             return false;
 
         if (_cache_header.length() != 0)
-            server.sendHeader("Cache-Control", _cache_header);
+            server.setCacheControl(_cache_header.c_str());
 
         server.streamFile(f, contentType);
         return true;
@@ -2,31 +2,50 @@
 
 #include "SPITransaction.h"
 #include "Config.h"
-#include "HSPI.h"
+#include "SPITransport.h"
+#include "Crc32.h"
 #include <algorithm>
 
 namespace SPITransaction
 {
+  // Maximum number of bytes of data in an SPI packet. This starts off at the legacy value and may be changed by the SAM once it has seen our network info message.
+  static uint32_t maxSpiDataLength = maxSpiFileData;
+
+  // Value of maxSpiDataLength that the SAM has asked for, to be applied when there are no messages in the buffers
+  static uint32_t requestedSpiDataLength = maxSpiFileData;
+
+  // CRC state. The SAM asks for CRCs, we start adding them when the buffers are idle and tell it so in a packet that carries the first one,
+  // and we start checking them on packets from the SAM once that packet has got through without being NAKed.
+  static bool crcRequested = false;                 // true if the SAM has asked for CRCs and we haven't started adding them yet
+  static bool sendCrc = false;                      // true if we add a CRC to the packets we send
+  static bool checkCrc = false;                     // true if we expect a CRC on the packets we receive
+  static uint32_t consecutiveCrcErrors = 0;         // packets from the SAM in a row that failed their CRC
+  static uint32_t goodPacketsAtLowerSpeed = 0;      // good packets since we dropped back to the lower clock speed, or 0 if we haven't
+  static uint32_t lastPacketNumber = 0;             // number we gave the last packet we built with a CRC, so that the SAM can say which one to resend
+  static bool samNumberKnown = false;               // true once we have had a numbered packet from the SAM
+  static uint32_t expectedSamNumber = 0;            // number we expect on the next packet from the SAM
+
   // Transaction buffer class.
-  // ***** This must be kept in step with the corresponding class in RepRapFirmwareWiFi *****
-  const uint32_t maxSpiDataLength = maxSpiFileData;
-  
+  // When CRCs are in use, the dword after the data (padded with zeros to a whole number of dwords) holds the CRC32 of the header and padded data.
+  // ***** The packet, from trType onwards, must be kept in step with the corresponding class in RepRapFirmwareWiFi *****
   class TransactionBuffer
   {
+      uint32_t hasCrc;                  // nonzero if SetMessage put a CRC after the data. This is not part of the packet.
       uint32_t trType;                  // type of transaction
       uint32_t seq;                     // sequence number of the request
       uint32_t ip;                      // IP address of the requester
       uint32_t fragment;                // fragment number of this packet, top bit set if last fragment
       uint32_t dataLength;              // number of bytes of data following the header
-      uint32_t data[maxSpiDataLength/4];  // the actual data, if needed
-      uint32_t dummy;                   // to allow us to add a null terminator to an incoming message
+      uint32_t data[1];                 // the actual data, if needed. Buffers are allocated with room for maxSpiDataLength bytes plus this dword,
+                                        // to allow us to add a null terminator to an incoming message, or to hold the CRC.
   
   public:
     static const uint32_t headerDwords = 5;
     static const uint32_t lastFragment = 0x80000000;
+    static const uint32_t packetNumberMask = 0x0000FF00;
 
-    // Initialise
-    void Init();
+    // Allocate a buffer with room for the specified amount of data. Returns nullptr if there is not enough memory.
+    static TransactionBuffer *Allocate(uint32_t maxDataLength);
 
     // Mark this buffer empty
     void Clear();
@@ -53,10 +72,30 @@ namespace SPITransaction
       return (trType & ttDataTaken) != 0;
     }
     
+    // Return true if the message in this buffer was set up with a CRC
+    bool HasCrc() const
+    {
+      return hasCrc != 0;
+    }
+
+    // Get the address of the packet to transfer
+    uint32_t *GetPacket()
+    {
+      return &trType;
+    }
+
     // Get SPI packet length in dwords
-    uint32_t PacketLength() const
+    uint32_t PacketLength(bool withCrc) const
     {
-      return (IsReady()) ? (dataLength + 3)/4 + headerDwords : headerDwords;
+      return (IsReady()) ? (dataLength + 3)/4 + headerDwords + ((withCrc) ? 1 : 0) : headerDwords;
+    }
+
+    // Return true if the CRC after the data is correct. Only call this on a valid buffer.
+    bool CheckCrc() const
+    {
+      Crc32 crc;
+      crc.Update(&trType, (headerDwords + (dataLength + 3)/4) * sizeof(uint32_t));
+      return data[(dataLength + 3)/4] == crc.Get();
     }
 
     uint32_t GetOpcode() const
@@ -69,6 +108,16 @@ namespace SPITransaction
       return fragment;
     }
 
+    uint32_t GetSeq() const
+    {
+      return seq;
+    }
+
+    uint32_t GetPacketNumber() const
+    {
+      return (trType & packetNumberMask) >> 8;
+    }
+
     const void *GetData(size_t& length) const
     {
       length = dataLength;
@@ -84,7 +133,7 @@ namespace SPITransaction
     }
 
     // Set up a message in this buffer
-    bool SetMessage(uint32_t tt, uint32_t ip, uint32_t frag, const void *dataToSend, uint32_t length);
+    bool SetMessage(uint32_t tt, uint32_t ip, uint32_t sq, uint32_t frag, const void *dataToSend, uint32_t length);
 
     // Get the address and size to write data into
     bool GetBufferAddress(uint8_t**p, size_t& length)
@@ -95,13 +144,23 @@ namespace SPITransaction
       }
       *p = reinterpret_cast<uint8_t*>(data);
       length = maxSpiDataLength;
-      // TODO reserve the buffer here so that no other client can allocate it
       return true;
     }
   };
 
+  TransactionBuffer *TransactionBuffer::Allocate(uint32_t maxDataLength)
+  {
+    TransactionBuffer *buf = static_cast<TransactionBuffer*>(malloc(sizeof(TransactionBuffer) + maxDataLength));
+    if (buf != nullptr)
+    {
+      buf->Clear();
+    }
+    return buf;
+  }
+
   void TransactionBuffer::Clear()
   {
+    hasCrc = 0;
     trType = 0;
     seq = 0;
     fragment = 0;
@@ -109,90 +168,511 @@ namespace SPITransaction
     ip = 0;
   }
 
-  bool TransactionBuffer::SetMessage(uint32_t tt, uint32_t p_ip, uint32_t frag, const void *dataToSend, uint32_t length)
+  bool TransactionBuffer::SetMessage(uint32_t tt, uint32_t p_ip, uint32_t sq, uint32_t frag, const void *dataToSend, uint32_t length)
   {
-    if (IsReady())
+    if (IsReady() || length > maxSpiDataLength)
     {
       return false;
     }
     trType = tt;
-    seq = 0;
+    seq = sq;
     fragment = frag;
     ip = p_ip;
     dataLength = length;
+    hasCrc = (sendCrc) ? 1 : 0;
+    if (!sendCrc)
+    {
+      if (dataToSend != nullptr)
+      {
+        memcpy(data, dataToSend, length);
+      }
+      // else if the pointer is null, we have already loaded the message in the buffer
+      return true;
+    }
+
+    // Number the packet, then calculate the CRC while we copy the data, and put it after the padding.
+    // A NAK is never sent again, so it doesn't take a number of its own.
+    if ((tt & 0xFF0000FF) != (trTypeInfo | ttNak))
+    {
+      lastPacketNumber = (lastPacketNumber + 1) & 0xFF;
+    }
+    trType = (tt & ~packetNumberMask) | (lastPacketNumber << 8);
+    Crc32 crc;
+    crc.Update(&trType, headerDwords * sizeof(uint32_t));
     if (dataToSend != nullptr)
     {
-      memcpy(data, dataToSend, length);
+      crc.UpdateAndCopy(data, dataToSend, length);
     }
-    // else if the pointer is null, we have already loaded the message in the buffer
+    else
+    {
+      crc.Update(data, length);
+    }
+    const size_t padding = (4 - (length & 3)) & 3;
+    memset(reinterpret_cast<uint8_t*>(data) + length, 0, padding);
+    crc.Update(reinterpret_cast<uint8_t*>(data) + length, padding);
+    data[(length + 3)/4] = crc.Get();
     return true;
   }
   
-  static TransactionBuffer inBuffer, outBuffer;
+  // Ring of transaction buffers. Messages are added at the head and removed from the tail.
+  // The head buffer can be reserved so that the caller can fill it in place before committing it.
+  template<size_t N> class BufferRing
+  {
+    TransactionBuffer *buffers[N];
+    size_t head;                      // index of the next buffer to be filled
+    size_t tail;                      // index of the oldest filled buffer
+    size_t count;                     // number of filled buffers
+    bool reserved;                    // true if the head buffer has been handed out for filling
+    uint8_t holds[N];                 // number of outstanding holds on each buffer after it has left the ring
+
+  public:
+    // Allocate the buffers with room for the specified amount of data each, freeing any old ones.
+    // Returns false if there is not enough memory, in which case the ring is left with no buffers.
+    bool Allocate(uint32_t maxDataLength);
+
+    // Free the buffers
+    void Free();
+
+    void Init();
+
+    bool IsEmpty() const { return count == 0; }
+    bool IsFull() const { return count == N; }
+
+    // Return true if the head buffer is available to be reserved
+    bool HasFreeBuffer() const { return !IsFull() && holds[head] == 0 && buffers[head] != nullptr; }
+
+    // Return true if any buffer that has left the ring is still held
+    bool HasHeldBuffers() const;
+
+    // Return true if the head buffer has been reserved but not yet committed
+    bool IsReserved() const { return reserved; }
+
+    // Reserve the head buffer for filling and return it, or return nullptr if all buffers are in use
+    TransactionBuffer *Reserve();
+
+    // Add the reserved head buffer to the ring
+    void Commit();
+
+    // Give up the reservation on the head buffer and mark it empty
+    void Cancel();
+
+    // Return the oldest filled buffer, or nullptr if there are none
+    TransactionBuffer *Peek();
+
+    // Remove the oldest filled buffer from the ring and mark it empty
+    void Release();
+
+    // Remove the oldest filled buffer from the ring but keep its contents until Unhold is called for it
+    TransactionBuffer *Hold();
+
+    // Release a hold on a buffer returned by Hold, marking it empty if this was the last hold
+    void Unhold(const TransactionBuffer *buf);
+  };
+
+  template<size_t N> bool BufferRing<N>::Allocate(uint32_t maxDataLength)
+  {
+    Free();
+    for (size_t i = 0; i < N; ++i)
+    {
+      buffers[i] = TransactionBuffer::Allocate(maxDataLength);
+      if (buffers[i] == nullptr)
+      {
+        Free();
+        return false;
+      }
+    }
+    Init();
+    return true;
+  }
+
+  template<size_t N> void BufferRing<N>::Free()
+  {
+    for (size_t i = 0; i < N; ++i)
+    {
+      free(buffers[i]);
+      buffers[i] = nullptr;
+      holds[i] = 0;
+    }
+    head = tail = count = 0;
+    reserved = false;
+  }
+
+  template<size_t N> void BufferRing<N>::Init()
+  {
+    for (size_t i = 0; i < N; ++i)
+    {
+      buffers[i]->Clear();
+    }
+    for (size_t i = 0; i < N; ++i)
+    {
+      holds[i] = 0;
+    }
+    head = tail = count = 0;
+    reserved = false;
+  }
+
+  template<size_t N> bool BufferRing<N>::HasHeldBuffers() const
+  {
+    for (size_t i = 0; i < N; ++i)
+    {
+      if (holds[i] != 0)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template<size_t N> TransactionBuffer *BufferRing<N>::Reserve()
+  {
+    if (!HasFreeBuffer())
+    {
+      return nullptr;
+    }
+    reserved = true;
+    return buffers[head];
+  }
+
+  template<size_t N> void BufferRing<N>::Commit()
+  {
+    if (reserved)
+    {
+      reserved = false;
+      head = (head + 1) % N;
+      ++count;
+    }
+  }
 
-  static HSPIClass hspi;
+  template<size_t N> void BufferRing<N>::Cancel()
+  {
+    if (reserved)
+    {
+      reserved = false;
+      buffers[head]->Clear();
+    }
+  }
 
-  void Init()
+  template<size_t N> TransactionBuffer *BufferRing<N>::Peek()
   {
-    pinMode(SamTfrReadyPin, INPUT);
-    pinMode(EspReqTransferPin, OUTPUT);
-    digitalWrite(EspReqTransferPin, LOW);
-    pinMode(SamSSPin, OUTPUT);
-    digitalWrite(SamSSPin, HIGH);
+    return (IsEmpty()) ? nullptr : buffers[tail];
+  }
 
-    // Set up the fast SPI channel
-    hspi.begin();
-    hspi.setBitOrder(MSBFIRST);
-    hspi.setDataMode(SPI_MODE1);
-    hspi.setFrequency(spiFrequency);
+  template<size_t N> void BufferRing<N>::Release()
+  {
+    if (!IsEmpty())
+    {
+      buffers[tail]->Clear();
+      tail = (tail + 1) % N;
+      --count;
+    }
+  }
 
-    inBuffer.Clear();
-    outBuffer.Clear();
+  template<size_t N> TransactionBuffer *BufferRing<N>::Hold()
+  {
+    if (IsEmpty())
+    {
+      return nullptr;
+    }
+    TransactionBuffer * const buf = buffers[tail];
+    ++holds[tail];
+    tail = (tail + 1) % N;
+    --count;
+    return buf;
   }
 
-  // Execute an SPI transaction if possible, by sending from outBuffer and reading any incomimg data to inBuffer.
+  template<size_t N> void BufferRing<N>::Unhold(const TransactionBuffer *buf)
+  {
+    for (size_t i = 0; i < N; ++i)
+    {
+      if (buffers[i] == buf && holds[i] != 0)
+      {
+        --holds[i];
+        if (holds[i] == 0)
+        {
+          buffers[i]->Clear();
+        }
+        return;
+      }
+    }
+  }
+
+  static BufferRing<numSpiInBuffers> inBuffers;
+  static BufferRing<numSpiOutBuffers> outBuffers;
+  static TransactionBuffer emptyBuffer;         // what we send when we have nothing to send
+  static TransactionBuffer *nakBuffer;          // NAK for a corrupt packet from the SAM, which we send ahead of anything else
+  static bool nakPending = false;
+
+  // Packets we have sent with a CRC, which the SAM may yet NAK. The SAM sends its NAK in the transaction after the one in which it got the
+  // bad packet, so we keep each packet until that transaction is over. A NAK makes us go back and send the packet again, and the ones after it.
+  struct SentPacket
+  {
+    TransactionBuffer *buf;
+    uint32_t transaction;                       // number of the transaction in which we last sent it
+  };
+  static SentPacket sentPackets[numSpiOutBuffers];
+  static size_t numSentPackets = 0;
+  static size_t nextResend = 0;                 // index of the next packet to send again, or numSentPackets if none
+  static uint32_t transactionNumber = 0;
+
+  static SPITransport *transport = nullptr;
+
+  // Latency statistics, measured from the SAM signalling that it is ready to the start of the transfer
+  static bool readyPending = false;                 // true if the SAM has become ready since we last started a transfer
+  static uint32_t readyTime;                        // when the SAM last became ready, in microseconds
+  static uint32_t latencyCount, latencyMin, latencyMax, latencyTotal;
+
+  // If we have a message to send and somewhere to put the incoming data, ask the SAM to do a transaction.
+  // We also want one while we are keeping sent packets, to give the SAM its chance to NAK them.
+  static void RequestTransferIfReady()
+  {
+    if ((!outBuffers.IsEmpty() || nakPending || numSentPackets != 0) && inBuffers.HasFreeBuffer())
+    {
+      transport->RequestTransfer(true);
+    }
+  }
+
+  // Set up a message in the next free output buffer and queue it for sending. Returns false if there is no free buffer.
+  static bool QueueMessage(uint32_t tt, uint32_t ip, uint32_t seq, uint32_t frag, const void *dataToSend, uint32_t length)
+  {
+    if (outBuffers.IsReserved())
+    {
+      return false;                   // the head buffer is being filled with postdata
+    }
+    TransactionBuffer *buf = outBuffers.Reserve();
+    if (buf == nullptr)
+    {
+      return false;
+    }
+    if (!buf->SetMessage(tt, ip, seq, frag, dataToSend, length))
+    {
+      outBuffers.Cancel();
+      return false;
+    }
+    outBuffers.Commit();
+    RequestTransferIfReady();
+    return true;
+  }
+
+  // Allocate the input and output buffers with room for the specified amount of data.
+  // If there isn't enough memory, refuse the new length and go back to buffers of the old one, or failing that of the default one.
+  // Returns false if we couldn't allocate buffers of the length asked for.
+  static bool AllocateBuffers(uint32_t dataLength)
+  {
+    if (inBuffers.Allocate(dataLength) && outBuffers.Allocate(dataLength))
+    {
+      maxSpiDataLength = requestedSpiDataLength = dataLength;
+      return true;
+    }
+
+    Serial.print("Failed to allocate SPI buffers of length ");
+    Serial.println(dataLength);
+    const uint32_t fallbackLengths[2] = { maxSpiDataLength, maxSpiFileData };
+    for (uint32_t fallback : fallbackLengths)
+    {
+      if (fallback < dataLength && inBuffers.Allocate(fallback) && outBuffers.Allocate(fallback))
+      {
+        maxSpiDataLength = requestedSpiDataLength = fallback;
+        return false;
+      }
+    }
+
+    // Nothing will fit, so we have no buffers and can't talk to the SAM
+    Serial.println("No memory for SPI buffers");
+    inBuffers.Free();
+    outBuffers.Free();
+    requestedSpiDataLength = maxSpiDataLength;
+    return false;
+  }
+
+  // If the SAM has asked for a different data length or for CRCs and there are no messages in the buffers, make the change and tell the SAM that we have done so
+  static void ChangeSettingsIfIdle()
+  {
+    if ((requestedSpiDataLength != maxSpiDataLength || crcRequested)
+        && inBuffers.IsEmpty() && !inBuffers.IsReserved() && !inBuffers.HasHeldBuffers() && outBuffers.IsEmpty() && !outBuffers.IsReserved() && !outBuffers.HasHeldBuffers() && !nakPending)
+    {
+      if (requestedSpiDataLength != maxSpiDataLength)
+      {
+        (void)AllocateBuffers(requestedSpiDataLength);    // if this fails we tell the SAM the length we kept
+        const uint32_t dataLength = maxSpiDataLength;
+        (void)QueueMessage(trTypeInfo | ttSpiDataLengthSet, 0, 0, TransactionBuffer::lastFragment, &dataLength, sizeof(dataLength));
+      }
+      if (crcRequested)
+      {
+        crcRequested = false;
+        sendCrc = true;
+        if (!QueueMessage(trTypeInfo | ttCrcEnabled, 0, 0, TransactionBuffer::lastFragment, nullptr, 0))
+        {
+          sendCrc = false;                // we have no buffers, so the SAM won't hear that we add CRCs
+        }
+      }
+    }
+  }
+
+  // Ask the SAM to send packets again, starting with the one numbered packetNumber. The seq and fragment of the packet that showed us
+  // something was wrong go in the NAK too, for debugging. If the SAM can't match the number, the request the packet belonged to times out,
+  // as it did before we had CRCs.
+  static void SendNak(const TransactionBuffer *bad, uint32_t packetNumber)
+  {
+    if (nakBuffer == nullptr)
+    {
+      return;
+    }
+    const uint32_t ids[3] = { packetNumber, bad->GetSeq(), bad->GetFragment() };
+    nakBuffer->Clear();
+    (void)nakBuffer->SetMessage(trTypeInfo | ttNak, 0, 0, TransactionBuffer::lastFragment, ids, sizeof(ids));
+    nakPending = true;
+  }
+
+  // Once CRCs are in use the SAM numbers its packets, apart from NAKs. After a bad packet the SAM goes back and sends it again with the ones after it,
+  // so drop any packet that we already have, and any that comes before the one we are waiting for, NAKing it again in case our NAK was lost.
+  // Return true if the packet is the next one in sequence.
+  static bool InSequence(const TransactionBuffer *buf)
+  {
+    const uint32_t number = buf->GetPacketNumber();
+    if (samNumberKnown)
+    {
+      const int8_t ahead = (int8_t)(number - expectedSamNumber);
+      if (ahead < 0)
+      {
+        return false;
+      }
+      if (ahead > 0)
+      {
+        SendNak(buf, expectedSamNumber);
+        return false;
+      }
+    }
+    samNumberKnown = true;
+    expectedSamNumber = (number + 1) & 0xFF;
+    return true;
+  }
+
+  // The SAM says that a packet from us was corrupt. Go back and send it again, with any we sent after it.
+  // Packets are matched on their packet number, because info messages and replies all have the same seq and fragment fields.
+  static void ResendFrom(const TransactionBuffer *nak)
+  {
+    size_t length;
+    const uint32_t *ids = static_cast<const uint32_t*>(nak->GetData(length));
+    if (length >= sizeof(uint32_t))
+    {
+      for (size_t i = 0; i < numSentPackets && i < nextResend; ++i)
+      {
+        if (sentPackets[i].buf->GetPacketNumber() == ids[0])
+        {
+          nextResend = i;
+          break;
+        }
+      }
+    }
+  }
+
+  // Record that the SAM has just become ready and start a transfer if we can
+  static void SamReady(uint32_t time)
+  {
+    if (!transport->IsSamReady())
+    {
+      return;                   // we have already done the transfer by polling
+    }
+    if (!readyPending)
+    {
+      readyTime = time;
+      readyPending = true;
+    }
+    DoTransaction();
+  }
+
+  // Update the latency statistics at the start of a transfer
+  static void RecordLatency()
+  {
+    if (readyPending)
+    {
+      readyPending = false;
+      const uint32_t latency = micros() - readyTime;
+      latencyMin = (latencyCount == 0) ? latency : std::min<uint32_t>(latencyMin, latency);
+      latencyMax = std::max<uint32_t>(latencyMax, latency);
+      latencyTotal += latency;
+      ++latencyCount;
+    }
+  }
+
+  void Init(SPITransport& t)
+  {
+    transport = &t;
+    transport->Init();
+    ResetLatencyStats();
+    transport->OnSamReady(SamReady);
+
+    AllocateBuffers(maxSpiFileData);
+    emptyBuffer.Clear();
+    nakBuffer = TransactionBuffer::Allocate(sizeof(uint32_t) * 3);
+    if (nakBuffer == nullptr)
+    {
+      Serial.println("No memory for the SPI NAK buffer, so CRCs are disabled");
+    }
+  }
+
+  // Execute an SPI transaction if possible, by sending the oldest queued message and reading any incoming data into the next free input buffer.
   void DoTransaction()
   {
-    if (digitalRead(SamTfrReadyPin) == HIGH && inBuffer.IsEmpty())
+    if (transport->IsSamReady() && inBuffers.HasFreeBuffer())
     {
+      TransactionBuffer *inBuffer = inBuffers.Reserve();
+      TransactionBuffer *outBuffer;
+      if (nakPending)
+      {
+        outBuffer = nakBuffer;
+      }
+      else if (nextResend < numSentPackets)
+      {
+        outBuffer = sentPackets[nextResend].buf;
+      }
+      else
+      {
+        outBuffer = outBuffers.Peek();
+        if (outBuffer == nullptr)
+        {
+          outBuffer = &emptyBuffer;
+        }
+      }
 #ifdef SPI_DEBUG
-      if (outBuffer.GetOpcode() != 0)
+      if (outBuffer->GetOpcode() != 0)
       {
         Serial.print("Sending ");
-        Serial.println(outBuffer.GetFragment());
+        Serial.println(outBuffer->GetFragment());
       }
       else
       {
         Serial.println("Reading");
       }
 #endif
-      uint32_t dataOutLength = outBuffer.PacketLength();    // number of dwords of data to send
+      uint32_t dataOutLength = outBuffer->PacketLength(outBuffer->HasCrc());    // number of dwords of data to send
    
-      uint32_t *inPointer = reinterpret_cast<uint32_t*>(&inBuffer);
-      uint32_t *outPointer = reinterpret_cast<uint32_t*>(&outBuffer);
+      uint32_t *inPointer = inBuffer->GetPacket();
+      uint32_t *outPointer = outBuffer->GetPacket();
   
-      hspi.beginTransaction();
-      digitalWrite(SamSSPin, LOW);            // assert CS to SAM
-      digitalWrite(EspReqTransferPin, LOW);   // stop asking to transfer data
+      RecordLatency();
+      transport->BeginTransfer();
+      transport->RequestTransfer(false);      // stop asking to transfer data
 
       // Exchange headers
-      hspi.transferDwords(outPointer, inPointer, TransactionBuffer::headerDwords);
+      transport->TransferDwords(outPointer, inPointer, TransactionBuffer::headerDwords);
       outPointer += TransactionBuffer::headerDwords;
       inPointer += TransactionBuffer::headerDwords;
       dataOutLength -= TransactionBuffer::headerDwords;
 
       // See if how much more data we need to read
-      uint32_t dataInLength = inBuffer.PacketLength() - TransactionBuffer::headerDwords;
-      if (dataInLength > maxSpiDataLength/4)
+      uint32_t dataInLength = inBuffer->PacketLength(checkCrc) - TransactionBuffer::headerDwords;
+      const uint32_t maxDataInLength = maxSpiDataLength/4 + ((checkCrc) ? 1 : 0);
+      if (dataInLength > maxDataInLength)
       {
-        dataInLength = maxSpiDataLength/4;
+        dataInLength = maxDataInLength;
         //TODO record that input has been truncated
       }
 
       if (dataInLength != 0 && dataOutLength != 0)
       {
         uint32_t lengthToTransfer = std::min<uint32_t>(dataInLength, dataOutLength);
-        hspi.transferDwords(outPointer, inPointer, lengthToTransfer);
+        transport->TransferDwords(outPointer, inPointer, lengthToTransfer);
         inPointer += lengthToTransfer;
         outPointer += lengthToTransfer;
         dataInLength -= lengthToTransfer;
@@ -201,33 +681,94 @@ namespace SPITransaction
 
       if (dataInLength != 0)
       {
-        hspi.transferDwords(nullptr, inPointer, dataInLength);
+        transport->TransferDwords(nullptr, inPointer, dataInLength);
       }
   
       // Finished receiving, so send any remaining data
       if (dataOutLength != 0)
       {
-        hspi.writeDwords(outPointer, dataOutLength);
+        transport->WriteDwords(outPointer, dataOutLength);
       }
 
-      digitalWrite(SamSSPin, HIGH);     // de-assert CS to SAM to end the transaction and tell SAM the transfer is complete
-      hspi.endTransaction();
+      transport->EndTransfer();
+      ++transactionNumber;
+
+      // Deal with the packet we sent. If we are adding CRCs, keep it in case the SAM NAKs it.
+      if (outBuffer == nakBuffer)
+      {
+        nakBuffer->Clear();
+        nakPending = false;
+      }
+      else if (nextResend < numSentPackets && outBuffer == sentPackets[nextResend].buf)
+      {
+        sentPackets[nextResend].transaction = transactionNumber;
+        ++nextResend;
+      }
+      else if (outBuffer != &emptyBuffer)
+      {
+        if (outBuffer->HasCrc())
+        {
+          sentPackets[numSentPackets].buf = outBuffers.Hold();
+          sentPackets[numSentPackets].transaction = transactionNumber;
+          nextResend = ++numSentPackets;
+        }
+        else
+        {
+          outBuffers.Release();
+        }
+      }
 
       // Check for valid data before we append a null
-      if (inBuffer.IsReady())
+      if (inBuffer->IsReady())
       {
-        if (inBuffer.IsValid())
+        const bool good = inBuffer->IsValid() && (!checkCrc || inBuffer->CheckCrc());
+        if (good && checkCrc && (inBuffer->GetOpcode() & 0xFF0000FF) != (trTypeInfo | ttSamNak) && !InSequence(inBuffer))
+        {
+          inBuffers.Cancel();               // we already have it, or we are waiting for the SAM to send an earlier one again
+        }
+        else if (good)
         { 
-          inBuffer.AppendNull();            // add a null terminator to the incoming data to simplify processing
+          consecutiveCrcErrors = 0;
+          if (goodPacketsAtLowerSpeed != 0 && ++goodPacketsAtLowerSpeed > crcRetryGoodPackets)
+          {
+            goodPacketsAtLowerSpeed = 0;
+            transport->SetFrequency(spiFrequencyWithCrc);     // the noise may have gone, so try the higher speed again
+          }
+          inBuffer->AppendNull();            // add a null terminator to the incoming data to simplify processing
 #ifdef SPI_DEBUG
           Serial.print("Good message rec'd:");
           for (size_t i = 0; i < 10; ++i)
           {
             Serial.print(" ");
-            Serial.print(*((const uint32 *)&inBuffer + i), HEX);
+            Serial.print(inBuffer->GetPacket()[i], HEX);
           }
           Serial.println();
 #endif
+          if ((inBuffer->GetOpcode() & 0xFF0000FF) == (trTypeInfo | ttSetSpiDataLength))
+          {
+            // The SAM wants to change the packet size. Handle this here because the buffers must not be in use when we change it.
+            size_t length;
+            const uint32_t *data = static_cast<const uint32_t*>(inBuffer->GetData(length));
+            if (length >= sizeof(uint32_t))
+            {
+              requestedSpiDataLength = std::min<uint32_t>(std::max<uint32_t>(*data, minNegotiatedSpiFileData), maxNegotiatedSpiFileData) & ~3u;
+            }
+            inBuffers.Cancel();
+          }
+          else if ((inBuffer->GetOpcode() & 0xFF0000FF) == (trTypeInfo | ttEnableCrc))
+          {
+            crcRequested = !sendCrc && nakBuffer != nullptr;     // we can't add CRCs unless we can NAK bad packets
+            inBuffers.Cancel();
+          }
+          else if ((inBuffer->GetOpcode() & 0xFF0000FF) == (trTypeInfo | ttSamNak))
+          {
+            ResendFrom(inBuffer);
+            inBuffers.Cancel();
+          }
+          else
+          {
+            inBuffers.Commit();
+          }
         }
         else
         {
@@ -235,111 +776,196 @@ namespace SPITransaction
           for (size_t i = 0; i < 10; ++i)
           {
             Serial.print(" ");
-            Serial.print(*((const uint32 *)&inBuffer + i), HEX);
+            Serial.print(inBuffer->GetPacket()[i], HEX);
           }
           Serial.println();
-          inBuffer.Clear();
+          if (checkCrc)
+          {
+            // Only packets that are corrupt count towards dropping the clock speed, not the ones that InSequence NAKs because an earlier one was lost
+            if (goodPacketsAtLowerSpeed != 0)
+            {
+              goodPacketsAtLowerSpeed = 1;              // start the run of good packets again
+            }
+            else if (++consecutiveCrcErrors == maxConsecutiveCrcErrors)
+            {
+              goodPacketsAtLowerSpeed = 1;
+              transport->SetFrequency(spiFrequency);    // the link is too noisy at the higher speed
+            }
+            SendNak(inBuffer, (samNumberKnown) ? expectedSamNumber : inBuffer->GetPacketNumber());
+          }
+          inBuffers.Cancel();
         }
       }
-#ifdef SPI_DEBUG
       else
       {
+#ifdef SPI_DEBUG
         Serial.println("No message rec'd");
-      }
 #endif
-//      if (inBuffer.DataWasTaken())
+        inBuffers.Cancel();
+      }
+
+      // Packets that the SAM has had its chance to NAK have got through.
+      // Once the SAM has got the packet that says we add CRCs, it adds them too, and we can use the higher clock speed.
+      while (nextResend != 0 && sentPackets[0].transaction != transactionNumber)
       {
-        outBuffer.Clear();
+        if ((sentPackets[0].buf->GetOpcode() & 0xFF0000FF) == (trTypeInfo | ttCrcEnabled) && !checkCrc)
+        {
+          checkCrc = true;
+          transport->SetFrequency(spiFrequencyWithCrc);
+        }
+        outBuffers.Unhold(sentPackets[0].buf);
+        for (size_t i = 1; i < numSentPackets; ++i)
+        {
+          sentPackets[i - 1] = sentPackets[i];
+        }
+        --numSentPackets;
+        --nextResend;
       }
+
+      ChangeSettingsIfIdle();
+      RequestTransferIfReady();
     }
   }
 
-  // Schedule a informational message to be sent. Returns false if there is already a message scheduled.
+  // Schedule a informational message to be sent. Returns false if there is no free output buffer.
   bool ScheduleInfoMessage(uint32_t tt, const void *dataToSend, uint32_t length)
   {
-    bool ok = outBuffer.SetMessage(tt | trTypeInfo, 0, TransactionBuffer::lastFragment, dataToSend, length);
-    if (ok && inBuffer.IsEmpty())
-    {
-      digitalWrite(EspReqTransferPin, HIGH);
-    }
-    return ok;
+    return QueueMessage(tt | trTypeInfo, 0, 0, TransactionBuffer::lastFragment, dataToSend, length);
   }
 
-  // Schedule a request message to be sent. Returns false if there is already a message scheduled.
-  bool ScheduleRequestMessage(uint32_t tt, uint32_t ip, bool last, const void *dataToSend, uint32_t length)
+  // Schedule a request message to be sent. Returns false if there is no free output buffer.
+  bool ScheduleRequestMessage(uint32_t tt, uint32_t ip, uint32_t seq, bool last, const void *dataToSend, uint32_t length)
   {
-    bool ok = outBuffer.SetMessage(tt | trTypeRequest, ip, (last) ? TransactionBuffer::lastFragment : 0, dataToSend, length);
-    if (ok && inBuffer.IsEmpty())
-    {
-      digitalWrite(EspReqTransferPin, HIGH);
-    }
-    return ok;
+    return QueueMessage(tt | trTypeRequest, ip, seq, (last) ? TransactionBuffer::lastFragment : 0, dataToSend, length);
   }
 
-  // Schedule a reply message to be sent. Returns false if there is already a message scheduled.
+  // Schedule a reply message to be sent. Returns false if there is no free output buffer.
   bool ScheduleReplyMessage(uint32_t tt, const void *dataToSend, uint32_t length)
   {
-    bool ok = outBuffer.SetMessage(tt | trTypeResponse, 0, TransactionBuffer::lastFragment, dataToSend, length);
-    if (ok && inBuffer.IsEmpty())
-    {
-      digitalWrite(EspReqTransferPin, HIGH);
-    }
-    return ok;
+    return QueueMessage(tt | trTypeResponse, 0, 0, TransactionBuffer::lastFragment, dataToSend, length);
   }
 
-  // Get the address of the data buffer ready to fill in postdata
+  // Reserve the next free output buffer and get the address of its data area ready to fill in postdata.
+  // Calling this again before the postdata message has been scheduled returns the same buffer.
   bool GetBufferAddress(uint8_t**p, size_t& length)
   {
-    return outBuffer.GetBufferAddress(p, length);
+    TransactionBuffer *buf = outBuffers.Reserve();
+    return buf != nullptr && buf->GetBufferAddress(p, length);
   }
 
-  // Schedule a postdata message
-  void SchedulePostdataMessage(uint32_t tt, uint32_t ip, size_t length, uint32_t fragment, bool last)
+  // Schedule a postdata message in the buffer reserved by GetBufferAddress
+  void SchedulePostdataMessage(uint32_t tt, uint32_t ip, uint32_t seq, size_t length, uint32_t fragment, bool last)
   {
-    bool ok = outBuffer.SetMessage(trTypeRequest | tt, ip, (last) ? fragment | TransactionBuffer::lastFragment : fragment, nullptr, length);
-    if (ok && inBuffer.IsEmpty())
+    if (outBuffers.IsReserved())
     {
-      digitalWrite(EspReqTransferPin, HIGH);
+      TransactionBuffer *buf = outBuffers.Reserve();
+      if (buf->SetMessage(trTypeRequest | tt, ip, seq, (last) ? fragment | TransactionBuffer::lastFragment : fragment, nullptr, length))
+      {
+        outBuffers.Commit();
+        RequestTransferIfReady();
+      }
     }
   }
 
+  // Release the buffer reserved by GetBufferAddress without sending anything
+  void CancelPostdataMessage()
+  {
+    outBuffers.Cancel();
+  }
+
   // Return true if we have received incoming data
   bool DataReady()
   {
-    return inBuffer.IsReady();
+    return !inBuffers.IsEmpty();
   }
 
   // Get the incoming opcode and transaction type
   uint32_t GetOpcode()
   {
-    return inBuffer.GetOpcode() & 0xFF0000FF;
+    const TransactionBuffer *inBuffer = inBuffers.Peek();
+    return (inBuffer != nullptr) ? inBuffer->GetOpcode() & 0xFF0000FF : 0;
   }
 
   // Get the incoming fragment number
   uint32_t GetFragment(bool& isLast)
   {
-    uint32_t fragment = inBuffer.GetFragment();
+    const TransactionBuffer *inBuffer = inBuffers.Peek();
+    uint32_t fragment = (inBuffer != nullptr) ? inBuffer->GetFragment() : 0;
     isLast = (fragment & TransactionBuffer::lastFragment) != 0;
     return fragment & ~TransactionBuffer::lastFragment;
   }
 
+  // Get the number of transfers started after the SAM signalled that it was ready, and the minimum, maximum and average delay in microseconds
+  void GetLatencyStats(uint32_t& count, uint32_t& minMicros, uint32_t& maxMicros, uint32_t& averageMicros)
+  {
+    count = latencyCount;
+    minMicros = latencyMin;
+    maxMicros = latencyMax;
+    averageMicros = (latencyCount == 0) ? 0 : latencyTotal/latencyCount;
+  }
+
+  // Clear the latency statistics
+  void ResetLatencyStats()
+  {
+    latencyCount = latencyMin = latencyMax = latencyTotal = 0;
+  }
+
+  // Get the capability flags to put in our network info. We can always match replies to requests by seq, but we can only add CRCs
+  // if we have a buffer to NAK bad packets from.
+  uint32_t GetCapabilities()
+  {
+    return ((nakBuffer != nullptr) ? capCrc : 0) | capPipelining;
+  }
+
+  // Get the maximum amount of data that an SPI packet can currently carry
+  uint32_t GetMaxDataLength()
+  {
+    return maxSpiDataLength;
+  }
+
+  // Get the sequence number of the request that the incoming message is a reply to
+  uint32_t GetSeq()
+  {
+    const TransactionBuffer *inBuffer = inBuffers.Peek();
+    return (inBuffer != nullptr) ? inBuffer->GetSeq() : 0;
+  }
+
   // Get the length of incoming data and return a pointer to the data
   const void *GetData(size_t& length)
   {
-    return inBuffer.GetData(length);
+    const TransactionBuffer *inBuffer = inBuffers.Peek();
+    if (inBuffer == nullptr)
+    {
+      length = 0;
+      return nullptr;
+    }
+    return inBuffer->GetData(length);
   }
 
-  // Flag the incoming data as taken
+  // Flag the incoming data as taken, freeing its buffer
   void IncomingDataTaken()
   {
-    inBuffer.Clear();
-    if (outBuffer.IsReady())
-    {
-      digitalWrite(EspReqTransferPin, HIGH);
-    }
+    inBuffers.Release();
+    ChangeSettingsIfIdle();
+    RequestTransferIfReady();
+  }
+
+  // Flag the incoming data as taken but keep its buffer, so that the SAM can send the next message while we are still using this one
+  IncomingMessage HoldIncoming()
+  {
+    IncomingMessage msg = inBuffers.Hold();
+    RequestTransferIfReady();
+    return msg;
+  }
+
+  // Release a message returned by HoldIncoming, freeing its buffer
+  void ReleaseIncoming(IncomingMessage msg)
+  {
+    inBuffers.Unhold(msg);
+    ChangeSettingsIfIdle();
+    RequestTransferIfReady();
   }
 
 };    // end namespace
 
 // End
-
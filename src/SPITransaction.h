@@ -5,13 +5,14 @@
 
 #include <Arduino.h>
 #include <stdlib.h>
+#include "SPITransport.h"
 
 namespace SPITransaction
 {
   // Transaction type field bits
   // Byte 3 (MSB) is the packet type.
   // Byte 2 holds flags
-  // Byte 1 is currently unused
+  // Byte 1 is the packet number if the packet carries a CRC, which a NAK for it returns
   // Byte 0 is the opcode if the packet is a request or info message, or the error code if it is a response.
 
   // Packet types
@@ -28,11 +29,19 @@ namespace SPITransaction
   // Opcodes for info messages from web server to Duet
   const uint32_t ttNetworkInfoOld = 0x70;             // used to pass network info to Duet when first connected
   const uint32_t ttNetworkInfo = 0x71;                // used to pass network info to Duet when first connected
+  const uint32_t ttSpiDataLengthSet = 0x72;           // used to confirm to the Duet that we have changed the maximum SPI packet data length
+  const uint32_t ttCrcEnabled = 0x73;                 // used to confirm to the Duet that this and all later packets from us carry a CRC
+  const uint32_t ttNak = 0x74;                        // tells the Duet to go back and send again from a packet that was corrupt or missing; data is its packet number,
+                                                      // then the seq and fragment fields of the packet that showed it. NAKs don't take a packet number of their own.
 
   // Opcodes for requests and info from Duet to web server
   const uint32_t ttNetworkConfig = 0x80;              // set network configuration (SSID, password etc.)
   const uint32_t ttNetworkEnable = 0x81;              // enable WiFi
   const uint32_t ttGetNetworkInfo = 0x83;             // get IP address etc.
+  const uint32_t ttSetSpiDataLength = 0x84;           // set the maximum SPI packet data length, within the range we gave in our network info
+  const uint32_t ttEnableCrc = 0x85;                  // add a CRC to each packet, if we said we could in our network info
+  const uint32_t ttSamNak = 0x86;                     // go back and send again from a packet of ours that was corrupt or missing; data is its packet number
+  const uint32_t ttEnablePipelining = 0x87;           // the Duet returns the seq of each rr_ request in its reply, if we said we could use it; data is how many requests it can take at once
 
   // Opcodes for info messages from Duet to server
   const uint32_t ttMachineConfigChanged = 0x82;       // notify server that the machine configuration has changed significantly
@@ -42,26 +51,40 @@ namespace SPITransaction
   const uint32_t rcJson = 0x00010000;
   const uint32_t rcKeepOpen = 0x00020000;
 
-  // Initialise
-  void Init();
+  // Capability flags in our network info
+  const uint32_t capCrc = 0x00000001;                 // we can add a CRC32 to each packet and resend packets that the Duet NAKs
+  const uint32_t capPipelining = 0x00000002;          // we can have several rr_ requests at the Duet at once and match its replies to them by seq
+
+  // Content length in the first fragment of a rr_ reply when the SAM doesn't know how long the reply will be
+  const uint32_t contentLengthUnknown = 0xFFFFFFFF;
+
+  class TransactionBuffer;
+  typedef const TransactionBuffer *IncomingMessage;       // handle to an incoming message that is being held
+
+  // Initialise, using the specified transport to talk to the SAM
+  void Init(SPITransport& t);
   
-  // Execute an SPI transaction if everything is ready
+  // Execute an SPI transaction if everything is ready.
+  // This is called automatically when the SAM signals that it is ready, but must also be called regularly in case we were not ready at that time.
   void DoTransaction();
 
-  // Schedule a informational message to be sent. Returns false if there is already a message scheduled.
+  // Schedule a informational message to be sent. Returns false if there is no free output buffer.
   bool ScheduleInfoMessage(uint32_t tt, const void *dataToSend, uint32_t length);
 
-  // Schedule a request message to be sent. Returns false if there is already a message scheduled.
-  bool ScheduleRequestMessage(uint32_t tt, uint32_t ip, bool last, const void *dataToSend, uint32_t length);
+  // Schedule a request message to be sent. The SAM returns the sequence number in its reply. Returns false if there is no free output buffer.
+  bool ScheduleRequestMessage(uint32_t tt, uint32_t ip, uint32_t seq, bool last, const void *dataToSend, uint32_t length);
 
-  // Schedule a reply message to be sent. Returns false if there is already a message scheduled.
+  // Schedule a reply message to be sent. Returns false if there is no free output buffer.
   bool ScheduleReplyMessage(uint32_t tt, const void *dataToSend, uint32_t length);
 
-  // Get the address of the data buffer ready to fill in postdata
+  // Reserve the next free output buffer and get the address of its data area ready to fill in postdata
   bool GetBufferAddress(uint8_t**p, size_t& length);
 
-  // Schedule a postdata message
-  void SchedulePostdataMessage(uint32_t tt, uint32_t ip, size_t length, uint32_t fragment, bool last);
+  // Schedule a postdata message in the buffer reserved by GetBufferAddress
+  void SchedulePostdataMessage(uint32_t tt, uint32_t ip, uint32_t seq, size_t length, uint32_t fragment, bool last);
+
+  // Release the buffer reserved by GetBufferAddress without sending anything
+  void CancelPostdataMessage();
   
   // Return true if we have received incoming data
   bool DataReady();
@@ -72,11 +95,33 @@ namespace SPITransaction
   // Get the incoming fragment number
   uint32_t GetFragment(bool& isLast);
 
+  // Get the number of transfers started after the SAM signalled that it was ready, and the minimum, maximum and average delay in microseconds
+  void GetLatencyStats(uint32_t& count, uint32_t& minMicros, uint32_t& maxMicros, uint32_t& averageMicros);
+
+  // Clear the latency statistics
+  void ResetLatencyStats();
+
+  // Get the capability flags to put in our network info
+  uint32_t GetCapabilities();
+
+  // Get the maximum amount of data that an SPI packet can currently carry
+  uint32_t GetMaxDataLength();
+
+  // Get the sequence number of the request that the incoming message is a reply to. Older SAM firmware always returns zero.
+  uint32_t GetSeq();
+
   // Get the length of incoming data and return a pointer to the data
   const void *GetData(size_t& length);
 
-  // Flag the incoming data as taken
+  // Flag the incoming data as taken, freeing its buffer
   void IncomingDataTaken();
+
+  // Flag the incoming data as taken but keep its buffer, so that the SAM can send the next message while we are still using this one.
+  // The data pointer returned by GetData remains valid until the returned handle is passed to ReleaseIncoming.
+  IncomingMessage HoldIncoming();
+
+  // Release a message returned by HoldIncoming, freeing its buffer
+  void ReleaseIncoming(IncomingMessage msg);
 };
 
 #endif
@@ -0,0 +1,46 @@
+// Interface to the physical link between the ESP8266 and the SAM.
+// The SPI transaction manager does all its I/O through this, so that it can be run against something other than the real hardware.
+
+#ifndef _SPITRANSPORT_H_INCLUDED
+#define _SPITRANSPORT_H_INCLUDED
+
+#include <Arduino.h>
+#include <stdlib.h>
+
+class SPITransport
+{
+public:
+  // Type of function called when the SAM becomes ready, passed the time in microseconds at which it did so
+  typedef void (*ReadyCallback)(uint32_t readyTime);
+
+  virtual ~SPITransport() {}
+
+  // Set up the pins and the SPI channel
+  virtual void Init() = 0;
+
+  // Return true if the SAM is ready to execute an SPI transaction
+  virtual bool IsSamReady() = 0;
+
+  // Register a function to be called when the SAM becomes ready. The transport calls it from task context, not from inside an interrupt.
+  virtual void OnSamReady(ReadyCallback callback) = 0;
+
+  // Tell the SAM whether we want to send it something
+  virtual void RequestTransfer(bool wanted) = 0;
+
+  // Start a transaction by asserting SS to the SAM
+  virtual void BeginTransfer() = 0;
+
+  // End a transaction by de-asserting SS, which tells the SAM that the transfer is complete
+  virtual void EndTransfer() = 0;
+
+  // Exchange dwords with the SAM. If out is null then dummy data is sent; if in is null then the incoming data is discarded.
+  virtual void TransferDwords(uint32_t *out, uint32_t *in, uint32_t numDwords) = 0;
+
+  // Send dwords to the SAM, discarding the incoming data
+  virtual void WriteDwords(uint32_t *out, uint32_t numDwords) = 0;
+
+  // Change the SPI clock frequency, between transactions
+  virtual void SetFrequency(uint32_t frequency) = 0;
+};
+
+#endif